@@ -0,0 +1,58 @@
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <map>
+#include "admission.h"
+using namespace std;
+
+static int MAX_SESSIONS = 0;  // 0 is unlimited
+static int MAX_PER_IP = 0;
+static int SESSIONS = 0;
+static map<uint32_t, int> PER_IP; // only IPs with open sessions
+static pthread_mutex_t admission_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void admission_init(int max_sessions, int max_per_ip){
+	MAX_SESSIONS = max_sessions;
+	MAX_PER_IP = max_per_ip;
+}
+
+// counts a new session, false if it would exceed a cap
+bool admission_acquire(uint32_t ip){
+	bool admitted = false;
+	pthread_mutex_lock(&admission_mutex);
+	if (MAX_SESSIONS == 0 || SESSIONS < MAX_SESSIONS) {
+		int& count = PER_IP[ip];
+		if (MAX_PER_IP == 0 || count < MAX_PER_IP) {
+			count++;
+			SESSIONS++;
+			admitted = true;
+		} else if (count == 0) {
+			PER_IP.erase(ip);
+		}
+	}
+	pthread_mutex_unlock(&admission_mutex);
+	return admitted;
+}
+
+void admission_release(uint32_t ip){
+	pthread_mutex_lock(&admission_mutex);
+	SESSIONS--;
+	map<uint32_t, int>::iterator it = PER_IP.find(ip);
+	if (it != PER_IP.end() && --it->second == 0) PER_IP.erase(it);
+	pthread_mutex_unlock(&admission_mutex);
+}
+
+// best effort reply that never blocks the accept loop, then close
+void admission_reject(int fd, const char* response){
+	send(fd, response, strlen(response), MSG_DONTWAIT | MSG_NOSIGNAL);
+	close(fd);
+}
+
+// sessions currently admitted
+int admission_active(){
+	pthread_mutex_lock(&admission_mutex);
+	int active = SESSIONS;
+	pthread_mutex_unlock(&admission_mutex);
+	return active;
+}
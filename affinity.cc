@@ -0,0 +1,139 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include "affinity.h"
+#include "metrics.h"
+using namespace std;
+
+static const char* ROLE_NAMES[AFFINITY_ROLES] = {"accept", "worker", "delivery", "auth"};
+
+static bool RUNNING = false;
+static cpu_set_t ORIGINAL;            // of the process at startup
+static cpu_set_t ROLES[AFFINITY_ROLES];
+static bool ROLE_SET[AFFINITY_ROLES];
+static vector<cpu_set_t> WORKERS;     // worker CPUs per NUMA node, empty for nodes without any
+static vector<int> NODE_OF;           // node of each CPU, -1 if not known
+static atomic<unsigned> NEXT_NODE(0);
+static int M_LOCAL, M_SPREAD;
+
+// "0-3,8" into set, false if malformed
+static bool parse_cpus(const string& list, cpu_set_t* set){
+	CPU_ZERO(set);
+	const char* p = list.c_str();
+	while (*p != '\0') {
+		char* end;
+		long first = strtol(p, &end, 10), last = first;
+		if (end == p) return false;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p) return false;
+		}
+		if (first < 0 || last < first || last >= CPU_SETSIZE) return false;
+		for (long cpu = first; cpu <= last; cpu++) CPU_SET(cpu, set);
+		if (*end == ',') end++;
+		else if (*end != '\0') return false;
+		p = end;
+	}
+	return CPU_COUNT(set) > 0;
+}
+
+// reads /sys/devices/system/node; one node with every CPU if it is not there
+static void read_nodes(vector<cpu_set_t>& nodes){
+	NODE_OF.assign(CPU_SETSIZE, -1);
+	DIR* d = opendir("/sys/devices/system/node");
+	struct dirent* ent;
+	while (d != NULL && (ent = readdir(d)) != NULL) {
+		if (strncmp(ent->d_name, "node", 4) != 0 || !isdigit(ent->d_name[4])) continue;
+		int node = atoi(ent->d_name + 4);
+		ifstream in(string("/sys/devices/system/node/") + ent->d_name + "/cpulist");
+		string list;
+		cpu_set_t cpus;
+		if (!getline(in, list) || !parse_cpus(list, &cpus)) continue; // a node with memory only
+		if (node >= nodes.size()) nodes.resize(node + 1);
+		nodes[node] = cpus;
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &cpus)) NODE_OF[cpu] = node;
+		}
+	}
+	if (d != NULL) closedir(d);
+	if (nodes.empty()) {
+		nodes.resize(1);
+		CPU_ZERO(&nodes[0]);
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			CPU_SET(cpu, &nodes[0]);
+			NODE_OF[cpu] = 0;
+		}
+	}
+}
+
+void affinity_init(const char* spec){
+	M_LOCAL = metrics_counter("affinity_sessions_local_total", "Sessions pinned to the node that received the connection.");
+	M_SPREAD = metrics_counter("affinity_sessions_spread_total", "Sessions pinned to a node in turn, none of the worker CPUs being on the receiving node.");
+
+	sched_getaffinity(0, sizeof(ORIGINAL), &ORIGINAL);
+	string rest = spec;
+	while (!rest.empty()) {
+		size_t colon = rest.find(':');
+		string item = rest.substr(0, colon);
+		rest = colon == string::npos ? "" : rest.substr(colon + 1);
+		size_t eq = item.find('=');
+		int role = 0;
+		while (role < AFFINITY_ROLES && (eq == string::npos || item.compare(0, eq, ROLE_NAMES[role]) != 0)) role++;
+		cpu_set_t usable;
+		if (role == AFFINITY_ROLES || !parse_cpus(item.substr(eq + 1), &ROLES[role])) {
+			cerr << "malformed affinity spec " << item << "\r\n";
+			exit(1);
+		}
+		CPU_AND(&usable, &ROLES[role], &ORIGINAL);
+		if (!CPU_EQUAL(&usable, &ROLES[role])) {
+			cerr << "affinity spec " << item << " has CPUs the process cannot run on\r\n";
+			exit(1);
+		}
+		ROLE_SET[role] = true;
+	}
+
+	// the worker CPUs split by node
+	vector<cpu_set_t> nodes;
+	read_nodes(nodes);
+	WORKERS.resize(nodes.size());
+	int found = 0;
+	for (int node = 0; node < nodes.size(); node++) {
+		CPU_AND(&WORKERS[node], &nodes[node], ROLE_SET[AFFINITY_WORKER] ? &ROLES[AFFINITY_WORKER] : &ORIGINAL);
+		found += CPU_COUNT(&WORKERS[node]);
+	}
+	if (found == 0) WORKERS[0] = ROLE_SET[AFFINITY_WORKER] ? ROLES[AFFINITY_WORKER] : ORIGINAL; // CPUs not in sysfs
+	RUNNING = true;
+}
+
+void affinity_pin(int role){
+	if (!RUNNING) return;
+	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), ROLE_SET[role] ? &ROLES[role] : &ORIGINAL);
+}
+
+void affinity_pin_session(int fd){
+	if (!RUNNING) return;
+	int cpu = -1;
+	socklen_t len = sizeof(cpu);
+	getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len); // fails for unix sockets
+	int node = cpu >= 0 && cpu < CPU_SETSIZE ? NODE_OF[cpu] : -1;
+	if (node >= 0 && CPU_COUNT(&WORKERS[node]) > 0) {
+		metrics_add(M_LOCAL, 1);
+	} else {
+		// the next node with worker CPUs
+		do {
+			node = NEXT_NODE++ % WORKERS.size();
+		} while (CPU_COUNT(&WORKERS[node]) == 0);
+		metrics_add(M_SPREAD, 1);
+	}
+	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &WORKERS[node]);
+}
@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <deque>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+#include "auth.h"
+#include "affinity.h"
+#include "metrics.h"
+using namespace std;
+
+const int MAC_SIZE = 32; // HMAC-SHA256 of the cache
+
+struct Credential {
+	int iterations;
+	string salt;
+	string hash;
+};
+
+// a password waiting for an auth thread
+struct Request {
+	string user;
+	string password;
+	bool ok;
+	bool done;
+};
+
+// a password verified lately, as HMAC(CACHE_KEY, user NUL password)
+struct Cached {
+	unsigned char mac[MAC_SIZE];
+	time_t expires;
+};
+
+static map<string, Credential> CREDENTIALS; // read only after auth_init()
+static map<string, Cached> CACHE;
+static deque<Request*> PENDING;
+static unsigned char CACHE_KEY[MAC_SIZE];  // random, so the cache is of no use outside the process
+static bool RUNNING = false;
+static pthread_mutex_t AUTH_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t QUEUED = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t VERIFIED = PTHREAD_COND_INITIALIZER;
+static int M_CHECKS, M_CACHE_HITS, M_FAILURES, M_KDF;
+
+static void* auth_thread(void* arg);
+
+// hex to bytes, false if it is not even length hex
+static bool unhex(const string& hex, string& bytes){
+	if (hex.length() % 2 != 0 || hex.empty()) return false;
+	bytes.clear();
+	for (size_t i = 0; i < hex.length(); i += 2) {
+		if (!isxdigit(hex[i]) || !isxdigit(hex[i + 1])) return false;
+		char pair[3] = {hex[i], hex[i + 1], '\0'};
+		bytes += (char)strtol(pair, NULL, 16);
+	}
+	return true;
+}
+
+void auth_init(const char* path, int threads){
+	M_CHECKS = metrics_counter("auth_checks_total", "Passwords checked.");
+	M_CACHE_HITS = metrics_counter("auth_cache_hits_total", "Passwords accepted from the cache, without the KDF.");
+	M_FAILURES = metrics_counter("auth_failures_total", "Passwords refused.");
+	M_KDF = metrics_histogram("auth_kdf_duration_seconds", "Time to derive and compare one password hash.", NULL, NULL);
+
+	ifstream in(path);
+	if (!in) {
+		cerr << "cannot open password file\r\n";
+		exit(2);
+	}
+	string line;
+	for (int n = 1; getline(in, line); n++) {
+		if (line.empty() || line[0] == '#') continue;
+		// user:$pbkdf2-sha256$iterations$salt$hash
+		size_t colon = line.find(':');
+		const char* scheme = "$pbkdf2-sha256$";
+		Credential c;
+		string fields = colon != string::npos ? line.substr(colon + 1) : "";
+		size_t salt = fields.find('$', strlen(scheme));
+		size_t hash = salt != string::npos ? fields.find('$', salt + 1) : string::npos;
+		if (colon == 0 || fields.compare(0, strlen(scheme), scheme) != 0 || hash == string::npos
+				|| (c.iterations = atoi(fields.c_str() + strlen(scheme))) <= 0
+				|| !unhex(fields.substr(salt + 1, hash - salt - 1), c.salt) || !unhex(fields.substr(hash + 1), c.hash)) {
+			cerr << "malformed line " << n << " in password file\r\n";
+			exit(2);
+		}
+		CREDENTIALS[line.substr(0, colon)] = c;
+	}
+	RAND_bytes(CACHE_KEY, MAC_SIZE);
+
+	RUNNING = true;
+	for (int i = 0; i < threads; i++) {
+		pthread_t thread;
+		pthread_create(&thread, NULL, auth_thread, NULL);
+		pthread_detach(thread);
+	}
+}
+
+static void cache_mac(const string& user, const string& password, unsigned char* mac){
+	string key = user + '\0' + password;
+	unsigned int len = MAC_SIZE;
+	HMAC(EVP_sha256(), CACHE_KEY, MAC_SIZE, (const unsigned char*)key.data(), key.length(), mac, &len);
+}
+
+bool auth_check(const string& user, const string& password){
+	metrics_add(M_CHECKS, 1);
+	if (!RUNNING) {
+		bool ok = password == DEFAULT_PASSWORD;
+		if (!ok) metrics_add(M_FAILURES, 1);
+		return ok;
+	}
+
+	unsigned char mac[MAC_SIZE];
+	cache_mac(user, password, mac);
+	time_t now = time(0);
+	pthread_mutex_lock(&AUTH_LOCK);
+	map<string, Cached>::iterator it = CACHE.find(user);
+	if (it != CACHE.end() && it->second.expires > now && CRYPTO_memcmp(it->second.mac, mac, MAC_SIZE) == 0) {
+		pthread_mutex_unlock(&AUTH_LOCK);
+		metrics_add(M_CACHE_HITS, 1);
+		return true;
+	}
+
+	// wait for an auth thread
+	Request request = {user, password, false, false};
+	PENDING.push_back(&request);
+	pthread_cond_signal(&QUEUED);
+	while (!request.done) pthread_cond_wait(&VERIFIED, &AUTH_LOCK);
+
+	if (request.ok) {
+		// expired entries go when the cache is full; if it still is, the
+		// password is not remembered
+		if (CACHE.size() >= AUTH_CACHE_SIZE && CACHE.find(user) == CACHE.end()) {
+			for (it = CACHE.begin(); it != CACHE.end();) {
+				if (it->second.expires <= now) CACHE.erase(it++);
+				else it++;
+			}
+		}
+		if (CACHE.size() < AUTH_CACHE_SIZE || CACHE.find(user) != CACHE.end()) {
+			Cached& cached = CACHE[user];
+			memcpy(cached.mac, mac, MAC_SIZE);
+			cached.expires = now + AUTH_CACHE_TTL;
+		}
+	} else {
+		CACHE.erase(user); // a changed password is not accepted with the old one
+		metrics_add(M_FAILURES, 1);
+	}
+	pthread_mutex_unlock(&AUTH_LOCK);
+	return request.ok;
+}
+
+static void* auth_thread(void* arg){
+	affinity_pin(AFFINITY_AUTH);
+	pthread_mutex_lock(&AUTH_LOCK);
+	while (true) {
+		while (PENDING.empty()) pthread_cond_wait(&QUEUED, &AUTH_LOCK);
+		Request* request = PENDING.front();
+		PENDING.pop_front();
+		pthread_mutex_unlock(&AUTH_LOCK);
+
+		// an unknown user costs no KDF, USER tells whether the mailbox exists
+		bool ok = false;
+		map<string, Credential>::iterator it = CREDENTIALS.find(request->user);
+		if (it != CREDENTIALS.end()) {
+			int64_t start = metrics_now();
+			Credential& c = it->second;
+			string derived(c.hash.length(), '\0');
+			ok = PKCS5_PBKDF2_HMAC(request->password.data(), request->password.length(),
+				(const unsigned char*)c.salt.data(), c.salt.length(), c.iterations, EVP_sha256(),
+				derived.length(), (unsigned char*)&derived[0]) == 1
+				&& CRYPTO_memcmp(derived.data(), c.hash.data(), derived.length()) == 0;
+			metrics_observe(M_KDF, metrics_now() - start);
+		}
+
+		pthread_mutex_lock(&AUTH_LOCK);
+		request->ok = ok;
+		request->done = true;
+		pthread_cond_broadcast(&VERIFIED);
+	}
+	return NULL;
+}
@@ -0,0 +1,130 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+
+#include "bench.h"
+
+// Parses the options shared by all benchmark drivers:
+//   -n <max>   largest synthetic mailbox in messages (default 100000)
+//   -m <min>   smallest synthetic mailbox in messages (default 10)
+//   -l <lines> body lines per synthetic message (default 10)
+//   -t <secs>  minimum measured time per data point (default 0.2)
+
+void parseBenchArgs(struct benchConfig *cfg, int argc, char *argv[])
+{
+  cfg->minMessages = 10;
+  cfg->maxMessages = 100000;
+  cfg->bodyLines = 10;
+  cfg->minSeconds = 0.2;
+
+  int c;
+  while ((c = getopt(argc, argv, "n:m:l:t:")) != -1) {
+    switch (c) {
+    case 'n': cfg->maxMessages = atoi(optarg); break;
+    case 'm': cfg->minMessages = atoi(optarg); break;
+    case 'l': cfg->bodyLines = atoi(optarg); break;
+    case 't': cfg->minSeconds = atof(optarg); break;
+    default:
+      panic("Syntax: %s [-n max messages] [-m min messages] [-l body lines] [-t seconds]", argv[0]);
+    }
+  }
+  if (cfg->minMessages < 1 || cfg->maxMessages < cfg->minMessages)
+    panic("Invalid mailbox size range %d..%d", cfg->minMessages, cfg->maxMessages);
+}
+
+double nowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void benchStart(struct benchTimer *t, struct benchConfig *cfg)
+{
+  t->ops = 0;
+  t->elapsedNs = 0;
+  t->minNs = cfg->minSeconds * 1e9;
+  t->startNs = nowNs();
+}
+
+// Counts one finished operation. We keep going until at least minSeconds have
+// passed, and always measure at least one operation.
+
+bool benchDone(struct benchTimer *t)
+{
+  t->ops++;
+  t->elapsedNs = nowNs() - t->startNs;
+  return t->elapsedNs >= t->minNs;
+}
+
+void report(const char *bench, const char *param, long n, struct benchTimer *t, long bytesPerOp)
+{
+  double nsPerOp = t->elapsedNs / t->ops;
+  double mbPerSec = bytesPerOp > 0 ? (bytesPerOp / 1e6) / (nsPerOp / 1e9) : 0;
+  printf("{\"bench\":\"%s\",\"%s\":%ld,\"ops\":%ld,\"ns_per_op\":%.1f,\"bytes_per_op\":%ld,\"mb_per_s\":%.2f}\n",
+         bench, param, n, t->ops, nsPerOp, bytesPerOp, mbPerSec);
+  fflush(stdout);
+}
+
+char *makeTempDir()
+{
+  char *dir = strdup("/tmp/mailbench.XXXXXX");
+  if (!mkdtemp(dir))
+    panic("Cannot create temp directory (%s)", strerror(errno));
+  return dir;
+}
+
+void removeTempDir(const char *dir)
+{
+  DIR *d = opendir(dir);
+  if (!d)
+    return;
+  struct dirent *ent;
+  char path[4096];
+  while ((ent = readdir(d)) != NULL) {
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+    unlink(path);
+  }
+  closedir(d);
+  rmdir(dir);
+}
+
+// Writes a synthetic mailbox in the same layout smtp appends: a "From " line
+// terminated by LF (ctime), followed by CRLF-terminated message lines. Returns
+// the size of the file in bytes.
+
+long makeMailbox(const char *path, int messages, int bodyLines)
+{
+  FILE *f = fopen(path, "w");
+  if (!f)
+    panic("Cannot create %s (%s)", path, strerror(errno));
+
+  long bytes = 0;
+  for (int i=0; i<messages; i++) {
+    bytes += fprintf(f, "From <sender%d@localhost> Mon Oct 19 05:31:55 2026\n", i % 97);
+    bytes += fprintf(f, "From: Sender %d <sender%d@localhost>\r\n", i % 97, i % 97);
+    bytes += fprintf(f, "To: Recipient <bench@localhost>\r\n");
+    bytes += fprintf(f, "Subject: Synthetic message %d\r\n\r\n", i);
+    for (int j=0; j<bodyLines; j++)
+      bytes += fprintf(f, "Line %04d of message %d: the quick brown fox jumps over the lazy dog.\r\n", j, i);
+  }
+  fclose(f);
+  return bytes;
+}
+
+// Responses from the handlers we benchmark go to /dev/null.
+
+int openSink()
+{
+  int fd = open("/dev/null", O_WRONLY);
+  if (fd < 0)
+    panic("Cannot open /dev/null (%s)", strerror(errno));
+  return fd;
+}
@@ -0,0 +1,37 @@
+#ifndef __bench_h__
+#define __bench_h__
+
+#define panic(a...) do { fprintf(stderr, a); fprintf(stderr, "\n"); exit(1); } while (0) 
+
+// Every benchmark prints one JSON object per line on stdout, e.g.
+//   {"bench":"read_mailbox","messages":1000,"ops":42,"ns_per_op":...,"mb_per_s":...}
+// so that the output of two builds can be compared with a simple script.
+
+struct benchConfig {
+  int minMessages;     // smallest synthetic mailbox
+  int maxMessages;     // largest synthetic mailbox (sizes grow by 10x)
+  int bodyLines;       // lines per synthetic message body
+  double minSeconds;   // minimum measured time per data point
+};
+
+// A running measurement: call benchStart(), then benchDone() after each
+// operation until it returns true.
+
+struct benchTimer {
+  double startNs;
+  double elapsedNs;
+  long ops;
+  double minNs;
+};
+
+void parseBenchArgs(struct benchConfig *cfg, int argc, char *argv[]);
+double nowNs();
+void benchStart(struct benchTimer *t, struct benchConfig *cfg);
+bool benchDone(struct benchTimer *t);
+void report(const char *bench, const char *param, long n, struct benchTimer *t, long bytesPerOp);
+char *makeTempDir();
+void removeTempDir(const char *dir);
+long makeMailbox(const char *path, int messages, int bodyLines);
+int openSink();
+
+#endif /* defined(__bench_h__) */
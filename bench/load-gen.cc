@@ -0,0 +1,200 @@
+// Load generator for a running smtp or maild: a number of concurrent clients
+// send mail for a fixed time and the latency of every transaction, from MAIL
+// FROM to the 250 after the dot, is recorded. Prints one JSON object with the
+// throughput and latency percentiles, e.g. to compare a server started with
+// and without -x:
+//   ./load-gen -p 2500 -c 64 -d 10 -r bench@localhost
+// With -n the clients reconnect after that many mails, so session setup (the
+// worker thread and its placement) is part of the load; the connect and
+// greeting are not counted in the latency.
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "bench.h"
+
+using namespace std;
+
+struct loadConfig {
+  int port;
+  int connections;
+  double seconds;
+  int perConnection;   // mails before reconnecting, 0 keeps the connection
+  int bodyBytes;
+  const char *rcpt;
+};
+
+struct loadClient {
+  struct loadConfig *cfg;
+  double stopNs;
+  vector<double> latencies; // ns per transaction
+  long reconnects;
+};
+
+struct smtpConn {
+  int fd;
+  string in;
+};
+
+void smtpConnect(struct smtpConn *c, int port)
+{
+  c->fd = socket(PF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  bzero(&addr, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+  if (c->fd < 0 || connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    panic("Cannot connect to port %d (%s)", port, strerror(errno));
+  const int NODELAY = 1;
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &NODELAY, sizeof(NODELAY));
+  c->in.clear();
+}
+
+void smtpSend(struct smtpConn *c, const string &data)
+{
+  for (size_t sent = 0; sent < data.length();) {
+    int w = write(c->fd, data.data() + sent, data.length() - sent);
+    if (w <= 0)
+      panic("Cannot write to the server (%s)", strerror(errno));
+    sent += w;
+  }
+}
+
+// reads a reply, skipping the lines of a multi-line one, and checks its code
+void smtpExpect(struct smtpConn *c, const char *code)
+{
+  while (true) {
+    size_t eol;
+    while ((eol = c->in.find("\r\n")) != string::npos) {
+      string line = c->in.substr(0, eol);
+      c->in.erase(0, eol + 2);
+      if (line.length() >= 4 && line[3] == '-')
+        continue;
+      if (line.compare(0, 3, code) != 0)
+        panic("Expected %s, got '%s'", code, line.c_str());
+      return;
+    }
+    char buf[4096];
+    int r = read(c->fd, buf, sizeof(buf));
+    if (r <= 0)
+      panic("The server closed the connection");
+    c->in.append(buf, r);
+  }
+}
+
+void smtpClose(struct smtpConn *c)
+{
+  smtpSend(c, "QUIT\r\n");
+  smtpExpect(c, "221");
+  close(c->fd);
+}
+
+void *runClient(void *arg)
+{
+  struct loadClient *client = (struct loadClient *)arg;
+  struct loadConfig *cfg = client->cfg;
+
+  string body = "Subject: load\r\n\r\n";
+  while ((int)body.length() < cfg->bodyBytes)
+    body += "the quick brown fox jumps over the lazy dog, again and again.\r\n";
+  string mail = string("MAIL FROM:<load@localhost>\r\n");
+  string rcpt = string("RCPT TO:<") + cfg->rcpt + ">\r\n";
+  string data = body + ".\r\n";
+
+  struct smtpConn c;
+  c.fd = -1;
+  int sent = 0;
+  while (nowNs() < client->stopNs) {
+    if (c.fd < 0) {
+      smtpConnect(&c, cfg->port);
+      smtpExpect(&c, "220");
+      smtpSend(&c, "EHLO load\r\n");
+      smtpExpect(&c, "250");
+      client->reconnects++;
+    }
+    double start = nowNs();
+    smtpSend(&c, mail);
+    smtpExpect(&c, "250");
+    smtpSend(&c, rcpt);
+    smtpExpect(&c, "250");
+    smtpSend(&c, "DATA\r\n");
+    smtpExpect(&c, "354");
+    smtpSend(&c, data);
+    smtpExpect(&c, "250");
+    client->latencies.push_back(nowNs() - start);
+    if (cfg->perConnection > 0 && ++sent == cfg->perConnection) {
+      smtpClose(&c);
+      c.fd = -1;
+      sent = 0;
+    }
+  }
+  if (c.fd >= 0)
+    smtpClose(&c);
+  return NULL;
+}
+
+double percentile(const vector<double> &sorted, double p)
+{
+  if (sorted.empty())
+    return 0;
+  size_t i = (size_t)(p * (sorted.size() - 1) + 0.5);
+  return sorted[i];
+}
+
+int main(int argc, char *argv[])
+{
+  struct loadConfig cfg = {2500, 16, 5, 0, 1024, "bench@localhost"};
+  int c;
+  while ((c = getopt(argc, argv, "p:c:d:n:b:r:")) != -1) {
+    switch (c) {
+    case 'p': cfg.port = atoi(optarg); break;
+    case 'c': cfg.connections = atoi(optarg); break;
+    case 'd': cfg.seconds = atof(optarg); break;
+    case 'n': cfg.perConnection = atoi(optarg); break;
+    case 'b': cfg.bodyBytes = atoi(optarg); break;
+    case 'r': cfg.rcpt = optarg; break;
+    default:
+      panic("Syntax: %s [-p smtp port] [-c connections] [-d seconds] [-n mails per connection] [-b body bytes] [-r recipient]", argv[0]);
+    }
+  }
+  if (cfg.connections < 1)
+    panic("Need at least one connection");
+
+  double start = nowNs();
+  vector<struct loadClient> clients(cfg.connections);
+  vector<pthread_t> threads(cfg.connections);
+  for (int i=0; i<cfg.connections; i++) {
+    clients[i].cfg = &cfg;
+    clients[i].stopNs = start + cfg.seconds * 1e9;
+    clients[i].reconnects = 0;
+    pthread_create(&threads[i], NULL, runClient, &clients[i]);
+  }
+  vector<double> all;
+  long reconnects = 0;
+  for (int i=0; i<cfg.connections; i++) {
+    pthread_join(threads[i], NULL);
+    all.insert(all.end(), clients[i].latencies.begin(), clients[i].latencies.end());
+    reconnects += clients[i].reconnects;
+  }
+  double elapsed = nowNs() - start;
+  sort(all.begin(), all.end());
+
+  printf("{\"bench\":\"load_smtp\",\"connections\":%d,\"ops\":%ld,\"sessions\":%ld,\"ops_per_s\":%.1f,"
+         "\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+         cfg.connections, (long)all.size(), reconnects, all.size() / (elapsed / 1e9),
+         percentile(all, 0.5) / 1e3, percentile(all, 0.9) / 1e3, percentile(all, 0.99) / 1e3,
+         percentile(all, 0.999) / 1e3, all.empty() ? 0 : all.back() / 1e3);
+  return 0;
+}
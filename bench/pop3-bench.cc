@@ -0,0 +1,143 @@
+// Microbenchmarks for the pop3 server: mailbox load/save and UIDL digests.
+// The server is compiled into this driver so the benchmarks call the very
+// same functions the worker threads use.
+
+#define NO_MAIN
+#include "../pop3.cc"
+
+#include "bench.h"
+
+void benchReadMailbox(struct benchConfig *cfg, Mailbox *mb, int n, long bytes)
+{
+  struct benchTimer t;
+  benchStart(&t, cfg);
+  do {
+    vector<Message> messages;
+    read_mailbox(mb, messages);
+    if ((int)messages.size() != n)
+      panic("read_mailbox returned %d messages, expected %d", (int)messages.size(), n);
+  } while (!benchDone(&t));
+  report("read_mailbox", "messages", n, &t, bytes);
+}
+
+// the same with the file dropped from the page cache before every parse, as
+// for the first login after a restart
+void benchReadMailboxCold(struct benchConfig *cfg, Mailbox *mb, int n, long bytes)
+{
+  int fd = open(mailbox_path(mb).c_str(), O_RDONLY);
+  struct benchTimer t;
+  benchStart(&t, cfg);
+  do {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    vector<Message> messages;
+    read_mailbox(mb, messages);
+    if ((int)messages.size() != n)
+      panic("read_mailbox returned %d messages, expected %d", (int)messages.size(), n);
+  } while (!benchDone(&t));
+  close(fd);
+  report("read_mailbox_cold", "messages", n, &t, bytes);
+}
+
+// pop3 login with the index cached, as after the first session
+void benchOpenMailbox(struct benchConfig *cfg, Mailbox *mb, int n, long bytes)
+{
+  struct benchTimer t;
+  benchStart(&t, cfg);
+  do {
+    vector<Message> messages;
+    mailbox_open(mb, messages);
+    if ((int)messages.size() != n)
+      panic("mailbox_open returned %d messages, expected %d", (int)messages.size(), n);
+  } while (!benchDone(&t));
+  report("mailbox_open", "messages", n, &t, bytes);
+}
+
+// a QUIT that deletes the first message; the message is delivered again so
+// the mailbox keeps its size, and that costs as much as the commit itself
+void benchCommit(struct benchConfig *cfg, Mailbox *mb, int n, long bytes)
+{
+  struct benchTimer t;
+  benchStart(&t, cfg);
+  do {
+    vector<Message> messages;
+    mailbox_open(mb, messages);
+    string data;
+    if ((int)messages.size() != n || !mailbox_read(mb, messages[0], data))
+      panic("mailbox_open returned %d messages, expected %d", (int)messages.size(), n);
+    messages[0].deleted = true;
+    if (!mailbox_commit(mb, messages))
+      panic("mailbox_commit failed");
+    Mail mail;
+    mailbox_prepare(mail, data);
+    mailbox_deliver(mb, "From <bench@localhost> Mon Oct 19 05:31:55 2026\n", mail);
+  } while (!benchDone(&t));
+  report("mailbox_commit", "messages", n, &t, bytes);
+}
+
+void benchUidl(struct benchConfig *cfg, Mailbox *mb, int n, long bytes, int sink)
+{
+  vector<Message> messages;
+  read_mailbox(mb, messages);
+
+  // one operation is a full "UIDL" listing of the mailbox
+  struct benchTimer t;
+  benchStart(&t, cfg);
+  do {
+    for (int i=0; i<(int)messages.size(); i++)
+      uidl_msg(sink, i+1, mb, messages, false);
+  } while (!benchDone(&t));
+  report("uidl_msg", "messages", n, &t, bytes);
+}
+
+void benchDigest(struct benchConfig *cfg)
+{
+  unsigned char digest[MD5_DIGEST_LENGTH];
+  for (int size = 256; size <= 1<<20; size *= 16) {
+    char *data = (char*)malloc(size);
+    memset(data, 'x', size);
+
+    struct benchTimer t;
+    benchStart(&t, cfg);
+    do {
+      computeDigest(data, size, digest);
+    } while (!benchDone(&t));
+    report("computeDigest", "bytes", size, &t, size);
+    free(data);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  struct benchConfig cfg;
+  parseBenchArgs(&cfg, argc, argv);
+  init_metrics();
+
+  char *dir = makeTempDir();
+  int sink = openSink();
+
+  benchDigest(&cfg);
+
+  vector<long> sizes;
+  for (int n = cfg.minMessages; n <= cfg.maxMessages; n *= 10) {
+    string user = "bench" + to_string(n) + ".mbox";
+    sizes.push_back(makeMailbox((string(dir) + "/" + user).c_str(), n, cfg.bodyLines));
+  }
+  mailbox_init(dir, true, CACHE_BUDGET_KB, 0, 0);
+
+  int k = 0;
+  for (int n = cfg.minMessages; n <= cfg.maxMessages; n *= 10, k++) {
+    Mailbox *mb = mailbox_find("bench" + to_string(n) + ".mbox");
+    long bytes = sizes[k];
+
+    benchReadMailbox(&cfg, mb, n, bytes);
+    benchReadMailboxCold(&cfg, mb, n, bytes);
+    benchOpenMailbox(&cfg, mb, n, bytes);
+    benchUidl(&cfg, mb, n, bytes, sink);
+    benchCommit(&cfg, mb, n, bytes);
+  }
+
+  close(sink);
+  removeTempDir(dir);
+  free(dir);
+  return 0;
+}
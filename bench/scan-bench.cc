@@ -0,0 +1,100 @@
+// Microbenchmarks for the byte scanners in scan.cc, at every level the CPU
+// supports, on one core. mb_per_s of a scan over a buffer with no match is
+// the raw throughput; scan_crlf stops at every line, as the smtp framing does.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#include "scan.h"
+#include "bench.h"
+
+using namespace std;
+
+const char *LINE = "Line 0042 of message 7: the quick brown fox jumps over the lazy dog.\r\n";
+const long BUFFER_BYTES = 1 << 20;
+
+// about BUFFER_BYTES of LINE copies, with LF line endings if 'bare'
+string makeText(bool bare)
+{
+  string text;
+  while ((long)text.length() < BUFFER_BYTES) {
+    text += LINE;
+    if (bare) text.erase(text.length() - 2, 1);
+  }
+  return text;
+}
+
+long countCrlf(const char *p, const char *end)
+{
+  long n = 0;
+  for (const char *q = scan_crlf(p, end); q != NULL; q = scan_crlf(q + 2, end))
+    n++;
+  return n;
+}
+
+void benchScanners(struct benchConfig *cfg, int level)
+{
+  string crlf = makeText(false), lf = makeText(true);
+  const char *p = crlf.data(), *end = p + crlf.length();
+  long lines = crlf.length() / strlen(LINE);
+  char name[64];
+  struct benchTimer t;
+
+  snprintf(name, sizeof(name), "scan_crlf_%s", scan_name(level));
+  benchStart(&t, cfg);
+  do {
+    if (countCrlf(p, end) != lines)
+      panic("scan_crlf found the wrong number of lines");
+  } while (!benchDone(&t));
+  report(name, "bytes", crlf.length(), &t, crlf.length());
+
+  const char *(*scanners[])(const char *, const char *) = { scan_data_end, scan_dot_line, scan_from };
+  const char *names[] = { "scan_data_end", "scan_dot_line", "scan_from" };
+  for (int i=0; i<3; i++) {
+    snprintf(name, sizeof(name), "%s_%s", names[i], scan_name(level));
+    benchStart(&t, cfg);
+    do {
+      if (scanners[i](p, end) != NULL)
+        panic("%s matched text without a match", names[i]);
+    } while (!benchDone(&t));
+    report(name, "bytes", crlf.length(), &t, crlf.length());
+  }
+
+  snprintf(name, sizeof(name), "scan_bare_lf_%s", scan_name(level));
+  benchStart(&t, cfg);
+  do {
+    if ((long)scan_bare_lf(lf.data(), lf.data() + lf.length(), 0) != (long)(lf.length() / (strlen(LINE) - 1)))
+      panic("scan_bare_lf miscounted");
+  } while (!benchDone(&t));
+  report(name, "bytes", lf.length(), &t, lf.length());
+}
+
+// memmem() from libc for the end of DATA, to compare against
+void benchMemmem(struct benchConfig *cfg)
+{
+  string crlf = makeText(false);
+  struct benchTimer t;
+  benchStart(&t, cfg);
+  do {
+    if (memmem(crlf.data(), crlf.length(), "\r\n.\r\n", 5) != NULL)
+      panic("memmem matched text without a match");
+  } while (!benchDone(&t));
+  report("memmem_data_end", "bytes", crlf.length(), &t, crlf.length());
+}
+
+int main(int argc, char *argv[])
+{
+  struct benchConfig cfg;
+  parseBenchArgs(&cfg, argc, argv);
+
+  int best = scan_level();
+  for (int level = SCAN_SCALAR; level <= best; level++) {
+    scan_use(level);
+    benchScanners(&cfg, level);
+  }
+  scan_use(best);
+  benchMemmem(&cfg);
+  return 0;
+}
@@ -0,0 +1,130 @@
+// Microbenchmarks for the smtp server: command line framing and DATA
+// accumulation, line by line and a buffer at a time. The server is compiled into this driver so the benchmarks call
+// the very same functions the worker threads use.
+
+#define NO_MAIN
+#include "../smtp.cc"
+
+#include "bench.h"
+
+const char *DATA_LINE = "Line 0042 of message 7: the quick brown fox jumps over the lazy dog.\r\n";
+
+// Replays 'lines' copies of 'line' through the worker_thread() framing loop:
+// each chunk of input is appended at the end of the buffer, as read() would,
+// then complete lines are cut off with scan_crlf() and clear_buffer().
+
+long frameLines(const char *line, long lines)
+{
+  char buff[BUFF_SIZE];
+  memset(buff, 0, sizeof(buff));
+  int lineLen = strlen(line);
+  long framed = 0, fed = 0;
+
+  while (framed < lines) {
+    // fill the free part of the buffer with as many whole lines as fit
+    int used = strlen(buff);
+    while (fed < lines && used + lineLen < BUFF_SIZE - 1) {
+      memcpy(buff + used, line, lineLen);
+      used += lineLen;
+      fed++;
+    }
+
+    char *end, *stop = buff + used;
+    while ((end = (char *)scan_crlf(buff, stop)) != NULL) {
+      end += 2;
+      framed++;
+      clear_buffer(buff, end);
+      stop -= end - buff;
+    }
+  }
+  return framed;
+}
+
+void benchFraming(struct benchConfig *cfg)
+{
+  const char *commands[] = { "NOOP\r\n", "RCPT TO:<linhphan@localhost>\r\n", DATA_LINE };
+  const char *names[] = { "frame_noop", "frame_rcpt", "frame_data_line" };
+  long lines = 10000;
+
+  for (int i=0; i<3; i++) {
+    struct benchTimer t;
+    benchStart(&t, cfg);
+    do {
+      if (frameLines(commands[i], lines) != lines)
+        panic("framing lost lines");
+    } while (!benchDone(&t));
+    report(names[i], "lines", lines, &t, lines * strlen(commands[i]));
+  }
+}
+
+// Feeds a message body line by line through handle_data() in the DATA state,
+// which is what the worker does for every line until the terminating dot.
+
+void benchDataAccumulation(struct benchConfig *cfg, int sink)
+{
+  char buff[BUFF_SIZE];
+  int lineLen = strlen(DATA_LINE);
+  strcpy(buff, DATA_LINE);
+  char *end = buff + lineLen;
+
+  for (long lines = 10; lines <= 100000; lines *= 10) {
+    struct benchTimer t;
+    benchStart(&t, cfg);
+    do {
+      int state = 4;
+      string data, sender = "bench@localhost";
+      vector<string> rcpts, remote;
+      off_t size = 0;
+      for (long j=0; j<lines; j++)
+        handle_data(sink, &state, buff, end, data, sender, rcpts, remote, &size, false);
+      if ((long)data.length() != lines * lineLen)
+        panic("handle_data accumulated %ld bytes, expected %ld", (long)data.length(), lines * lineLen);
+    } while (!benchDone(&t));
+    report("handle_data", "lines", lines, &t, lines * lineLen);
+  }
+}
+
+// Feeds a message through the DATA path as the worker does: each buffer full
+// of lines is cut at the last complete line by data_block() and appended by
+// one handle_data() call, then the dot ends the message.
+
+void benchDataBlocks(struct benchConfig *cfg, int sink)
+{
+  char buff[BUFF_SIZE];
+  int lineLen = strlen(DATA_LINE);
+  int perBuffer = (BUFF_SIZE - 1) / lineLen;
+  memset(buff, 0, sizeof(buff));
+  for (int i=0; i<perBuffer; i++)
+    memcpy(buff + i * lineLen, DATA_LINE, lineLen);
+  char *stop = buff + perBuffer * lineLen;
+
+  for (long lines = 1000; lines <= 100000; lines *= 10) {
+    struct benchTimer t;
+    benchStart(&t, cfg);
+    do {
+      int state = 4;
+      string data, sender = "bench@localhost";
+      vector<string> rcpts, remote;
+      off_t size = 0;
+      for (long j=0; j<lines; j+=perBuffer)
+        handle_data(sink, &state, buff, data_block(buff, stop), data, sender, rcpts, remote, &size, false);
+      if ((long)data.length() != (lines + perBuffer - 1) / perBuffer * perBuffer * lineLen)
+        panic("handle_data accumulated %ld bytes", (long)data.length());
+    } while (!benchDone(&t));
+    report("handle_data_block", "lines", lines, &t, (lines + perBuffer - 1) / perBuffer * perBuffer * lineLen);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  struct benchConfig cfg;
+  parseBenchArgs(&cfg, argc, argv);
+  init_metrics();
+
+  int sink = openSink();
+  benchFraming(&cfg);
+  benchDataAccumulation(&cfg, sink);
+  benchDataBlocks(&cfg, sink);
+  close(sink);
+  return 0;
+}
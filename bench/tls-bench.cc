@@ -0,0 +1,222 @@
+// Benchmarks for tls.cc over loopback: full and resumed handshakes, and bulk
+// throughput at the write sizes the servers use. A server thread serves the
+// connections with tls_accept()/tls_write() as the worker threads do; the
+// client is an OpenSSL client in this process, so handshake times include
+// both ends.
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <string>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#include <openssl/pem.h>
+
+#include "bench.h"
+#include "tls.h"
+#include "log.h"
+
+using namespace std;
+
+const long BULK_BYTES = 4 * 1024 * 1024;
+const int WRITE_SIZES[] = {4096, 16384, 65536}; // 65536 is the servers' OUTPUT_SIZE
+
+// a self-signed P-256 certificate and its key in one PEM file
+string makeCertificate(const char *dir)
+{
+  EVP_PKEY *key = EVP_EC_gen("P-256");
+  X509 *cert = X509_new();
+  if (!key || !cert)
+    panic("Cannot create a key");
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+  X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+  X509_set_pubkey(cert, key);
+  X509_NAME *name = X509_get_subject_name(cert);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+  X509_set_issuer_name(cert, name);
+  if (!X509_sign(cert, key, EVP_sha256()))
+    panic("Cannot sign the certificate");
+
+  string path = string(dir) + "/bench.pem";
+  FILE *f = fopen(path.c_str(), "w");
+  if (!f)
+    panic("Cannot create %s (%s)", path.c_str(), strerror(errno));
+  PEM_write_X509(f, cert);
+  PEM_write_PrivateKey(f, key, NULL, NULL, 0, NULL, NULL);
+  fclose(f);
+  X509_free(cert);
+  EVP_PKEY_free(key);
+  return path;
+}
+
+// greets, then answers "<bytes> <write size>\r\n" with that many bytes
+void *serveConnection(void *arg)
+{
+  int fd = (int)(long)arg;
+  Tls *tls = tls_accept(fd);
+  if (tls) {
+    char request[100];
+    tls_write(tls, "+OK\r\n", 5);
+    int r;
+    while ((r = tls_read(tls, request, sizeof(request) - 1)) > 0) {
+      request[r] = '\0';
+      long bytes = atol(request);
+      int size = atoi(strchr(request, ' ') + 1);
+      string chunk(size, 'x');
+      for (long sent = 0; sent < bytes; sent += size) {
+        if (tls_write(tls, chunk.data(), size) <= 0)
+          break;
+      }
+    }
+    tls_close(tls);
+  }
+  close(fd);
+  return NULL;
+}
+
+void *serveConnections(void *arg)
+{
+  int listenFd = (int)(long)arg;
+  while (true) {
+    int fd = accept(listenFd, NULL, NULL);
+    if (fd < 0)
+      continue;
+    pthread_t thread;
+    pthread_create(&thread, NULL, serveConnection, (void *)(long)fd);
+    pthread_detach(thread);
+  }
+  return NULL;
+}
+
+// starts the server on an ephemeral loopback port and returns the port
+int startServer()
+{
+  int fd = socket(PF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  bzero(&addr, sizeof(addr));
+  addr.sin_family = AF_INET;
+  inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+  socklen_t len = sizeof(addr);
+  if (bind(fd, (struct sockaddr *)&addr, len) < 0 || listen(fd, 100) < 0)
+    panic("Cannot listen (%s)", strerror(errno));
+  getsockname(fd, (struct sockaddr *)&addr, &len);
+  pthread_t thread;
+  pthread_create(&thread, NULL, serveConnections, (void *)(long)fd);
+  pthread_detach(thread);
+  return ntohs(addr.sin_port);
+}
+
+// connects, handshakes and reads the greeting, after which a TLS 1.3 client
+// has its tickets
+SSL *connectClient(SSL_CTX *ctx, int port, SSL_SESSION *session)
+{
+  int fd = socket(PF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  bzero(&addr, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    panic("Cannot connect (%s)", strerror(errno));
+
+  SSL *ssl = SSL_new(ctx);
+  SSL_set_fd(ssl, fd);
+  if (session)
+    SSL_set_session(ssl, session);
+  char greeting[5];
+  if (SSL_connect(ssl) != 1 || SSL_read(ssl, greeting, sizeof(greeting)) != 5)
+    panic("TLS handshake failed");
+  return ssl;
+}
+
+void closeClient(SSL *ssl)
+{
+  int fd = SSL_get_fd(ssl);
+  SSL_shutdown(ssl);
+  SSL_free(ssl);
+  close(fd);
+}
+
+void benchHandshake(struct benchConfig *cfg, SSL_CTX *ctx, int port, int version, bool resume)
+{
+  SSL_SESSION *session = NULL;
+  if (resume) {
+    SSL *ssl = connectClient(ctx, port, NULL);
+    session = SSL_get1_session(ssl);
+    closeClient(ssl);
+  }
+
+  struct benchTimer t;
+  benchStart(&t, cfg);
+  do {
+    SSL *ssl = connectClient(ctx, port, session);
+    if (resume) {
+      if (!SSL_session_reused(ssl))
+        panic("The session was not resumed");
+      SSL_SESSION_free(session);
+      session = SSL_get1_session(ssl);
+    }
+    closeClient(ssl);
+  } while (!benchDone(&t));
+  if (session)
+    SSL_SESSION_free(session);
+  report(resume ? "tls_handshake_resumed" : "tls_handshake_full", "version", version, &t, 0);
+}
+
+void benchBulk(struct benchConfig *cfg, SSL_CTX *ctx, int port, int size)
+{
+  SSL *ssl = connectClient(ctx, port, NULL);
+  char request[100];
+  snprintf(request, sizeof(request), "%ld %d\r\n", BULK_BYTES, size);
+  static char buf[65536];
+
+  struct benchTimer t;
+  benchStart(&t, cfg);
+  do {
+    SSL_write(ssl, request, strlen(request));
+    for (long got = 0; got < BULK_BYTES;) {
+      int r = SSL_read(ssl, buf, sizeof(buf));
+      if (r <= 0)
+        panic("The bulk transfer broke off after %ld bytes", got);
+      got += r;
+    }
+  } while (!benchDone(&t));
+  closeClient(ssl);
+  report("tls_bulk", "write_bytes", size, &t, BULK_BYTES);
+}
+
+int main(int argc, char *argv[])
+{
+  struct benchConfig cfg;
+  parseBenchArgs(&cfg, argc, argv);
+  log_init(LOG_ERROR);
+
+  char *dir = makeTempDir();
+  tls_init(makeCertificate(dir).c_str());
+  int port = startServer();
+
+  SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT);
+
+  // TLS 1.2 resumes from the server's session cache, TLS 1.3 by ticket
+  int versions[] = {TLS1_2_VERSION, TLS1_3_VERSION};
+  for (int v = 0; v < 2; v++) {
+    SSL_CTX_set_max_proto_version(ctx, versions[v]);
+    benchHandshake(&cfg, ctx, port, 12 + v, false);
+    benchHandshake(&cfg, ctx, port, 12 + v, true);
+  }
+  for (int i = 0; i < 3; i++)
+    benchBulk(&cfg, ctx, port, WRITE_SIZES[i]);
+
+  SSL_CTX_free(ctx);
+  removeTempDir(dir);
+  return 0;
+}
@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string.h>
+#include "handoff.h"
+#include "log.h"
+using namespace std;
+
+const int NAME_SIZE = 16;
+
+struct Handoff {
+	int upgrade_fd;   // unix socket the next instance connects to
+	int listen_fd;    // socket handed over
+	int wake_fd;      // written once the socket is handed over
+	char name[NAME_SIZE];
+};
+
+static void set_path(struct sockaddr_un* addr, const char* path){
+	bzero(addr, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+}
+
+// asks a running instance for its listening socket, -1 if there is none
+int handoff_receive(const char* path, const char* name){
+	struct sockaddr_un addr;
+	set_path(&addr, path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+
+	// the request names the protocol, so smtp never takes over a pop3 port
+	char request[NAME_SIZE] = {0};
+	strncpy(request, name, NAME_SIZE - 1);
+	if (write(fd, request, NAME_SIZE) != NAME_SIZE) {
+		close(fd);
+		return -1;
+	}
+
+	char ok;
+	struct iovec iov = { &ok, 1 };
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	bzero(&msg, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	int listen_fd = -1;
+	if (recvmsg(fd, &msg, 0) == 1) {
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			memcpy(&listen_fd, CMSG_DATA(cmsg), sizeof(int));
+		}
+	}
+	close(fd);
+	return listen_fd;
+}
+
+static void *handoff_thread(void *arg){
+	Handoff* h = (Handoff*)arg;
+
+	while (true) {
+		int fd = accept(h->upgrade_fd, NULL, NULL);
+		if (fd < 0) continue;
+
+		char request[NAME_SIZE];
+		if (read(fd, request, NAME_SIZE) != NAME_SIZE || strncmp(request, h->name, NAME_SIZE) != 0) {
+			log_event(LOG_WARN, -1, "Upgrade request for another protocol ignored");
+			close(fd);
+			continue;
+		}
+
+		char ok = 'U';
+		struct iovec iov = { &ok, 1 };
+		char control[CMSG_SPACE(sizeof(int))];
+		bzero(control, sizeof(control));
+		struct msghdr msg;
+		bzero(&msg, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &h->listen_fd, sizeof(int));
+
+		int sent = sendmsg(fd, &msg, 0);
+		close(fd);
+		if (sent == 1) break;
+		log_event(LOG_WARN, -1, "Listening socket handoff failed");
+	}
+
+	// the new instance owns the upgrade path from now on
+	close(h->upgrade_fd);
+	log_event(LOG_INFO, -1, "Listening socket handed to new instance");
+	write(h->wake_fd, "U", 1);
+	return NULL;
+}
+
+// Serves the listening socket to the next instance on path. Returns a file
+// descriptor that becomes readable once the socket has been handed over; the
+// accept loop polls it next to the listening socket and stops accepting.
+int handoff_serve(const char* path, const char* name, int listen_fd){
+	struct sockaddr_un addr;
+	set_path(&addr, path);
+	unlink(path);
+	int upgrade_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (upgrade_fd < 0 || bind(upgrade_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		log_event(LOG_ERROR, -1, "Cannot open upgrade socket ", path);
+		return -1;
+	}
+	listen(upgrade_fd, 1);
+
+	int pipe_fds[2];
+	pipe(pipe_fds);
+	Handoff* h = new Handoff;
+	h->upgrade_fd = upgrade_fd;
+	h->listen_fd = listen_fd;
+	h->wake_fd = pipe_fds[1];
+	bzero(h->name, NAME_SIZE);
+	strncpy(h->name, name, NAME_SIZE - 1);
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, handoff_thread, h);
+	pthread_detach(thread);
+	return pipe_fds[0];
+}
@@ -0,0 +1,22 @@
+#ifndef __admission_h__
+#define __admission_h__
+
+#include <stdint.h>
+
+// Admission control for the accept loop: caps on concurrent sessions in total
+// and per source IP. A connection over either cap is answered and closed by
+// the accept loop itself, so no worker thread is spawned for it.
+
+// a connection admitted by the accept loop, handed to its worker thread
+struct Client {
+	int fd;
+	uint32_t ip; // network byte order
+};
+
+void admission_init(int max_sessions, int max_per_ip);
+bool admission_acquire(uint32_t ip);
+void admission_release(uint32_t ip);
+void admission_reject(int fd, const char* response);
+int admission_active();
+
+#endif /* defined(__admission_h__) */
@@ -0,0 +1,28 @@
+#ifndef __affinity_h__
+#define __affinity_h__
+
+// CPU placement of the server threads. The spec lists CPUs per role,
+//   accept=0:worker=2-15,18-31:delivery=1:auth=16,17
+// and a thread pins itself when it starts, to the CPUs of its role or, for a
+// role not in the spec, to all the CPUs the process had at startup (threads
+// inherit the affinity of the thread that creates them). A session pins its
+// worker thread to the worker CPUs on the NUMA node whose CPU received the
+// connection (SO_INCOMING_CPU), or on the next node in turn if there are none
+// there; its buffers, and the mailbox indexes it loads, are then allocated
+// on that node by the kernel's first touch policy. Without a spec threads are
+// left where the scheduler puts them.
+
+enum {
+	AFFINITY_ACCEPT,   // accept loops
+	AFFINITY_WORKER,   // sessions, including pop3 compaction at QUIT
+	AFFINITY_DELIVERY, // journal writers and relay senders
+	AFFINITY_AUTH,     // password hashing
+	AFFINITY_ROLES
+};
+
+// exits if the spec cannot be parsed or names CPUs the process cannot use
+void affinity_init(const char* spec);
+void affinity_pin(int role);
+void affinity_pin_session(int fd);
+
+#endif /* defined(__affinity_h__) */
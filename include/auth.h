@@ -0,0 +1,23 @@
+#ifndef __auth_h__
+#define __auth_h__
+
+#include <string>
+
+// Credentials for pop3 logins. The password file has one line per user,
+//   user:$pbkdf2-sha256$iterations$salt$hash
+// salt and hash in hex, loaded into memory at startup. The PBKDF2 runs on a
+// pool of AUTH threads, so no more of them run at once than there are CPUs,
+// however many sessions log in; a session waits for its result. A password
+// that was verified is remembered for AUTH_CACHE_TTL, as a keyed hash, and a
+// client polling within that time costs no KDF. Without a password file
+// every mailbox has the password DEFAULT_PASSWORD.
+
+const char* const DEFAULT_PASSWORD = "cis505";
+const int AUTH_CACHE_TTL = 600;     // seconds a verified password is remembered
+const int AUTH_CACHE_SIZE = 65536;  // users remembered at most
+
+// exits if the file cannot be read or has a malformed line
+void auth_init(const char* path, int threads);
+bool auth_check(const std::string& user, const std::string& password);
+
+#endif /* defined(__auth_h__) */
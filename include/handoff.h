@@ -0,0 +1,13 @@
+#ifndef __handoff_h__
+#define __handoff_h__
+
+// Listener handoff for binary upgrades without refused connections. A server
+// started with an upgrade socket path first asks a running instance on that
+// path for its listening socket (passed with SCM_RIGHTS). The old instance
+// then stops accepting and drains its sessions while the new one accepts on
+// the very same socket, so the port never closes.
+
+int handoff_receive(const char* path, const char* name);
+int handoff_serve(const char* path, const char* name, int listen_fd);
+
+#endif /* defined(__handoff_h__) */
@@ -0,0 +1,29 @@
+#ifndef __journal_h__
+#define __journal_h__
+
+#include <string>
+#include <vector>
+#include "mailbox.h"
+
+// Write-ahead delivery journal. smtp appends an accepted mail to a journal
+// file in the mailbox directory and answers 250 once that append is on disk;
+// writer threads then append the mail to the recipients' mailboxes, sync
+// them and mark the entry done; an entry whose append or sync fails stays in
+// the journal and is tried again. Sessions that finish DATA at the same time
+// share one fdatasync. Each process has its own journal,
+// .journal.<pid>-<start time>, locked while it runs; at startup the entries
+// left undone in the journal of a process that is gone are taken over, so
+// mail is delivered at least once. The journal is truncated whenever every
+// entry in it is done. Mail in the journal counts against the quota of its
+// mailboxes, and an instance draining for an upgrade applies its journal
+// before it exits, the new instance having found it still locked.
+
+const int JOURNAL_MAX_PENDING = 1024; // entries not applied yet before appends wait
+const int JOURNAL_RETRY_MAX = 60;     // seconds, longest backoff for an entry a mailbox refused
+
+void journal_init(int writers);
+bool journal_running();
+void journal_drain();
+bool journal_append(const std::vector<Mailbox*>& rcpts, const std::string& header, const Mail& mail, off_t reserved);
+
+#endif /* defined(__journal_h__) */
@@ -0,0 +1,28 @@
+#ifndef __log_h__
+#define __log_h__
+
+// Asynchronous logger. A thread that logs copies a small binary record into
+// its own lock-free ring buffer; a background thread drains all rings, formats
+// the records and writes them to stderr in batches. A full ring drops records
+// (and counts them) instead of blocking the session thread.
+
+enum { LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG };
+
+const int LOG_RING_SIZE = 128;  // records per thread
+const int LOG_TEXT_SIZE = 200;  // bytes of text copied per record
+
+extern int LOG_LEVEL;
+
+#define log_enabled(level) ((level) <= LOG_LEVEL)
+
+void log_init(int level);
+void log_record(int level, int conn, const char* event, const char* text, int len);
+void log_flush();
+
+// event must be a string literal or another string that outlives the process,
+// only its pointer is stored; text is copied
+inline void log_event(int level, int conn, const char* event, const char* text = 0, int len = -1){
+	if (log_enabled(level)) log_record(level, conn, event, text, len);
+}
+
+#endif /* defined(__log_h__) */
@@ -0,0 +1,102 @@
+#ifndef __mailbox_h__
+#define __mailbox_h__
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+
+// Registry of the mailboxes in the mailbox directory, shared by all sessions
+// of a process (and by both protocols in maild). A mailbox is an mbox file:
+// a "From " line per message followed by the message data. smtp appends to
+// it; pop3 works on an index of message offsets. Messages deleted in a pop3
+// session stay in the file and are listed in a deletion log next to it
+// (user.mbox.del), appended and synced on QUIT; once they are most of the
+// file it is compacted into a new file that is renamed over the old one.
+// The parsed index is cached per mailbox and kept up to date by deliveries
+// from the same process, so a pop3 login does not re-parse the file. Cached
+// indexes share a memory budget and the least recently used are dropped.
+// Mailboxes are looked up when a session first names them, so startup does
+// not depend on how many there are, and the directory may be sharded by a
+// hash of the user name (ab/cd/user.mbox) so that no directory is huge.
+
+// one message of a mailbox file; pop3 sessions work on a copy of the index
+struct Message {
+	off_t offset;    // of the "From " line
+	int header_len;  // of the "From " line, including its line ending
+	off_t length;    // bytes of message data on disk, after the "From " line
+	off_t octets;    // size of the data as sent to clients, every line ending in CRLF
+	off_t body;      // bytes of data before the body (headers and blank line), -1 if no body
+	int frame;       // of the frame line of a compressed message, 0 if stored as text
+	bool stuffed;    // stored with its dots stuffed, from before UNSTUFFED_MARK; sent as stored
+	bool deleted;
+};
+
+// a mail ready to be appended, prepared once for all recipients
+struct Mail {
+	std::string data; // as stored: message data, or frame line and compressed data
+	off_t octets;
+	off_t body;
+	int frame;
+};
+
+// gets message data in chunks, false stops the stream
+typedef bool (*MailSink)(void* arg, const char* data, size_t len);
+
+struct Mailbox {
+	std::string name;          // file name, e.g. "linhphan.mbox"
+	std::string shard;         // directory in the mailbox directory, "ab/cd/" or ""
+	pthread_mutex_t lock;      // file appends and rewrites, and the cached index
+	pthread_mutex_t maildrop;  // held by the pop3 session that has the mailbox open
+	bool cached;               // index is valid while the file matches the stat below
+	std::vector<Message> index;
+	size_t cost;               // bytes of index charged to the cache budget
+	Mailbox* lru_prev;         // cached mailboxes, most recently used first
+	Mailbox* lru_next;
+	dev_t dev;
+	ino_t ino;
+	off_t size;                // of the file the index describes, may be less than
+	struct timespec mtime;     // the current size after an append elsewhere
+	uint64_t tail_hash;        // of the bytes before size, see appended_to()
+	size_t saved;              // leading index entries that match the .idx file
+	off_t usage;               // bytes of the file, kept up to date by deliveries and QUIT
+	off_t pending;             // bytes in the delivery journal or being delivered, not appended yet
+	std::map<off_t, off_t> gone; // messages deleted but still in the file, offset to bytes
+	off_t gone_bytes;
+	ino_t del_ino;             // file the deletion log was read for
+	off_t del_size;            // of the deletion log when read
+	struct timespec del_mtime;
+	off_t del_valid;           // where its last complete batch ends
+	bool del_stale;            // the log has batches for a file compacted away
+};
+
+extern char* MAILBOX_DIR;
+
+const long CACHE_BUDGET_KB = 65536; // default memory for cached indexes
+const size_t UNKNOWN_CACHE_SIZE = 65536; // names remembered as not found
+const int UNKNOWN_CACHE_TTL = 60;        // seconds until a new mailbox is found
+
+// Ends the "From " line of mail stored with the dot-stuffing of DATA undone;
+// pop3 stuffs it again when sending. Mail stored before has lines that end
+// with the date and keeps its stuffed dots.
+const char* const UNSTUFFED_MARK = " unstuffed";
+
+void mailbox_init(const char* dir, bool shared, long cache_kb, int compress, long quota_kb);
+Mailbox* mailbox_find(const std::string& name);
+std::string mailbox_path(Mailbox* mb);
+bool mailbox_fits(Mailbox* mb, off_t size, bool reserve = false);
+void mailbox_reserve(Mailbox* mb, off_t size);
+void mailbox_prepare(Mail& mail, const std::string& data);
+std::string mailbox_from_line(const std::string& sender, time_t when);
+bool mailbox_deliver(Mailbox* mb, const std::string& header, const Mail& mail, int64_t* waited = NULL);
+bool mailbox_sync(Mailbox* mb);
+void mailbox_open(Mailbox* mb, std::vector<Message>& messages);
+bool mailbox_commit(Mailbox* mb, std::vector<Message>& messages);
+bool mailbox_stream(Mailbox* mb, const Message& m, int lines, MailSink sink, void* arg);
+bool mailbox_read(Mailbox* mb, const Message& m, std::string& data);
+void read_mailbox(Mailbox* mb, std::vector<Message>& messages, off_t from = 0);
+
+#endif /* defined(__mailbox_h__) */
@@ -0,0 +1,24 @@
+#ifndef __metrics_h__
+#define __metrics_h__
+
+#include <stdint.h>
+#include <string>
+
+// Process-wide counters, gauges and latency histograms. Metrics are registered
+// once in main() and get a small integer id. Every thread then updates its own
+// shard without locks or atomic read-modify-write; the admin endpoint sums the
+// shards on each scrape and serves them in the Prometheus text format.
+
+const int METRICS_MAX = 64;    // registered metrics per process
+const int HIST_BUCKETS = 160;  // 4 sub-buckets per power of two of ns, up to ~18 minutes
+
+int metrics_counter(const char* name, const char* help);
+int metrics_gauge(const char* name, const char* help);
+int metrics_histogram(const char* name, const char* help, const char* label, const char* value);
+void metrics_add(int id, int64_t delta);
+void metrics_observe(int id, int64_t ns);
+int64_t metrics_now();
+std::string metrics_render();
+void metrics_serve(const char* addr);
+
+#endif /* defined(__metrics_h__) */
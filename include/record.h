@@ -0,0 +1,54 @@
+#ifndef __record_h__
+#define __record_h__
+
+#include <stdint.h>
+
+// Session capture for replay (test/session-replay). Every command a session
+// handles becomes one fixed size entry: which verb, when it came relative to
+// the start of the session, how long the server took and the class of the
+// first reply. Nothing the client sent is kept but the verb, message numbers
+// (LIST, UIDL, RETR, TOP, DELE) and the sizes of mail data blocks: no
+// addresses, user names, passwords or mail. A session buffers its entries
+// and appends them to the capture file at the end, or each RECORD_FLUSH
+// bytes; sessions that are still open when the server is killed are lost.
+// The hooks are where -v logs commands and responses.
+
+const int RECORD_FLUSH = 65536;
+const char RECORD_MAGIC[8] = {'m', 'a', 'i', 'l', 'r', 'e', 'c', '1'};
+
+// at the start of the file
+struct RecordHeader {
+	char magic[8];
+	int64_t start_ms; // wall clock, when the file was created
+};
+
+enum { RECORD_OPEN, RECORD_COMMAND, RECORD_DATA, RECORD_CLOSE };
+enum { RECORD_SMTP, RECORD_LMTP, RECORD_POP3, RECORD_POP3S };
+
+struct RecordEntry {
+	uint32_t session;     // unique in the file
+	uint32_t offset_us;   // since the session opened; OPEN: ms since start_ms
+	uint32_t duration_us; // server time to handle the command
+	uint32_t arg;         // message number; DATA: bytes of the block; OPEN: protocol
+	uint32_t arg2;        // TOP: lines
+	int16_t reply;        // smtp: code; pop3: 1 +OK, 2 "+ " challenge, 0 -ERR; -1 none
+	uint8_t type;
+	uint8_t verb;         // index in RECORD_VERBS
+	uint8_t args;         // message numbers given, 0-2
+	uint8_t unused[3];
+};
+
+// "." is the end of mail data, SASL a response to an AUTH challenge
+const char* const RECORD_VERBS[] = {"HELO", "EHLO", "LHLO", "MAIL", "RCPT", "DATA", ".", "RSET", "NOOP", "QUIT", "STARTTLS",
+	"USER", "PASS", "AUTH", "SASL", "CAPA", "STAT", "LIST", "UIDL", "RETR", "TOP", "DELE", "STLS", "OTHER"};
+const int RECORD_NUM_VERBS = 24;
+
+void record_init(const char* path);
+// per session, on its worker thread; no-ops without record_init()
+void record_open(int protocol);
+void record_command(const char* verb, const char* line, int64_t start);
+void record_reply(const char* response);
+void record_data(uint32_t bytes);
+void record_close();
+
+#endif /* defined(__record_h__) */
@@ -0,0 +1,32 @@
+#ifndef __relay_h__
+#define __relay_h__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Outbound relay. Mail for recipients on other hosts is queued as one file
+// per mail in the .relay directory of the mailbox directory, synced before
+// the 250, and sent on to one next hop SMTP server (the smarthost). A pool of
+// connections, one per sender thread, stays open between mails and sends the
+// commands of a transaction at once when the smarthost offers PIPELINING
+// (RFC 2920). A recipient that gets a 4xx, or a mail the smarthost cannot be
+// reached for, is tried again with exponential backoff; a 5xx, or a mail
+// queued longer than RELAY_LIFETIME, drops the recipient with a log line. No
+// bounce mail is sent. At startup the queue left by a stopped process is sent.
+// Only clients in the relay networks, loopback unless -y gives a list, may
+// relay: others get 550 for recipients on other hosts, as without -g, so the
+// server is not an open relay. LMTP never relays.
+
+const int RELAY_CONNECTIONS = 2;          // default connections to the smarthost
+const int RELAY_LIFETIME = 5 * 24 * 3600; // seconds a mail is tried for
+const char* const RELAY_NETWORKS = "127.0.0.0/8"; // clients allowed to relay by default
+
+// smarthost is host[:port], port 25 if not given; networks is a list of
+// address/prefix length, "10.0.0.0/8,192.168.1.5/32"
+void relay_init(const char* smarthost, int connections, const char* networks);
+bool relay_running();
+bool relay_allowed(uint32_t ip); // network byte order
+bool relay_enqueue(const std::string& sender, const std::vector<std::string>& rcpts, const std::string& data);
+
+#endif /* defined(__relay_h__) */
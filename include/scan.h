@@ -0,0 +1,28 @@
+#ifndef __scan_h__
+#define __scan_h__
+
+#include <stddef.h>
+
+// Byte scanners for the loops that walk mail data: SMTP line framing and the
+// end of DATA, dot-stuffing, mbox "From " lines and LF to CRLF expansion.
+// They compare 16 (SSE2) or 32 (AVX2) bytes at a time and fall back to plain
+// loops on other CPUs. Every scanner takes the range [p, end) and returns
+// NULL when there is no match.
+
+enum { SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2 };
+
+// best level the CPU supports, chosen on first use; scan_use() lowers or
+// raises it (up to what the CPU has) and returns the level now in use
+int scan_level();
+int scan_use(int level);
+const char* scan_name(int level);
+
+const char* scan_crlf(const char* p, const char* end);      // "\r\n", at its CR
+const char* scan_data_end(const char* p, const char* end);  // "\r\n.\r\n", at its CR
+const char* scan_dot_line(const char* p, const char* end);  // "\r\n.", at its CR
+const char* scan_from(const char* p, const char* end);      // "\nFrom ", at its LF
+
+// LFs without a CR before them; 'last' is the byte before p, 0 if none
+size_t scan_bare_lf(const char* p, const char* end, char last);
+
+#endif /* defined(__scan_h__) */
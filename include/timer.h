@@ -0,0 +1,59 @@
+#ifndef __timer_h__
+#define __timer_h__
+
+#include <stdint.h>
+#include <atomic>
+
+// Hierarchical timer wheel driven by one background thread. Timers are
+// intrusive, so setting and cancelling one is O(1) no matter how many are
+// pending; a timer beyond the first level is cascaded down at most once per
+// level. Expiry callbacks run on the timer thread with the wheel locked, so
+// they must be short, and once timer_cancel() returns the callback is not
+// running and will not run.
+
+const int TIMER_TICK_MS = 100;
+const int TIMER_LEVELS = 4;
+const int TIMER_SLOTS = 64;   // per level, covers 64^4 ticks (~19 days)
+
+struct Timer {
+	Timer* prev;
+	Timer* next;
+	uint64_t expires;         // in ticks
+	int (*expire)(Timer*);    // returns ms until it should fire again, 0 if done
+};
+
+void timer_start();
+void timer_set(Timer* t, int64_t ms);
+void timer_cancel(Timer* t);
+
+// Idle and slow-client guard of one connection. While idle the connection
+// must deliver its next command within idle_ms. During a transfer (DATA,
+// RETR) it must move at least min_rate bytes/s on average over every
+// WATCHDOG_WINDOW_MS and never stall for a whole window. On expiry the
+// response is sent (best effort) and the socket is shut down, which wakes the
+// worker thread out of read() or write().
+
+const int WATCHDOG_WINDOW_MS = 180000; // RFC 5321 data block timeout
+
+struct Watchdog {
+	Timer timer;              // first member, the callback casts back
+	int fd;
+	const char* response;
+	int idle_ms;
+	int min_rate;
+	bool transfer;
+	std::atomic<int64_t> bytes;
+	int64_t checked;          // bytes at the last rate check
+	std::atomic<bool> expired;
+};
+
+void watchdog_init(Watchdog* w, int fd, const char* response, int idle_ms, int min_rate);
+void watchdog_idle(Watchdog* w);
+void watchdog_transfer(Watchdog* w);
+void watchdog_stop(Watchdog* w);
+
+inline void watchdog_progress(Watchdog* w, int bytes){
+	if (bytes > 0) w->bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+#endif /* defined(__timer_h__) */
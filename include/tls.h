@@ -0,0 +1,30 @@
+#ifndef __tls_h__
+#define __tls_h__
+
+// TLS for both servers: STARTTLS in smtp (RFC 3207), STLS and implicit TLS
+// in pop3 (RFC 2595, RFC 8314). One OpenSSL context serves every session in
+// the process, both servers in maild, so its session cache and its session
+// ticket keys are shared too: a client that comes back, on either port, gets
+// an abbreviated handshake. Where OpenSSL and the kernel support it, kTLS
+// takes over record encryption after the handshake and tls_write() is a
+// plain write() on the socket.
+
+const int TLS_CACHE_SIZE = 20480;     // sessions kept for resumption by id
+const int TLS_SESSION_TIMEOUT = 7200; // seconds a session can be resumed
+const int TLS_TICKETS = 2;            // TLS 1.3 tickets sent after a full handshake
+
+struct Tls;
+
+// files is cert[:key], PEM; the key is in the cert file if not given. Exits
+// if they cannot be loaded.
+void tls_init(const char* files);
+bool tls_running();
+// handshake as the server on a connected socket, NULL if it fails
+Tls* tls_accept(int fd);
+// like read() and write(), <= 0 once the connection is closed or broken
+int tls_read(Tls* tls, char* buf, int len);
+int tls_write(Tls* tls, const char* buf, int len);
+// sends close_notify and frees the session, the socket stays open
+void tls_close(Tls* tls);
+
+#endif /* defined(__tls_h__) */
@@ -0,0 +1,395 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <string.h>
+#include <time.h>
+#include <iostream>
+#include <deque>
+#include <map>
+#include <set>
+#include <zlib.h>
+#include "journal.h"
+#include "affinity.h"
+#include "metrics.h"
+#include "log.h"
+using namespace std;
+
+// A record is this header followed by the recipient names (each ending in
+// '\0'), the From line and the mail data as stored. A done record has no
+// payload. The crc covers the header with crc 0 and the payload, so a torn
+// record at the end of a journal is recognized and ignored.
+struct Record {
+	char magic[4];
+	uint32_t type;
+	uint64_t seq;
+	uint32_t rcpts_len;
+	uint32_t header_len;
+	uint64_t data_len;
+	int64_t octets;
+	int64_t body;
+	int32_t frame;
+	uint32_t crc;
+};
+
+static const char RECORD_MAGIC[4] = {'m', 'b', 'j', '1'};
+enum { RECORD_MAIL = 1, RECORD_DONE = 2 };
+static const size_t WRITER_BATCH = 64; // entries applied per mailbox sync
+
+// a mail in the journal, not applied to its mailboxes yet
+struct Entry {
+	uint64_t seq;
+	vector<Mailbox*> rcpts; // the mailboxes that do not have it on disk yet
+	string header;
+	Mail mail;
+	int failures;           // attempts to apply it that failed in a row
+};
+
+static int FD = -1;
+static uint64_t SEQ = 0;
+static deque<Entry*> QUEUE;       // appended, synced and waiting for a writer
+static multimap<time_t, Entry*> RETRY; // failed to apply, by when they are tried again
+static int PENDING = 0;           // appended and not done, queued or not
+static uint64_t WRITTEN = 0;      // bytes ever appended
+static uint64_t SYNCED = 0;       // of those, bytes known to be on disk
+static pthread_mutex_t JOURNAL_LOCK = PTHREAD_MUTEX_INITIALIZER; // all of the above but SYNCED
+static pthread_mutex_t SYNC_LOCK = PTHREAD_MUTEX_INITIALIZER;    // SYNCED, one fdatasync at a time
+static pthread_cond_t QUEUED = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ROOM = PTHREAD_COND_INITIALIZER;
+static int M_APPENDS, M_SYNCS, M_SYNC_TIME, M_PENDING, M_TAKEN_OVER, M_RETRIES;
+
+static bool append_entry(Entry* e, bool wait, off_t reserved, uint64_t& through);
+static bool sync_through(uint64_t through);
+static void queue_entry(Entry* e);
+static void* writer_thread(void* arg);
+static void take_over(vector<int>& orphans, vector<string>& paths, vector<Entry*>& entries);
+
+void journal_init(int writers){
+	M_APPENDS = metrics_counter("journal_appends_total", "Mails appended to the delivery journal.");
+	M_SYNCS = metrics_counter("journal_syncs_total", "fdatasync calls on the journal, one per group of appends.");
+	M_SYNC_TIME = metrics_histogram("journal_sync_duration_seconds", "Time of a journal fdatasync.", "file", "journal");
+	M_PENDING = metrics_gauge("journal_pending", "Journal entries not applied to the mailboxes yet.");
+	M_TAKEN_OVER = metrics_counter("journal_taken_over_total", "Entries taken over from the journal of a stopped process.");
+	M_RETRIES = metrics_counter("journal_retries_total", "Entries a mailbox append or sync failed for, applied again later.");
+
+	// read the journals of stopped processes before this one has its own
+	vector<int> orphans;
+	vector<string> paths;
+	vector<Entry*> entries;
+	take_over(orphans, paths, entries);
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	string path = string(MAILBOX_DIR) + "/.journal." + to_string(getpid()) + "-" + to_string(now.tv_sec);
+	FD = open(path.c_str(), O_RDWR | O_APPEND | O_CREAT | O_EXCL, 0600);
+	if (FD < 0 || flock(FD, LOCK_EX | LOCK_NB) != 0) {
+		cerr << "cannot create delivery journal\r\n";
+		exit(4);
+	}
+
+	for (int i = 0; i < writers; i++) {
+		pthread_t thread;
+		pthread_create(&thread, NULL, writer_thread, NULL);
+		pthread_detach(thread);
+	}
+
+	// entries taken over are on disk in this journal before the old ones go
+	uint64_t through = 0;
+	for (size_t i = 0; i < entries.size(); i++) {
+		if (!append_entry(entries[i], false, 0, through)) exit(4);
+	}
+	if (!sync_through(through)) exit(4);
+	for (size_t i = 0; i < entries.size(); i++) queue_entry(entries[i]);
+	metrics_add(M_TAKEN_OVER, entries.size());
+	for (size_t i = 0; i < orphans.size(); i++) {
+		unlink(paths[i].c_str());
+		close(orphans[i]);
+	}
+}
+
+bool journal_running(){
+	return FD >= 0;
+}
+
+static bool writev_all(int fd, struct iovec* iov, int n){
+	while (n > 0) {
+		ssize_t w = writev(fd, iov, n);
+		if (w < 0) return false;
+		for (; n > 0 && (size_t)w >= iov->iov_len; iov++, n--) w -= iov->iov_len;
+		if (n > 0) {
+			iov->iov_base = (char*)iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+	return true;
+}
+
+// appends one record, with JOURNAL_LOCK held
+static bool write_record(int type, uint64_t seq, const string& names, const string& header, const Mail& mail){
+	Record r;
+	memset(&r, 0, sizeof(r));
+	memcpy(r.magic, RECORD_MAGIC, sizeof(r.magic));
+	r.type = type;
+	r.seq = seq;
+	r.rcpts_len = names.length();
+	r.header_len = header.length();
+	r.data_len = mail.data.length();
+	r.octets = mail.octets;
+	r.body = mail.body;
+	r.frame = mail.frame;
+	uLong crc = crc32(0, (const Bytef*)&r, sizeof(r));
+	crc = crc32(crc, (const Bytef*)names.data(), names.length());
+	crc = crc32(crc, (const Bytef*)header.data(), header.length());
+	crc = crc32(crc, (const Bytef*)mail.data.data(), mail.data.length());
+	r.crc = crc;
+
+	struct iovec iov[4] = {{&r, sizeof(r)}, {(void*)names.data(), names.length()},
+		{(void*)header.data(), header.length()}, {(void*)mail.data.data(), mail.data.length()}};
+	if (!writev_all(FD, iov, 4)) return false;
+	WRITTEN += sizeof(r) + names.length() + header.length() + mail.data.length();
+	return true;
+}
+
+// Makes sure the first 'through' bytes ever appended are on disk. Sessions
+// that wait here while another one syncs are usually covered by that sync.
+static bool sync_through(uint64_t through){
+	bool ok = true;
+	pthread_mutex_lock(&SYNC_LOCK);
+	if (SYNCED < through) {
+		pthread_mutex_lock(&JOURNAL_LOCK);
+		uint64_t target = WRITTEN;
+		pthread_mutex_unlock(&JOURNAL_LOCK);
+		int64_t start = metrics_now();
+		ok = fdatasync(FD) == 0;
+		metrics_observe(M_SYNC_TIME, metrics_now() - start);
+		metrics_add(M_SYNCS, 1);
+		if (ok) SYNCED = target;
+	}
+	pthread_mutex_unlock(&SYNC_LOCK);
+	return ok;
+}
+
+// Appends an entry, false if it could not be written. Sets 'through' to the
+// bytes that have to be on disk for it. The mail is reserved in each mailbox
+// until it is applied; 'reserved' bytes of that the caller holds already.
+static bool append_entry(Entry* e, bool wait, off_t reserved, uint64_t& through){
+	string names;
+	for (size_t i = 0; i < e->rcpts.size(); i++) names += e->rcpts[i]->name + '\0';
+	pthread_mutex_lock(&JOURNAL_LOCK);
+	while (wait && PENDING >= JOURNAL_MAX_PENDING) pthread_cond_wait(&ROOM, &JOURNAL_LOCK);
+	e->seq = ++SEQ;
+	bool ok = write_record(RECORD_MAIL, e->seq, names, e->header, e->mail);
+	through = WRITTEN;
+	if (ok) PENDING++;
+	pthread_mutex_unlock(&JOURNAL_LOCK);
+	if (!ok) {
+		log_event(LOG_ERROR, 0, "Cannot write to the delivery journal");
+		return false;
+	}
+	for (size_t i = 0; i < e->rcpts.size(); i++) mailbox_reserve(e->rcpts[i], e->header.length() + e->mail.data.length() - reserved);
+	metrics_add(M_APPENDS, 1);
+	metrics_add(M_PENDING, 1);
+	return true;
+}
+
+static void queue_entry(Entry* e){
+	pthread_mutex_lock(&JOURNAL_LOCK);
+	QUEUE.push_back(e);
+	pthread_cond_signal(&QUEUED);
+	pthread_mutex_unlock(&JOURNAL_LOCK);
+}
+
+// Returns once every entry appended so far is applied, for an instance that
+// exits after an upgrade.
+void journal_drain(){
+	if (FD < 0) return;
+	pthread_mutex_lock(&JOURNAL_LOCK);
+	while (PENDING > 0) pthread_cond_wait(&ROOM, &JOURNAL_LOCK);
+	pthread_mutex_unlock(&JOURNAL_LOCK);
+}
+
+// Returns once the mail is on disk in the journal, false if it could not be
+// written; the mailboxes get it later. The journal takes over the 'reserved'
+// bytes the caller holds in each mailbox, or gives them back on failure.
+bool journal_append(const vector<Mailbox*>& rcpts, const string& header, const Mail& mail, off_t reserved){
+	Entry* e = new Entry();
+	e->failures = 0;
+	e->rcpts = rcpts;
+	e->header = header;
+	e->mail = mail;
+	uint64_t through;
+	if (!append_entry(e, true, reserved, through)) {
+		for (size_t i = 0; i < rcpts.size(); i++) mailbox_reserve(rcpts[i], -reserved);
+		delete e;
+		return false;
+	}
+	// queued even if the sync fails, the record may be on disk all the same
+	bool ok = sync_through(through);
+	if (!ok) log_event(LOG_ERROR, 0, "Cannot sync the delivery journal");
+	queue_entry(e);
+	return ok;
+}
+
+// Applies batches of entries: each mailbox of a batch is synced once before
+// the entries are marked done. An entry a mailbox append or sync failed for
+// stays pending, still counted against the quota of those mailboxes, and is
+// tried again after a backoff. The journal is emptied when nothing is pending.
+static void* writer_thread(void* arg){
+	affinity_pin(AFFINITY_DELIVERY);
+	while (true) {
+		pthread_mutex_lock(&JOURNAL_LOCK);
+		vector<Entry*> batch;
+		while (true) {
+			time_t now = time(0);
+			while (!RETRY.empty() && RETRY.begin()->first <= now && batch.size() < WRITER_BATCH) {
+				batch.push_back(RETRY.begin()->second);
+				RETRY.erase(RETRY.begin());
+			}
+			while (!QUEUE.empty() && batch.size() < WRITER_BATCH) {
+				batch.push_back(QUEUE.front());
+				QUEUE.pop_front();
+			}
+			if (!batch.empty()) break;
+			if (RETRY.empty()) {
+				pthread_cond_wait(&QUEUED, &JOURNAL_LOCK);
+			} else {
+				struct timespec due = {RETRY.begin()->first, 0};
+				pthread_cond_timedwait(&QUEUED, &JOURNAL_LOCK, &due);
+			}
+		}
+		pthread_mutex_unlock(&JOURNAL_LOCK);
+
+		// the mail stays reserved in a mailbox until it is appended there
+		set<Mailbox*> touched;
+		vector<pair<Entry*, Mailbox*> > appended;
+		for (size_t i = 0; i < batch.size(); i++) {
+			Entry* e = batch[i];
+			off_t size = e->header.length() + e->mail.data.length();
+			vector<Mailbox*> missing;
+			for (size_t j = 0; j < e->rcpts.size(); j++) {
+				if (mailbox_deliver(e->rcpts[j], e->header, e->mail)) {
+					mailbox_reserve(e->rcpts[j], -size);
+					touched.insert(e->rcpts[j]);
+					appended.push_back(make_pair(e, e->rcpts[j]));
+				} else {
+					log_event(LOG_ERROR, 0, "Cannot append journal entry to ", e->rcpts[j]->name.c_str());
+					missing.push_back(e->rcpts[j]);
+				}
+			}
+			e->rcpts = missing;
+		}
+		// appended to a mailbox that failed to sync, it is appended again: the
+		// mail is delivered at least once, as after a restart
+		set<Mailbox*> unsynced;
+		for (set<Mailbox*>::iterator it = touched.begin(); it != touched.end(); it++) {
+			if (!mailbox_sync(*it)) {
+				log_event(LOG_ERROR, 0, "Cannot sync mailbox ", (*it)->name.c_str());
+				unsynced.insert(*it);
+			}
+		}
+		for (size_t i = 0; i < appended.size(); i++) {
+			if (unsynced.count(appended[i].second) == 0) continue;
+			Entry* e = appended[i].first;
+			e->rcpts.push_back(appended[i].second);
+			mailbox_reserve(appended[i].second, e->header.length() + e->mail.data.length());
+		}
+
+		vector<Entry*> done;
+		Mail none;
+		none.octets = none.body = 0;
+		none.frame = 0;
+		time_t now = time(0);
+		pthread_mutex_lock(&JOURNAL_LOCK);
+		for (size_t i = 0; i < batch.size(); i++) {
+			Entry* e = batch[i];
+			if (e->rcpts.empty()) {
+				write_record(RECORD_DONE, e->seq, "", "", none);
+				done.push_back(e);
+			} else {
+				e->failures++;
+				RETRY.insert(make_pair(now + min(1 << min(e->failures - 1, 6), JOURNAL_RETRY_MAX), e));
+			}
+		}
+		PENDING -= done.size();
+		if (PENDING == 0 && ftruncate(FD, 0) != 0) log_event(LOG_ERROR, 0, "Cannot truncate the delivery journal");
+		if (done.size() < batch.size()) pthread_cond_signal(&QUEUED);
+		pthread_cond_broadcast(&ROOM);
+		pthread_mutex_unlock(&JOURNAL_LOCK);
+		metrics_add(M_PENDING, -(int64_t)done.size());
+		metrics_add(M_RETRIES, batch.size() - done.size());
+
+		for (size_t i = 0; i < done.size(); i++) delete done[i];
+	}
+	return NULL;
+}
+
+// Collects the entries not done in the journals no running process holds,
+// in order. A record that is cut short or fails its crc ends a journal. The
+// journals stay locked until the caller has removed them.
+static void take_over(vector<int>& orphans, vector<string>& paths, vector<Entry*>& entries){
+	DIR* d = opendir(MAILBOX_DIR);
+	if (d == NULL) return;
+	struct dirent* ent;
+	while ((ent = readdir(d)) != NULL) {
+		if (strncmp(ent->d_name, ".journal.", 9) != 0) continue;
+		string path = string(MAILBOX_DIR) + "/" + ent->d_name;
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) continue;
+		struct stat st;
+		if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0 || st.st_nlink == 0) {
+			// its process still runs, or another one took it over
+			close(fd);
+			continue;
+		}
+		string buf(st.st_size, '\0');
+		size_t got = 0;
+		for (ssize_t r; got < buf.size() && (r = read(fd, &buf[got], buf.size() - got)) > 0;) got += r;
+		orphans.push_back(fd);
+		paths.push_back(path);
+
+		map<uint64_t, Entry*> undone;
+		for (size_t pos = 0; pos + sizeof(Record) <= got;) {
+			Record r;
+			memcpy(&r, buf.data() + pos, sizeof(r));
+			size_t payload = (size_t)r.rcpts_len + r.header_len + r.data_len;
+			if (memcmp(r.magic, RECORD_MAGIC, sizeof(r.magic)) != 0 || payload > got - pos - sizeof(r)) break;
+			uint32_t crc = r.crc;
+			r.crc = 0;
+			uLong check = crc32(crc32(0, (const Bytef*)&r, sizeof(r)), (const Bytef*)buf.data() + pos + sizeof(r), payload);
+			if (check != crc) break;
+
+			const char* p = buf.data() + pos + sizeof(r);
+			if (r.type == RECORD_DONE) {
+				map<uint64_t, Entry*>::iterator it = undone.find(r.seq);
+				if (it != undone.end()) {
+					delete it->second;
+					undone.erase(it);
+				}
+			} else if (r.type == RECORD_MAIL) {
+				Entry* e = new Entry();
+				e->failures = 0;
+				for (const char* name = p; name < p + r.rcpts_len; name += strlen(name) + 1) {
+					Mailbox* mb = mailbox_find(name);
+					if (mb != NULL) e->rcpts.push_back(mb);
+				}
+				e->header.assign(p + r.rcpts_len, r.header_len);
+				e->mail.data.assign(p + r.rcpts_len + r.header_len, r.data_len);
+				e->mail.octets = r.octets;
+				e->mail.body = r.body;
+				e->mail.frame = r.frame;
+				undone[r.seq] = e;
+			}
+			pos += sizeof(r) + payload;
+		}
+		for (map<uint64_t, Entry*>::iterator it = undone.begin(); it != undone.end(); it++) {
+			if (it->second->rcpts.empty()) delete it->second;
+			else entries.push_back(it->second);
+		}
+	}
+	closedir(d);
+	if (!entries.empty()) log_event(LOG_INFO, 0, "Delivering mail left in the journal of a stopped process");
+}
@@ -0,0 +1,188 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include "log.h"
+using namespace std;
+
+const char* LEVELS[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+
+int LOG_LEVEL = LOG_INFO;
+
+struct LogRecord {
+	int64_t time;       // CLOCK_REALTIME in ns
+	int level;
+	int conn;           // connection fd, -1 for none
+	const char* event;  // static text, formatted by the drain thread
+	int len;            // original text length, may exceed LOG_TEXT_SIZE
+	char text[LOG_TEXT_SIZE];
+};
+
+// single producer (owning thread), single consumer (drain thread)
+struct LogRing {
+	LogRecord records[LOG_RING_SIZE];
+	atomic<uint32_t> head;   // next record to write, owned by producer
+	atomic<uint32_t> tail;   // next record to read, owned by drain thread
+	atomic<bool> closed;     // producer thread has exited
+	atomic<int64_t> dropped;
+};
+
+static vector<LogRing*> RINGS;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER; // one drainer at a time
+static bool STARTED = false;
+
+// hands the ring to the drain thread when the owning thread exits
+struct RingHolder {
+	LogRing* ring;
+	~RingHolder() {
+		if (ring != NULL) ring->closed.store(true, memory_order_release);
+	}
+};
+static thread_local RingHolder LOCAL = { NULL };
+
+static LogRing* local_ring(){
+	if (LOCAL.ring == NULL) {
+		LogRing* ring = new LogRing();
+		pthread_mutex_lock(&rings_mutex);
+		RINGS.push_back(ring);
+		pthread_mutex_unlock(&rings_mutex);
+		LOCAL.ring = ring;
+	}
+	return LOCAL.ring;
+}
+
+void log_record(int level, int conn, const char* event, const char* text, int len){
+	LogRing* ring = local_ring();
+	uint32_t head = ring->head.load(memory_order_relaxed);
+	if (head - ring->tail.load(memory_order_acquire) == LOG_RING_SIZE) {
+		ring->dropped.fetch_add(1, memory_order_relaxed);
+		return;
+	}
+
+	LogRecord& r = ring->records[head % LOG_RING_SIZE];
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	r.time = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	r.level = level;
+	r.conn = conn;
+	r.event = event;
+	if (text == NULL) len = 0;
+	else if (len < 0) len = strlen(text);
+	r.len = len;
+	memcpy(r.text, text, min(len, LOG_TEXT_SIZE));
+	ring->head.store(head + 1, memory_order_release);
+}
+
+// appends text with CR/LF at the end stripped and other control bytes escaped
+static void append_text(string& out, const char* text, int len){
+	while (len > 0 && (text[len - 1] == '\n' || text[len - 1] == '\r')) len--;
+	for (int i = 0; i < len; i++) {
+		unsigned char c = text[i];
+		if (c >= 0x20 && c < 0x7f) {
+			out += c;
+		} else {
+			char hex[8];
+			snprintf(hex, sizeof(hex), "<0x%02X>", c);
+			out += hex;
+		}
+	}
+}
+
+static void format_record(string& out, LogRecord& r){
+	char prefix[64];
+	time_t sec = r.time / 1000000000;
+	struct tm tm;
+	localtime_r(&sec, &tm);
+	int n = strftime(prefix, sizeof(prefix), "%Y-%m-%d %H:%M:%S", &tm);
+	snprintf(prefix + n, sizeof(prefix) - n, ".%06d %-5s ", (int)(r.time % 1000000000 / 1000), LEVELS[r.level]);
+	out += prefix;
+	if (r.conn >= 0) out += "[" + to_string(r.conn) + "] ";
+	append_text(out, r.event, strlen(r.event));
+	append_text(out, r.text, min(r.len, LOG_TEXT_SIZE));
+	if (r.len > LOG_TEXT_SIZE) out += "...";
+	out += "\n";
+}
+
+static bool record_before(LogRecord* a, LogRecord* b){
+	return a->time < b->time;
+}
+
+// drains all rings once, in timestamp order; returns number of records written
+static int drain(){
+	pthread_mutex_lock(&drain_mutex);
+	pthread_mutex_lock(&rings_mutex);
+	vector<LogRing*> rings = RINGS;
+	pthread_mutex_unlock(&rings_mutex);
+
+	vector<LogRecord*> batch;
+	vector<uint32_t> heads(rings.size());
+	string out;
+	for (int i = 0; i < rings.size(); i++) {
+		LogRing* ring = rings[i];
+		uint32_t tail = ring->tail.load(memory_order_relaxed);
+		heads[i] = ring->head.load(memory_order_acquire);
+		for (uint32_t t = tail; t != heads[i]; t++) {
+			batch.push_back(&ring->records[t % LOG_RING_SIZE]);
+		}
+		int64_t dropped = ring->dropped.exchange(0, memory_order_relaxed);
+		if (dropped > 0) out += "log: " + to_string(dropped) + " records dropped\n";
+	}
+	stable_sort(batch.begin(), batch.end(), record_before);
+	for (int i = 0; i < batch.size(); i++) {
+		format_record(out, *batch[i]);
+	}
+	for (size_t off = 0; off < out.length();) {
+		int w = write(2, out.data() + off, out.length() - off);
+		if (w <= 0) break;
+		off += w;
+	}
+
+	// release the records, and the rings of exited threads once they are empty
+	for (int i = 0; i < rings.size(); i++) {
+		LogRing* ring = rings[i];
+		ring->tail.store(heads[i], memory_order_release);
+		if (ring->closed.load(memory_order_acquire) && ring->head.load(memory_order_acquire) == heads[i]) {
+			pthread_mutex_lock(&rings_mutex);
+			RINGS.erase(find(RINGS.begin(), RINGS.end(), ring));
+			pthread_mutex_unlock(&rings_mutex);
+			delete ring;
+		}
+	}
+	pthread_mutex_unlock(&drain_mutex);
+	return batch.size();
+}
+
+static void *drain_thread(void *arg){
+	// poll with a short sleep, back off to 10ms while idle
+	long idle_us = 1000;
+	while (true) {
+		if (drain() > 0) {
+			idle_us = 1000;
+		} else if (idle_us < 10000) {
+			idle_us *= 2;
+		}
+		usleep(idle_us);
+	}
+	return NULL;
+}
+
+void log_flush(){
+	if (STARTED) drain();
+}
+
+void log_init(int level){
+	LOG_LEVEL = level;
+	STARTED = true;
+	atexit(log_flush);
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, drain_thread, NULL);
+	pthread_detach(thread);
+}
@@ -0,0 +1,1120 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <time.h>
+#include <iostream>
+#include <map>
+#include <deque>
+#include <zlib.h>
+#include <openssl/evp.h>
+#include "mailbox.h"
+#include "metrics.h"
+#include "scan.h"
+using namespace std;
+
+char* MAILBOX_DIR;
+static bool SHARED = true; // other processes write the files too, see mailbox_init()
+static int COMPRESS = 0;   // zlib level for delivered mail, 0 stores text
+static off_t QUOTA = 0;    // bytes per mailbox, 0 for unlimited
+const int CHUNK_SIZE = 65536;
+
+// mailboxes looked up so far, and names that were not found lately
+static pthread_mutex_t REGISTRY_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static map<string, Mailbox*> MAILBOXES;
+static map<string, time_t> UNKNOWN;                // name to when it expires
+static deque<pair<string, time_t> > UNKNOWN_ORDER; // oldest first
+static int M_MAILBOXES, M_UNKNOWN_HITS, M_LOOKUPS;
+
+// lru of cached indexes; lock order is Mailbox::lock, then LRU_LOCK
+static pthread_mutex_t LRU_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static Mailbox LRU; // list head
+static size_t CACHE_BUDGET, CACHE_USED;
+static int M_HITS, M_MISSES, M_TAIL_PARSES, M_EVICTIONS, M_CACHE_BYTES;
+
+static void load_deletions(Mailbox* mb, ino_t ino);
+
+// .idx file: a header, then one record per message
+const int FINGERPRINT_SIZE = 64;
+struct IndexHeader {
+	char magic[8];
+	uint64_t ino;
+	int64_t size;
+	uint64_t tail_hash;
+	int64_t count;
+};
+struct IndexRecord {
+	int64_t offset;
+	int64_t length;
+	int64_t octets;
+	int64_t body;
+	int32_t header_len;
+	int32_t frame;
+	int32_t stuffed;
+};
+static const char INDEX_MAGIC[8] = "mbxidx4";
+
+// .del file: one batch per pop3 QUIT, a header and the deleted messages
+struct DeletionHeader {
+	char magic[8];
+	uint64_t ino;    // of the mailbox file the offsets are in
+	uint32_t count;
+	uint32_t crc;    // of the header with crc 0 and the records
+};
+struct DeletionRecord {
+	int64_t offset;
+	int64_t size;
+};
+static const char DELETION_MAGIC[8] = "mbxdel1";
+const off_t COMPACT_MIN = 65536; // deleted bytes before a mailbox is compacted
+
+// shared: smtp and pop3 run as separate processes, so file access is also
+// serialized with flock(); maild is the only writer and skips it
+// cache_kb: memory for cached indexes, 0 parses the file on every login
+// compress: zlib level for delivered mail, 0 stores plain text
+// quota_kb: size a mailbox may grow to, 0 for unlimited
+void mailbox_init(const char* dir, bool shared, long cache_kb, int compress, long quota_kb){
+	MAILBOX_DIR = new char[strlen(dir) + 1];
+	strcpy(MAILBOX_DIR, dir);
+	SHARED = shared;
+	COMPRESS = compress;
+	QUOTA = (off_t)quota_kb * 1024;
+	CACHE_BUDGET = cache_kb * 1024;
+	LRU.lru_prev = LRU.lru_next = &LRU;
+
+	M_HITS = metrics_counter("mailbox_cache_hits_total", "Mailbox opens served from the cached index.");
+	M_MISSES = metrics_counter("mailbox_cache_misses_total", "Mailbox opens that parsed the whole file.");
+	M_TAIL_PARSES = metrics_counter("mailbox_tail_parses_total", "Mailbox opens that parsed only mail appended since the index was cached or saved.");
+	M_EVICTIONS = metrics_counter("mailbox_cache_evictions_total", "Cached indexes dropped for the memory budget.");
+	M_CACHE_BYTES = metrics_gauge("mailbox_cache_bytes", "Memory held by cached indexes.");
+
+	M_MAILBOXES = metrics_gauge("mailbox_registry_size", "Mailboxes looked up since startup and kept in memory.");
+	M_LOOKUPS = metrics_counter("mailbox_lookups_total", "Mailbox names looked up on disk.");
+	M_UNKNOWN_HITS = metrics_counter("mailbox_unknown_hits_total", "Lookups answered from the cache of unknown names.");
+
+	// mailboxes are found on demand, see mailbox_find()
+	struct stat st;
+	if (stat(MAILBOX_DIR, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		cerr << "cannot open mailbox directory\r\n";
+		exit(4);
+	}
+}
+
+// "ab/cd/": the first two bytes of the MD5 of the user name, in hex
+static string shard_of(const string& name){
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int len;
+	EVP_Digest(name.data(), name.length() - 5, md, &len, EVP_md5(), NULL); // without .mbox
+	char shard[7];
+	snprintf(shard, sizeof(shard), "%02x/%02x/", md[0], md[1]);
+	return shard;
+}
+
+static Mailbox* new_mailbox(const string& name, const string& shard, struct stat& st){
+	Mailbox* mb = new Mailbox();
+	mb->name = name;
+	mb->shard = shard;
+	pthread_mutex_init(&mb->lock, NULL);
+	pthread_mutex_init(&mb->maildrop, NULL);
+	mb->cached = false;
+	mb->cost = 0;
+	mb->saved = 0;
+	mb->lru_prev = mb->lru_next = NULL;
+	mb->gone_bytes = 0;
+	mb->del_ino = 0;
+	mb->del_size = -1;
+	mb->del_valid = 0;
+	mb->del_stale = false;
+	load_deletions(mb, st.st_ino);
+	mb->usage = st.st_size - mb->gone_bytes;
+	mb->pending = 0;
+	return mb;
+}
+
+// remembers that name was not found, the oldest names go first when full
+static void remember_unknown(const string& name, time_t now){
+	while (UNKNOWN_ORDER.size() >= UNKNOWN_CACHE_SIZE) {
+		map<string, time_t>::iterator it = UNKNOWN.find(UNKNOWN_ORDER.front().first);
+		if (it != UNKNOWN.end() && it->second == UNKNOWN_ORDER.front().second) UNKNOWN.erase(it);
+		UNKNOWN_ORDER.pop_front();
+	}
+	UNKNOWN[name] = now + UNKNOWN_CACHE_TTL;
+	UNKNOWN_ORDER.push_back(make_pair(name, now + UNKNOWN_CACHE_TTL));
+}
+
+// NULL if there is no such mailbox. Names are "<user>.mbox" and looked up in
+// the shard directory of the user, then at the top of the mailbox directory;
+// a mailbox found stays in the registry, one not found is not looked for
+// again for UNKNOWN_CACHE_TTL.
+Mailbox* mailbox_find(const string& name){
+	// only plain file names, the users come from the clients
+	if (name.length() <= 5 || name.compare(name.length() - 5, 5, ".mbox") != 0 || name[0] == '.'
+			|| name.find('/') != string::npos || name.find('\0') != string::npos) {
+		return NULL;
+	}
+	time_t now = time(0);
+	pthread_mutex_lock(&REGISTRY_LOCK);
+	map<string, Mailbox*>::iterator it = MAILBOXES.find(name);
+	if (it != MAILBOXES.end()) {
+		pthread_mutex_unlock(&REGISTRY_LOCK);
+		return it->second;
+	}
+	map<string, time_t>::iterator unknown = UNKNOWN.find(name);
+	if (unknown != UNKNOWN.end() && unknown->second > now) {
+		pthread_mutex_unlock(&REGISTRY_LOCK);
+		metrics_add(M_UNKNOWN_HITS, 1);
+		return NULL;
+	}
+	pthread_mutex_unlock(&REGISTRY_LOCK);
+
+	// the disk is looked at without the lock; a session that finds the same
+	// mailbox meanwhile gets the one registered first
+	metrics_add(M_LOOKUPS, 1);
+	string shard = shard_of(name);
+	struct stat st;
+	bool found = stat((string(MAILBOX_DIR) + "/" + shard + name).c_str(), &st) == 0 && S_ISREG(st.st_mode);
+	if (!found) {
+		shard = "";
+		found = stat((string(MAILBOX_DIR) + "/" + name).c_str(), &st) == 0 && S_ISREG(st.st_mode);
+	}
+	Mailbox* mb = found ? new_mailbox(name, shard, st) : NULL;
+
+	pthread_mutex_lock(&REGISTRY_LOCK);
+	if (mb == NULL) {
+		remember_unknown(name, now);
+	} else {
+		UNKNOWN.erase(name);
+		pair<map<string, Mailbox*>::iterator, bool> added = MAILBOXES.insert(make_pair(name, mb));
+		if (!added.second) {
+			pthread_mutex_destroy(&mb->lock);
+			pthread_mutex_destroy(&mb->maildrop);
+			delete mb;
+			mb = added.first->second;
+		} else {
+			metrics_add(M_MAILBOXES, 1);
+		}
+	}
+	pthread_mutex_unlock(&REGISTRY_LOCK);
+	return mb;
+}
+
+string mailbox_path(Mailbox* mb){
+	return string(MAILBOX_DIR) + "/" + mb->shard + mb->name;
+}
+
+static int64_t now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void file_lock(int fd, int op){
+	if (SHARED) flock(fd, op);
+}
+
+static bool stat_matches(Mailbox* mb, struct stat& st){
+	return mb->cached && mb->dev == st.st_dev && mb->ino == st.st_ino && mb->size == st.st_size
+		&& mb->mtime.tv_sec == st.st_mtim.tv_sec && mb->mtime.tv_nsec == st.st_mtim.tv_nsec;
+}
+
+// hash of the bytes before size, 0 if they do not end a line
+static uint64_t fingerprint(int fd, off_t size){
+	char buff[FINGERPRINT_SIZE];
+	off_t start = size > FINGERPRINT_SIZE ? size - FINGERPRINT_SIZE : 0;
+	if (size == 0) return 1;
+	if (pread(fd, buff, size - start, start) != size - start || buff[size - start - 1] != '\n') return 0;
+
+	uint64_t hash = 14695981039346656037ULL; // FNV-1a
+	for (int i = 0; i < size - start; i++) {
+		hash = (hash ^ (unsigned char)buff[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+static void remember_stat(Mailbox* mb, int fd, struct stat& st){
+	mb->dev = st.st_dev;
+	mb->ino = st.st_ino;
+	mb->size = st.st_size;
+	mb->mtime = st.st_mtim;
+	mb->tail_hash = fingerprint(fd, st.st_size);
+}
+
+// Whether the file is the one the index describes with mail appended: same
+// inode, not smaller, and the bytes at the end of the indexed part unchanged.
+// A compaction writes a new file, so this is enough to tell an append from a
+// rewrite.
+static bool appended_to(Mailbox* mb, int fd, struct stat& st){
+	return mb->dev == st.st_dev && mb->ino == st.st_ino && mb->size <= st.st_size
+		&& mb->tail_hash != 0 && fingerprint(fd, mb->size) == mb->tail_hash;
+}
+
+static string index_path(Mailbox* mb){
+	return mailbox_path(mb) + ".idx";
+}
+
+// Loads the saved index of the mailbox open as fd, if it still describes the
+// start of the file. Otherwise the index is left empty, to be parsed from 0.
+static void load_index(Mailbox* mb, int fd, struct stat& st){
+	mb->index.clear();
+	mb->size = 0;
+	mb->saved = 0;
+	int idx = open(index_path(mb).c_str(), O_RDONLY);
+	if (idx < 0) return;
+
+	IndexHeader h;
+	bool ok = pread(idx, &h, sizeof(h), 0) == sizeof(h) && memcmp(h.magic, INDEX_MAGIC, 8) == 0
+		&& h.ino == st.st_ino && h.size <= st.st_size && h.count >= 0 && h.count <= h.size;
+	if (ok) {
+		mb->dev = st.st_dev;
+		mb->ino = st.st_ino;
+		mb->size = h.size;
+		mb->tail_hash = h.tail_hash;
+		ok = appended_to(mb, fd, st);
+	}
+	vector<IndexRecord> records(ok ? h.count : 0);
+	if (ok && h.count > 0) {
+		size_t n = h.count * sizeof(IndexRecord);
+		ok = pread(idx, &records[0], n, sizeof(h)) == (ssize_t)n;
+		// records are written before the header, a crash in between leaves
+		// a last message that does not end at the saved size
+		IndexRecord& last = records.back();
+		ok = ok && last.offset + last.header_len + last.length == h.size;
+	}
+	close(idx);
+
+	if (!ok) {
+		mb->size = 0;
+		return;
+	}
+	mb->index.resize(records.size());
+	for (int i = 0; i < records.size(); i++) {
+		Message& m = mb->index[i];
+		m.offset = records[i].offset;
+		m.header_len = records[i].header_len;
+		m.length = records[i].length;
+		m.octets = records[i].octets;
+		m.body = records[i].body;
+		m.frame = records[i].frame;
+		m.stuffed = records[i].stuffed != 0;
+		m.deleted = false;
+	}
+	mb->saved = records.size();
+}
+
+// Writes the index entries from first on, and any the file is missing, then
+// the header that makes them valid.
+static void save_index(Mailbox* mb, size_t first){
+	int idx = open(index_path(mb).c_str(), O_WRONLY | O_CREAT, 0644);
+	if (idx < 0) return;
+	first = min(first, mb->saved);
+
+	vector<IndexRecord> records(mb->index.size() - first);
+	for (int i = 0; i < records.size(); i++) {
+		Message& m = mb->index[first + i];
+		records[i].offset = m.offset;
+		records[i].header_len = m.header_len;
+		records[i].length = m.length;
+		records[i].octets = m.octets;
+		records[i].body = m.body;
+		records[i].frame = m.frame;
+		records[i].stuffed = m.stuffed;
+	}
+	IndexHeader h;
+	memcpy(h.magic, INDEX_MAGIC, 8);
+	h.ino = mb->ino;
+	h.size = mb->size;
+	h.tail_hash = mb->tail_hash;
+	h.count = mb->index.size();
+
+	size_t n = records.size() * sizeof(IndexRecord);
+	bool ok = n == 0 || pwrite(idx, &records[0], n, sizeof(h) + first * sizeof(IndexRecord)) == (ssize_t)n;
+	ok = ok && ftruncate(idx, sizeof(h) + h.count * sizeof(IndexRecord)) == 0;
+	ok = ok && pwrite(idx, &h, sizeof(h), 0) == sizeof(h);
+	close(idx);
+	mb->saved = ok ? mb->index.size() : 0;
+}
+
+static bool write_all(int fd, const char* p, size_t n){
+	while (n > 0) {
+		ssize_t w = write(fd, p, n);
+		if (w <= 0) return false;
+		p += w;
+		n -= w;
+	}
+	return true;
+}
+
+static bool pread_all(int fd, char* p, size_t n, off_t offset){
+	while (n > 0) {
+		ssize_t r = pread(fd, p, n, offset);
+		if (r <= 0) return false;
+		p += r;
+		n -= r;
+		offset += r;
+	}
+	return true;
+}
+
+static bool pwrite_all(int fd, const char* p, size_t n, off_t offset){
+	while (n > 0) {
+		ssize_t w = pwrite(fd, p, n, offset);
+		if (w <= 0) return false;
+		p += w;
+		n -= w;
+		offset += w;
+	}
+	return true;
+}
+
+static string deletions_path(Mailbox* mb){
+	return mailbox_path(mb) + ".del";
+}
+
+// Reads the deletion log again if it changed since it was read for the
+// mailbox file with inode ino. Batches for another file, left by a compaction
+// that did not finish, are skipped; a torn batch ends the log.
+static void load_deletions(Mailbox* mb, ino_t ino){
+	struct stat st;
+	int fd = open(deletions_path(mb).c_str(), O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		st.st_size = 0;
+		st.st_mtim.tv_sec = st.st_mtim.tv_nsec = 0;
+	}
+	if (mb->del_ino == ino && mb->del_size == st.st_size && mb->del_mtime.tv_sec == st.st_mtim.tv_sec
+		&& mb->del_mtime.tv_nsec == st.st_mtim.tv_nsec) {
+		if (fd >= 0) close(fd);
+		return;
+	}
+
+	mb->gone.clear();
+	mb->gone_bytes = 0;
+	mb->del_ino = ino;
+	mb->del_size = st.st_size;
+	mb->del_mtime = st.st_mtim;
+	mb->del_valid = 0;
+	mb->del_stale = false;
+	string log(st.st_size, '\0');
+	if (fd < 0) return;
+	bool ok = st.st_size == 0 || pread_all(fd, &log[0], st.st_size, 0);
+	close(fd);
+
+	for (size_t at = 0; ok && at + sizeof(DeletionHeader) <= log.length();) {
+		DeletionHeader h;
+		memcpy(&h, &log[at], sizeof(h));
+		size_t n = sizeof(h) + (size_t)h.count * sizeof(DeletionRecord);
+		if (memcmp(h.magic, DELETION_MAGIC, 8) != 0 || at + n > log.length()) break;
+		uint32_t crc = h.crc;
+		h.crc = 0;
+		uLong sum = crc32(crc32(0, (const Bytef*)&h, sizeof(h)), (const Bytef*)&log[at + sizeof(h)], n - sizeof(h));
+		if (sum != crc) break;
+
+		if (h.ino != ino) mb->del_stale = true;
+		for (uint32_t i = 0; h.ino == ino && i < h.count; i++) {
+			DeletionRecord r;
+			memcpy(&r, &log[at + sizeof(h) + i * sizeof(r)], sizeof(r));
+			if (mb->gone.insert(make_pair((off_t)r.offset, (off_t)r.size)).second) mb->gone_bytes += r.size;
+		}
+		at += n;
+		mb->del_valid = at;
+	}
+}
+
+// makes a rename or a new file in the directory of the mailbox durable
+static void sync_dir(Mailbox* mb){
+	int fd = open((string(MAILBOX_DIR) + "/" + mb->shard).c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd < 0) return;
+	fsync(fd);
+	close(fd);
+}
+
+// Appends a batch to the deletion log and syncs it; the batch counts from
+// then on. A torn batch after the last good one is cut off first, and a log
+// with batches for an older file is started over with all the deletions.
+static bool log_deletions(Mailbox* mb, const vector<DeletionRecord>& batch){
+	int fd = open(deletions_path(mb).c_str(), O_WRONLY | O_CREAT, 0644);
+	if (fd < 0) return false;
+	vector<DeletionRecord> records;
+	if (mb->del_stale) {
+		for (map<off_t, off_t>::iterator it = mb->gone.begin(); it != mb->gone.end(); ++it) {
+			DeletionRecord r = {it->first, it->second};
+			records.push_back(r);
+		}
+	}
+	records.insert(records.end(), batch.begin(), batch.end());
+
+	DeletionHeader h;
+	memcpy(h.magic, DELETION_MAGIC, 8);
+	h.ino = mb->del_ino;
+	h.count = records.size();
+	h.crc = 0;
+	h.crc = crc32(crc32(0, (const Bytef*)&h, sizeof(h)), (const Bytef*)&records[0], records.size() * sizeof(DeletionRecord));
+	string data((const char*)&h, sizeof(h));
+	data.append((const char*)&records[0], records.size() * sizeof(DeletionRecord));
+
+	off_t at = mb->del_stale ? 0 : mb->del_valid;
+	bool ok = ftruncate(fd, at) == 0 && pwrite_all(fd, data.data(), data.length(), at) && fdatasync(fd) == 0;
+	if (ok && at == 0) sync_dir(mb); // the log may be new
+	struct stat st;
+	if (ok && fstat(fd, &st) == 0) {
+		mb->del_size = st.st_size;
+		mb->del_mtime = st.st_mtim;
+		mb->del_valid = at + data.length();
+		mb->del_stale = false;
+	} else {
+		mb->del_size = -1; // read it again
+	}
+	close(fd);
+	return ok;
+}
+
+// the message of the cached index at offset, NULL if there is none
+static Message* find_message(Mailbox* mb, off_t offset){
+	size_t lo = 0, hi = mb->index.size();
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (mb->index[mid].offset < offset) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo < mb->index.size() && mb->index[lo].offset == offset ? &mb->index[lo] : NULL;
+}
+
+static bool copy_range(int in, int out, off_t offset, off_t n, vector<char>& chunk){
+	while (n > 0) {
+		size_t k = min((off_t)chunk.size(), n);
+		if (!pread_all(in, &chunk[0], k, offset) || !write_all(out, &chunk[0], k)) return false;
+		offset += k;
+		n -= k;
+	}
+	return true;
+}
+
+// Writes the messages that are not deleted to a new file and renames it over
+// the mailbox, then removes the deletion log. A crash before the rename
+// leaves the old file and its log, one after it a log for the old file, which
+// is skipped. The caller holds the lock of the file open as fd, whose index is
+// current; the index moves to the new offsets.
+static void compact(Mailbox* mb, int fd){
+	string path = mailbox_path(mb), tmp = path + ".tmp";
+	int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) return;
+	file_lock(out, LOCK_EX); // deliveries that open the new file wait for the index
+
+	// runs of kept messages are copied at once
+	vector<Message> index;
+	vector<char> chunk(CHUNK_SIZE);
+	off_t pos = 0, run = 0, run_end = 0;
+	bool ok = true;
+	for (int i = 0; ok && i < mb->index.size(); i++) {
+		Message m = mb->index[i];
+		if (mb->gone.count(m.offset)) continue;
+		if (m.offset != run_end) {
+			ok = copy_range(fd, out, run, run_end - run, chunk);
+			run = m.offset;
+		}
+		run_end = m.offset + m.header_len + m.length;
+		m.offset = pos;
+		pos += m.header_len + m.length;
+		index.push_back(m);
+	}
+	ok = ok && copy_range(fd, out, run, run_end - run, chunk);
+
+	struct stat st;
+	ok = ok && fdatasync(out) == 0 && fstat(out, &st) == 0 && rename(tmp.c_str(), path.c_str()) == 0;
+	if (!ok) {
+		unlink(tmp.c_str());
+		close(out);
+		return;
+	}
+	sync_dir(mb);
+	unlink(deletions_path(mb).c_str());
+
+	mb->index.swap(index);
+	remember_stat(mb, out, st);
+	mb->saved = 0;
+	save_index(mb, 0);
+	mb->usage = st.st_size;
+	mb->gone.clear();
+	mb->gone_bytes = 0;
+	mb->del_ino = st.st_ino;
+	mb->del_size = 0;
+	mb->del_mtime.tv_sec = mb->del_mtime.tv_nsec = 0;
+	mb->del_valid = 0;
+	mb->del_stale = false;
+	close(out);
+}
+
+// Opens the mailbox file and locks it. A compaction in another process may
+// have renamed a new file over the one that got locked, then the new one is
+// opened.
+static int open_locked(Mailbox* mb, int flags, int op){
+	string path = mailbox_path(mb);
+	while (true) {
+		int fd = open(path.c_str(), flags, 0644);
+		if (fd < 0 || !SHARED) return fd;
+		flock(fd, op);
+		struct stat st, now;
+		if (fstat(fd, &st) != 0 || stat(path.c_str(), &now) != 0 || now.st_ino == st.st_ino) return fd;
+		close(fd);
+	}
+}
+
+static void lru_unlink(Mailbox* mb){
+	if (mb->lru_next == NULL) return;
+	mb->lru_prev->lru_next = mb->lru_next;
+	mb->lru_next->lru_prev = mb->lru_prev;
+	mb->lru_prev = mb->lru_next = NULL;
+}
+
+static void lru_push_front(Mailbox* mb){
+	mb->lru_prev = &LRU;
+	mb->lru_next = LRU.lru_next;
+	LRU.lru_next->lru_prev = mb;
+	LRU.lru_next = mb;
+}
+
+// drops the index of mb, whose lock the caller holds
+static void cache_drop(Mailbox* mb){
+	mb->cached = false;
+	mb->saved = 0;
+	vector<Message>().swap(mb->index);
+}
+
+// Charges the index of mb, whose lock the caller holds, to the budget and
+// marks it most recently used. Then drops the least recently used indexes
+// until the cache fits, skipping mailboxes other threads have locked.
+static void cache_update(Mailbox* mb){
+	pthread_mutex_lock(&LRU_LOCK);
+	size_t cost = mb->cached ? mb->index.capacity() * sizeof(Message) : 0;
+	CACHE_USED += cost - mb->cost;
+	metrics_add(M_CACHE_BYTES, (int64_t)cost - (int64_t)mb->cost);
+	mb->cost = cost;
+	lru_unlink(mb);
+	if (mb->cached) lru_push_front(mb);
+
+	for (Mailbox* v = LRU.lru_prev; v != &LRU && CACHE_USED > CACHE_BUDGET;) {
+		Mailbox* prev = v->lru_prev;
+		if (v == mb || pthread_mutex_trylock(&v->lock) == 0) {
+			cache_drop(v);
+			CACHE_USED -= v->cost;
+			metrics_add(M_CACHE_BYTES, -(int64_t)v->cost);
+			metrics_add(M_EVICTIONS, 1);
+			v->cost = 0;
+			lru_unlink(v);
+			if (v != mb) pthread_mutex_unlock(&v->lock);
+		}
+		v = prev;
+	}
+	pthread_mutex_unlock(&LRU_LOCK);
+}
+
+// size of a line once it ends in CRLF; len excludes the LF
+static off_t line_octets(const char* line, size_t len){
+	return len > 0 && line[len - 1] == '\r' ? len + 1 : len + 2;
+}
+
+// size of data once every line ends in CRLF, as mailbox_stream() sends it:
+// one more byte per bare LF, and a line ending for a last line without one
+static off_t crlf_size(const char* p, size_t n){
+	off_t octets = n + scan_bare_lf(p, p + n, 0);
+	if (n > 0 && p[n - 1] != '\n') octets += p[n - 1] == '\r' ? 1 : 2;
+	return octets;
+}
+
+// offset of the body: just past the first empty line, -1 if there is none
+static off_t body_offset(const char* p, size_t n){
+	for (size_t start = 0; start < n;) {
+		const char* nl = (const char*)memchr(p + start, '\n', n - start);
+		size_t end = nl != NULL ? nl - p : n;
+		if (end == start || (end == start + 1 && p[start] == '\r')) return end + 1;
+		start = end + 1;
+	}
+	return -1;
+}
+
+// Whether size more bytes keep the mailbox within its quota. The usage is
+// counted on delivery and QUIT; with separate smtp and pop3 processes the
+// other one changes the file too, and the usage is its size less the
+// messages in the deletion log. Mail in the journal counts as well, and so
+// does mail a session is delivering: with reserve, the bytes that fit are
+// reserved in the same step, until the caller gives them back with
+// mailbox_reserve().
+bool mailbox_fits(Mailbox* mb, off_t size, bool reserve){
+	if (QUOTA == 0) return true;
+	pthread_mutex_lock(&mb->lock);
+	struct stat st;
+	if (SHARED && stat(mailbox_path(mb).c_str(), &st) == 0) {
+		load_deletions(mb, st.st_ino);
+		mb->usage = st.st_size - mb->gone_bytes;
+	}
+	bool fits = mb->usage + mb->pending + size <= QUOTA;
+	if (fits && reserve) mb->pending += size;
+	pthread_mutex_unlock(&mb->lock);
+	return fits;
+}
+
+// Counts size bytes of mail in the journal, or being delivered, against the
+// quota until it is appended; a negative size takes them back.
+void mailbox_reserve(Mailbox* mb, off_t size){
+	if (QUOTA == 0) return;
+	pthread_mutex_lock(&mb->lock);
+	mb->pending += size;
+	pthread_mutex_unlock(&mb->lock);
+}
+
+// a line in the mail that starts with "From " would start a message of its
+// own when the file is parsed, so it is stored as ">From "; so is a first
+// line that starts with "=zlib ", which would be taken for a compressed frame
+static bool quote_from(const string& data, string& quoted){
+	const char* p = data.data();
+	const char* end = p + data.length();
+	const char* from = scan_from(p, end);
+	bool first = data.compare(0, 5, "From ") == 0 || data.compare(0, 6, "=zlib ") == 0;
+	if (from == NULL && !first) return false;
+	quoted.reserve(data.length() + 16);
+	if (first) quoted += '>';
+	for (; from != NULL; from = scan_from(from + 1, end)) {
+		quoted.append(p, from + 1 - p);
+		quoted += '>';
+		p = from + 1;
+	}
+	quoted.append(p, end - p);
+	return true;
+}
+
+// Sizes the data for the index and compresses it if that is on and pays off.
+void mailbox_prepare(Mail& mail, const string& raw){
+	string quoted;
+	const string& data = quote_from(raw, quoted) ? quoted : raw;
+	mail.octets = crlf_size(data.data(), data.length());
+	mail.body = body_offset(data.data(), data.length());
+	mail.frame = 0;
+
+	if (COMPRESS > 0 && data.length() > 0) {
+		uLongf stored = compressBound(data.length());
+		string frame(stored, '\0');
+		if (compress2((Bytef*)&frame[0], &stored, (const Bytef*)data.data(), data.length(), COMPRESS) == Z_OK && stored < data.length()) {
+			char line[100];
+			mail.frame = snprintf(line, sizeof(line), "=zlib %lu %lu %lld %lld\n", (unsigned long)stored,
+				(unsigned long)data.length(), (long long)mail.octets, (long long)mail.body);
+			frame.resize(stored);
+			mail.data = line + frame + "\n";
+			return;
+		}
+	}
+	mail.data = data;
+}
+
+// the "From " line a delivery is stored under, see UNSTUFFED_MARK
+string mailbox_from_line(const string& sender, time_t when){
+	string time = ctime(&when); // convert raw time to calendar time
+	time.insert(time.length() - 1, UNSTUFFED_MARK);
+	return "From <" + sender + "> " + time;
+}
+
+// whether the mail under this "From " line kept the dots stuffed by the client
+static bool stored_stuffed(const char* line, size_t len){
+	size_t mark = strlen(UNSTUFFED_MARK);
+	while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) len--;
+	return len < mark || memcmp(line + len - mark, UNSTUFFED_MARK, mark) != 0;
+}
+
+// Appends one mail, false if it could not be written; the file is then cut
+// back, so no torn message is left for later appends to follow. If the
+// cached index is current it gets the new message, so the next pop3 login
+// does not parse the file. Sets waited to the ns spent waiting for the
+// mailbox lock.
+bool mailbox_deliver(Mailbox* mb, const string& header, const Mail& mail, int64_t* waited){
+	const string& data = mail.data;
+	int64_t start = now_ns();
+	pthread_mutex_lock(&mb->lock);
+	if (waited != NULL) *waited = now_ns() - start;
+
+	bool written = false;
+	int fd = open_locked(mb, O_RDWR | O_APPEND | O_CREAT, LOCK_EX);
+	if (fd >= 0) {
+		struct stat st;
+		fstat(fd, &st);
+		bool current = stat_matches(mb, st);
+
+		struct iovec iov[2] = {{(void*)header.data(), header.length()}, {(void*)data.data(), data.length()}};
+		ssize_t w = writev(fd, iov, 2);
+		written = w == (ssize_t)(header.length() + data.length());
+		if (!written && w >= 0) {
+			// short write, finish the part that is missing
+			if (w < header.length()) {
+				written = write_all(fd, header.data() + w, header.length() - w) && write_all(fd, data.data(), data.length());
+			} else {
+				written = write_all(fd, data.data() + (w - header.length()), data.length() - (w - header.length()));
+			}
+		}
+		if (!written) ftruncate(fd, st.st_size);
+
+		if (written) mb->usage += header.length() + data.length();
+		if (current && written) {
+			Message m;
+			m.offset = st.st_size;
+			m.header_len = header.length();
+			m.length = data.length();
+			m.octets = mail.octets;
+			m.body = mail.body;
+			m.frame = mail.frame;
+			m.stuffed = stored_stuffed(header.data(), header.length());
+			m.deleted = false;
+			mb->index.push_back(m);
+			fstat(fd, &st);
+			remember_stat(mb, fd, st);
+		} else {
+			cache_drop(mb);
+		}
+		cache_update(mb);
+		close(fd);
+	}
+
+	pthread_mutex_unlock(&mb->lock);
+	return written;
+}
+
+// Flushes appended mail to disk, for the delivery journal.
+bool mailbox_sync(Mailbox* mb){
+	int fd = open(mailbox_path(mb).c_str(), O_RDONLY);
+	if (fd < 0) return false;
+	bool ok = fdatasync(fd) == 0;
+	close(fd);
+	return ok;
+}
+
+// Brings the cached index up to date with the file open as fd, parsing it
+// only from where the cached or saved index ends. Returns the metric the
+// lookup counts as.
+static int refresh_index(Mailbox* mb, int fd, struct stat& st){
+	if (stat_matches(mb, st)) return M_HITS;
+	if (!mb->cached || !appended_to(mb, fd, st)) {
+		cache_drop(mb);
+		load_index(mb, fd, st);
+	}
+	int counted = mb->size > 0 ? M_TAIL_PARSES : M_MISSES;
+
+	// the last message may go on in the tail
+	size_t first = mb->index.empty() ? 0 : mb->index.size() - 1;
+	if (mb->size < st.st_size) read_mailbox(mb, mb->index, mb->size);
+	remember_stat(mb, fd, st);
+	mb->cached = true;
+	save_index(mb, first);
+	return counted;
+}
+
+// Index of the mailbox for a pop3 session, without the messages in the
+// deletion log.
+void mailbox_open(Mailbox* mb, vector<Message>& messages){
+	pthread_mutex_lock(&mb->lock);
+	int fd = open_locked(mb, O_RDONLY, LOCK_SH);
+	messages.clear();
+	if (fd < 0) {
+		pthread_mutex_unlock(&mb->lock);
+		return;
+	}
+
+	struct stat st;
+	fstat(fd, &st);
+	metrics_add(refresh_index(mb, fd, st), 1);
+	load_deletions(mb, st.st_ino);
+	if (mb->gone.empty()) {
+		messages = mb->index;
+	} else {
+		// both are in file order
+		messages.reserve(mb->index.size());
+		map<off_t, off_t>::iterator gone = mb->gone.begin();
+		for (int i = 0; i < mb->index.size(); i++) {
+			while (gone != mb->gone.end() && gone->first < mb->index[i].offset) ++gone;
+			if (gone == mb->gone.end() || gone->first != mb->index[i].offset) messages.push_back(mb->index[i]);
+		}
+	}
+	cache_update(mb);
+	close(fd);
+	pthread_mutex_unlock(&mb->lock);
+}
+
+// Deletes the messages marked in a pop3 session. They are appended to the
+// deletion log as one batch, and the sync of that batch is the commit: after
+// a crash either all of them or none are deleted. This costs I/O for the
+// deleted messages only; the file is rewritten once they are most of it, so
+// the copying is paid for by the deletions. Mail delivered during the session
+// stays. Returns false if the deletions could not be written.
+bool mailbox_commit(Mailbox* mb, vector<Message>& messages){
+	vector<DeletionRecord> batch;
+	for (int i = 0; i < messages.size(); i++) {
+		if (messages[i].deleted) {
+			DeletionRecord r = {messages[i].offset, messages[i].header_len + messages[i].length};
+			batch.push_back(r);
+		}
+	}
+	if (batch.empty()) return true; // nothing to write back
+
+	pthread_mutex_lock(&mb->lock);
+	int fd = open_locked(mb, O_RDONLY, LOCK_EX);
+	if (fd < 0) {
+		pthread_mutex_unlock(&mb->lock);
+		return false;
+	}
+	struct stat st;
+	fstat(fd, &st);
+	refresh_index(mb, fd, st);
+	load_deletions(mb, st.st_ino);
+
+	// only messages still in this file and not deleted yet
+	size_t n = 0;
+	for (int i = 0; i < batch.size(); i++) {
+		Message* m = find_message(mb, batch[i].offset);
+		if (m != NULL && m->header_len + m->length == batch[i].size && !mb->gone.count(batch[i].offset)) batch[n++] = batch[i];
+	}
+	batch.resize(n);
+
+	bool ok = batch.empty() || log_deletions(mb, batch);
+	for (int i = 0; ok && i < batch.size(); i++) {
+		mb->gone[batch[i].offset] = batch[i].size;
+		mb->gone_bytes += batch[i].size;
+		mb->usage -= batch[i].size;
+	}
+	if (ok && mb->gone_bytes >= COMPACT_MIN && mb->gone_bytes * 2 > st.st_size) compact(mb, fd);
+	cache_update(mb);
+	close(fd);
+	pthread_mutex_unlock(&mb->lock);
+	return ok;
+}
+
+// turns bare LF line endings into CRLF on the way to a sink, also when a
+// CR and its LF are in different chunks
+struct CrlfWriter {
+	MailSink sink;
+	void* arg;
+	char last; // of the previous chunk
+	string out;
+};
+
+static bool crlf_write(CrlfWriter& w, const char* p, size_t n){
+	if (n == 0) return true;
+	// mail that arrived by smtp has CRLF already
+	if (scan_bare_lf(p, p + n, w.last) == 0) {
+		w.last = p[n - 1];
+		return w.sink(w.arg, p, n);
+	}
+	w.out.clear();
+	size_t start = 0;
+	for (const char* nl = (const char*)memchr(p, '\n', n); nl != NULL; nl = (const char*)memchr(nl + 1, '\n', p + n - nl - 1)) {
+		size_t i = nl - p;
+		if ((i > 0 ? p[i - 1] : w.last) != '\r') {
+			w.out.append(p + start, i - start);
+			w.out += "\r\n";
+			start = i + 1;
+		}
+	}
+	w.last = p[n - 1];
+	if (start == 0) return w.sink(w.arg, p, n); // nothing to change
+	w.out.append(p + start, n - start);
+	return w.sink(w.arg, w.out.data(), w.out.length());
+}
+
+// ends a last line that has no line ending
+static bool crlf_finish(CrlfWriter& w){
+	if (w.last == '\n') return true;
+	return w.last == '\r' ? w.sink(w.arg, "\n", 1) : w.sink(w.arg, "\r\n", 2);
+}
+
+// position in the raw data of a message being streamed
+struct Stream {
+	CrlfWriter crlf;
+	off_t pos;
+	off_t body;
+	int lines; // body lines wanted, -1 for all
+	int found;
+	bool done;
+};
+
+// passes raw data on up to the end of the wanted lines
+static bool stream_raw(Stream& s, const char* p, size_t n){
+	size_t used = n;
+	if (s.lines >= 0 && s.body >= 0 && s.pos + (off_t)n >= s.body) {
+		size_t i = s.pos < s.body ? s.body - s.pos : 0;
+		if (s.lines == 0) {
+			used = i;
+			s.done = true;
+		}
+		for (; !s.done && i < n; i++) {
+			if (p[i] == '\n' && ++s.found == s.lines) {
+				used = i + 1;
+				s.done = true;
+			}
+		}
+	}
+	s.pos += used;
+	return crlf_write(s.crlf, p, used);
+}
+
+// inflates a zlib frame in chunks
+static bool stream_frame(Stream& s, int fd, const Message& m){
+	string line(m.frame, '\0');
+	long long stored, raw, octets, body;
+	if (!pread_all(fd, &line[0], m.frame, m.offset + m.header_len)
+		|| sscanf(line.c_str(), "=zlib %lld %lld %lld %lld", &stored, &raw, &octets, &body) != 4) return false;
+
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	if (inflateInit(&z) != Z_OK) return false;
+	vector<char> in(CHUNK_SIZE), out(CHUNK_SIZE);
+	off_t at = m.offset + m.header_len + m.frame, end = at + stored;
+	int ret = Z_OK;
+	bool ok = true;
+	while (ok && !s.done && ret != Z_STREAM_END) {
+		if (z.avail_in == 0) {
+			size_t n = min((off_t)CHUNK_SIZE, end - at);
+			if (n == 0 || !pread_all(fd, &in[0], n, at)) {
+				ok = false;
+				break;
+			}
+			at += n;
+			z.next_in = (Bytef*)&in[0];
+			z.avail_in = n;
+		}
+		z.next_out = (Bytef*)&out[0];
+		z.avail_out = CHUNK_SIZE;
+		ret = inflate(&z, Z_NO_FLUSH);
+		if (ret != Z_OK && ret != Z_STREAM_END) ok = false;
+		else ok = stream_raw(s, &out[0], CHUNK_SIZE - z.avail_out);
+	}
+	inflateEnd(&z);
+	return ok;
+}
+
+// Streams the data of a message with every line ending in CRLF to sink. With
+// lines >= 0 only the headers and that many body lines (TOP), and only the
+// bytes that are sent are read or inflated.
+bool mailbox_stream(Mailbox* mb, const Message& m, int lines, MailSink sink, void* arg){
+	int fd = open(mailbox_path(mb).c_str(), O_RDONLY);
+	if (fd < 0) return false;
+	Stream s;
+	s.crlf.sink = sink;
+	s.crlf.arg = arg;
+	s.crlf.last = '\n';
+	s.pos = 0;
+	s.body = m.body;
+	s.lines = lines;
+	s.found = 0;
+	s.done = false;
+
+	bool ok = true;
+	if (m.frame > 0) {
+		ok = stream_frame(s, fd, m);
+	} else {
+		vector<char> chunk(CHUNK_SIZE);
+		for (off_t at = 0; ok && !s.done && at < m.length;) {
+			size_t n = min((off_t)CHUNK_SIZE, m.length - at);
+			ok = pread_all(fd, &chunk[0], n, m.offset + m.header_len + at) && stream_raw(s, &chunk[0], n);
+			at += n;
+		}
+	}
+	close(fd);
+	return ok && crlf_finish(s.crlf);
+}
+
+static bool append_chunk(void* arg, const char* data, size_t len){
+	((string*)arg)->append(data, len);
+	return true;
+}
+
+// Reads the data of a message, with every line ending in CRLF.
+bool mailbox_read(Mailbox* mb, const Message& m, string& data){
+	data.clear();
+	data.reserve(m.octets);
+	return mailbox_stream(mb, m, -1, append_chunk, &data);
+}
+
+// start of the next message at or after the line start p, else end
+static const char* next_message(const char* p, const char* end){
+	if (end - p >= 5 && memcmp(p, "From ", 5) == 0) return p;
+	const char* from = scan_from(p, end);
+	return from != NULL ? from + 1 : end;
+}
+
+// adds whole lines to a message
+static void extend_message(Message& m, const char* p, size_t n){
+	if (m.body < 0) {
+		off_t body = body_offset(p, n);
+		if (body >= 0) m.body = m.length + body;
+	}
+	m.length += n;
+	m.octets += crlf_size(p, n);
+}
+
+// size of the "=zlib" frame at p, its line and the compressed data, or 0 if
+// there is none; the frame line has all the index needs
+static size_t zlib_frame(Message& m, const char* p, const char* end){
+	char line[100];
+	if (end - p < 6 || memcmp(p, "=zlib ", 6) != 0) return 0;
+	const char* nl = (const char*)memchr(p, '\n', min(end - p, (ptrdiff_t)sizeof(line)));
+	if (nl == NULL) return 0;
+	memcpy(line, p, nl - p);
+	line[nl - p] = '\0';
+	long long stored, raw, octets, body;
+	int n = 0;
+	if (sscanf(line, "=zlib %lld %lld %lld %lld%n", &stored, &raw, &octets, &body, &n) != 4 || n != nl - p) return 0;
+	// the data ends with a newline right before the next message; plain mail
+	// stored before "=zlib " was quoted is read as text
+	const char* after = nl + 1 + stored;
+	if (stored <= 0 || stored >= end - nl - 1 || *after != '\n'
+		|| (end - after > 1 && (end - after < 6 || memcmp(after + 1, "From ", 5) != 0))) return 0;
+	m.frame = nl + 1 - p;
+	m.octets = octets;
+	m.body = body;
+	return m.frame + stored + 1;
+}
+
+// Parses the file from a line start on: a "From " line starts a message,
+// other lines extend the last message in messages. The file is mapped, and
+// a message costs one scan for the next "From " line and one over its lines
+// for the CRLF size, while it is in cache; compressed data is skipped.
+void read_mailbox(Mailbox* mb, vector<Message>& messages, off_t from){
+	int fd = open(mailbox_path(mb).c_str(), O_RDONLY);
+	if (fd < 0) return;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size <= from) {
+		close(fd);
+		return;
+	}
+	off_t base = from - from % sysconf(_SC_PAGESIZE);
+	size_t mapped = st.st_size - base;
+	char* map = (char*)mmap(NULL, mapped, PROT_READ, MAP_PRIVATE, fd, base);
+	close(fd);
+	if (map == MAP_FAILED) return;
+	madvise(map, mapped, MADV_SEQUENTIAL);
+
+	const char* start = map + (from - base);
+	const char* end = map + mapped;
+	const char* p = next_message(start, end);
+	// lines before the first "From " line belong to no message
+	if (p > start && !messages.empty()) extend_message(messages.back(), start, p - start);
+	while (p < end) {
+		Message m;
+		m.offset = from + (p - start);
+		const char* nl = (const char*)memchr(p, '\n', end - p);
+		m.header_len = (nl != NULL ? nl + 1 : end) - p;
+		m.length = 0;
+		m.octets = 0;
+		m.body = -1;
+		m.frame = 0;
+		m.stuffed = stored_stuffed(p, m.header_len);
+		m.deleted = false;
+		p += m.header_len;
+
+		m.length = zlib_frame(m, p, end);
+		p += m.length;
+		const char* next = next_message(p, end);
+		extend_message(m, p, next - p);
+		messages.push_back(m);
+		p = next;
+	}
+	munmap(map, mapped);
+}
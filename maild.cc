@@ -0,0 +1,198 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <iostream>
+#include <pthread.h>
+#include <signal.h>
+#include "metrics.h"
+#include "log.h"
+#include "admission.h"
+#include "timer.h"
+#include "mailbox.h"
+#include "journal.h"
+#include "relay.h"
+#include "tls.h"
+#include "auth.h"
+#include "affinity.h"
+#include "record.h"
+using namespace std;
+
+// smtp and pop3 in one process: both servers share the mailbox registry, its
+// locks and cached indexes, the logger, metrics, admission control and the
+// timer wheel. smtp.cc and pop3.cc are built with NO_MAIN for this.
+
+namespace smtp {
+	extern bool DEBUG;
+	extern off_t MAX_SIZE;
+	extern int IDLE_TIMEOUT;
+	extern int MIN_RATE;
+	void init_metrics();
+	int smtp_server(unsigned int port);
+	void lmtp_serve(const char* addr);
+	void close_sockets();
+}
+
+namespace pop3 {
+	extern bool DEBUG;
+	extern int IDLE_TIMEOUT;
+	extern int MIN_RATE;
+	void init_metrics();
+	int pop3_server(unsigned int port);
+	void pop3s_serve(unsigned int port);
+	void close_sockets();
+}
+
+void signal_handler(int arg);
+void *smtp_thread(void *arg);
+
+int main(int argc, char *argv[]){
+	int c;
+	unsigned int smtp_port = 2500, pop3_port = 11000;
+	char* metrics_addr = NULL;
+	int max_sessions = 1000, max_per_ip = 0;
+	long cache_kb = CACHE_BUDGET_KB;
+	int compress = 0;
+	long quota_kb = 0;
+	int writers = 0;
+	char* smarthost = NULL;
+	int connections = RELAY_CONNECTIONS;
+	const char* networks = RELAY_NETWORKS;
+	char* lmtp_addr = NULL;
+	char* tls_files = NULL;
+	char* affinity = NULL;
+	char* capture = NULL;
+	unsigned int pop3s_port = 0;
+	char* passwords = NULL;
+	bool debug = false;
+
+	// getopt() for command parsing
+	while((c=getopt(argc,argv,"s:p:avm:c:i:t:r:b:z:l:q:j:g:n:y:d:k:o:w:x:e:"))!=-1){
+		switch(c){
+		case 's': //set smtp port num
+			smtp_port = atoi(optarg);
+			break;
+		case 'p': //set pop3 port num
+			pop3_port = atoi(optarg);
+			break;
+		case 'a': //exit
+	    	cerr << "Wudao Ling (wudao) @UPenn\r\n";
+	    	exit(1);
+		case 'v': //debug mode, log every command and response
+			debug = true;
+			break;
+		case 'm': //metrics endpoint, port or unix socket path
+			metrics_addr = optarg;
+			break;
+		case 'c': //max concurrent sessions of both protocols, 0 for unlimited
+			max_sessions = atoi(optarg);
+			break;
+		case 'i': //max concurrent sessions per client IP, 0 for unlimited
+			max_per_ip = atoi(optarg);
+			break;
+		case 't': //idle timeout in seconds, for both protocols
+			smtp::IDLE_TIMEOUT = pop3::IDLE_TIMEOUT = atoi(optarg);
+			break;
+		case 'r': //minimum transfer rate in bytes/s
+			smtp::MIN_RATE = pop3::MIN_RATE = atoi(optarg);
+			break;
+		case 'b': //memory for cached mailbox indexes in KB, 0 to disable
+			cache_kb = atol(optarg);
+			break;
+		case 'z': //compress delivered mail with this zlib level, 1-9
+			compress = atoi(optarg);
+			break;
+		case 'l': //max message size in KB, 0 for unlimited
+			smtp::MAX_SIZE = (off_t)atol(optarg) * 1024;
+			break;
+		case 'q': //mailbox quota in KB, 0 for unlimited
+			quota_kb = atol(optarg);
+			break;
+		case 'j': //deliver through the journal with this many writer threads
+			writers = atoi(optarg);
+			break;
+		case 'g': //relay mail for other hosts to this smarthost, host[:port]
+			smarthost = optarg;
+			break;
+		case 'n': //connections to the smarthost
+			connections = atoi(optarg);
+			break;
+		case 'y': //clients that may relay, address/bits,...
+			networks = optarg;
+			break;
+		case 'd': //LMTP for delivery from an upstream MTA, port or unix socket path
+			lmtp_addr = optarg;
+			break;
+		case 'k': //TLS certificate[:key], PEM, offers STARTTLS and STLS
+			tls_files = optarg;
+			break;
+		case 'o': //POP3S port, TLS from the start; needs -k
+			pop3s_port = atoi(optarg);
+			break;
+		case 'w': //password file for pop3, see auth.h; without it every password is cis505
+			passwords = optarg;
+			break;
+		case 'x': //CPUs of the threads of both servers, role=cpus:..., see affinity.h
+			affinity = optarg;
+			break;
+		case 'e': //append sanitized session captures of both servers to this file, see record.h
+			capture = optarg;
+			break;
+		default:
+			cerr <<"Syntax: "<< argv[0] << " [-s smtp port] [-p pop3 port] [-a] [-v] [-m metrics port|socket] [-c max sessions] [-i max sessions per IP] [-t idle timeout] [-r min rate] [-b cache KB] [-z zlib level] [-l max message KB] [-q quota KB] [-j journal writers] [-g smarthost[:port]] [-n smarthost connections] [-y relay networks] [-d lmtp port|socket] [-k certificate[:key]] [-o pop3s port] [-w password file] [-x affinity] [-e capture file] <mailboxes directory>\r\n";
+			exit(1);
+		}
+	}
+
+	// check mailbox directory: remaining non-option arguments
+	if (optind == argc) {
+		cerr <<"Syntax: "<< argv[0] << " [-s smtp port] [-p pop3 port] [-a] [-v] [-m metrics port|socket] [-c max sessions] [-i max sessions per IP] [-t idle timeout] [-r min rate] [-b cache KB] [-z zlib level] [-l max message KB] [-q quota KB] [-j journal writers] [-g smarthost[:port]] [-n smarthost connections] [-y relay networks] [-d lmtp port|socket] [-k certificate[:key]] [-o pop3s port] [-w password file] [-x affinity] [-e capture file] <mailbox directory>\r\n";
+		exit(1);
+	}
+
+	if (pop3s_port != 0 && tls_files == NULL) {
+		cerr << "POP3S needs a certificate, -k\r\n";
+		exit(1);
+	}
+
+	// the only process writing the mailboxes, no flock() needed
+	mailbox_init(argv[optind], false, cache_kb, compress, quota_kb);
+
+	smtp::DEBUG = pop3::DEBUG = debug;
+	log_init(debug ? LOG_DEBUG : LOG_INFO);
+	smtp::init_metrics();
+	pop3::init_metrics();
+	if (affinity != NULL) affinity_init(affinity); // before any thread starts
+	if (capture != NULL) record_init(capture);
+	if (tls_files != NULL) tls_init(tls_files); // one session cache for both servers
+	if (passwords != NULL) auth_init(passwords, sysconf(_SC_NPROCESSORS_ONLN));
+	if (writers > 0) journal_init(writers); // delivers what a stopped process left
+	if (smarthost != NULL) relay_init(smarthost, connections, networks); // sends what a stopped process queued
+	if (metrics_addr != NULL) metrics_serve(metrics_addr);
+	admission_init(max_sessions, max_per_ip);
+	timer_start();
+	if (lmtp_addr != NULL) smtp::lmtp_serve(lmtp_addr);
+	if (pop3s_port != 0) pop3::pop3s_serve(pop3s_port);
+
+	// handle ctrl+c signal
+	signal(SIGINT, signal_handler);
+	// writes to sockets shut down by a timeout must fail, not kill the process
+	signal(SIGPIPE, SIG_IGN);
+
+	// smtp server in its own thread, pop3 server in this one
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, smtp_thread, &smtp_port) != 0) {
+		cerr << "cannot start smtp server\r\n";
+		exit(2);
+	}
+	pop3::pop3_server(pop3_port);
+}
+
+void *smtp_thread(void *arg){
+	smtp::smtp_server(*(unsigned int*)arg);
+	return NULL;
+}
+
+void signal_handler(int arg) {
+	smtp::close_sockets();
+	pop3::close_sockets();
+	exit(3);
+}
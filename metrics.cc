@@ -0,0 +1,285 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <iostream>
+#include "metrics.h"
+#include "log.h"
+using namespace std;
+
+enum { COUNTER, GAUGE, HISTOGRAM };
+
+struct Metric {
+	string name;
+	string help;
+	int type;
+	string label; // "verb=\"HELO\"" for labelled histograms, else empty
+};
+
+// per-thread values; only the owning thread writes, scrapes only read
+struct Shard {
+	atomic<int64_t> values[METRICS_MAX];
+	atomic<atomic<int64_t>*> hist[METRICS_MAX]; // HIST_BUCKETS counts + sum, allocated on first use
+};
+
+static Metric METRICS[METRICS_MAX];
+static int NUM_METRICS = 0;
+static vector<Shard*> SHARDS;            // shards of live threads
+static Shard RETIRED;                    // totals of threads that have exited
+static pthread_mutex_t shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void retire_shard(Shard* shard);
+
+// frees the shard of a thread into RETIRED when the thread exits
+struct ShardHolder {
+	Shard* shard;
+	~ShardHolder() {
+		if (shard != NULL) retire_shard(shard);
+	}
+};
+static thread_local ShardHolder LOCAL = { NULL };
+
+static int register_metric(const char* name, const char* help, int type, string label){
+	if (NUM_METRICS == METRICS_MAX) {
+		cerr << "too many metrics\r\n";
+		exit(5);
+	}
+	METRICS[NUM_METRICS].name = name;
+	METRICS[NUM_METRICS].help = help;
+	METRICS[NUM_METRICS].type = type;
+	METRICS[NUM_METRICS].label = label;
+	return NUM_METRICS++;
+}
+
+int metrics_counter(const char* name, const char* help){
+	return register_metric(name, help, COUNTER, "");
+}
+
+int metrics_gauge(const char* name, const char* help){
+	return register_metric(name, help, GAUGE, "");
+}
+
+int metrics_histogram(const char* name, const char* help, const char* label, const char* value){
+	string l = "";
+	if (label != NULL) l = string(label) + "=\"" + value + "\"";
+	return register_metric(name, help, HISTOGRAM, l);
+}
+
+static Shard* local_shard(){
+	if (LOCAL.shard == NULL) {
+		Shard* shard = new Shard();
+		pthread_mutex_lock(&shards_mutex);
+		SHARDS.push_back(shard);
+		pthread_mutex_unlock(&shards_mutex);
+		LOCAL.shard = shard;
+	}
+	return LOCAL.shard;
+}
+
+// single writer, so a relaxed load and store is enough, no locked instruction
+static inline void bump(atomic<int64_t>& v, int64_t delta){
+	v.store(v.load(memory_order_relaxed) + delta, memory_order_relaxed);
+}
+
+void metrics_add(int id, int64_t delta){
+	bump(local_shard()->values[id], delta);
+}
+
+// log-linear bucket: exact below 4ns, then 4 sub-buckets per power of two
+static int bucket_of(int64_t ns){
+	if (ns < 4) return ns < 0 ? 0 : ns;
+	int msb = 63 - __builtin_clzll(ns);
+	int idx = (msb - 1) * 4 + ((ns >> (msb - 2)) & 3);
+	return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+// exclusive upper bound of a bucket in ns
+static int64_t bucket_bound(int idx){
+	if (idx < 4) return idx + 1;
+	int msb = idx / 4 + 1;
+	int64_t step = (int64_t)1 << (msb - 2);
+	return (4 + idx % 4) * step + step;
+}
+
+void metrics_observe(int id, int64_t ns){
+	Shard* shard = local_shard();
+	atomic<int64_t>* hist = shard->hist[id].load(memory_order_relaxed);
+	if (hist == NULL) {
+		hist = new atomic<int64_t>[HIST_BUCKETS + 1]();
+		shard->hist[id].store(hist, memory_order_release);
+	}
+	bump(hist[bucket_of(ns)], 1);
+	bump(hist[HIST_BUCKETS], ns);
+}
+
+int64_t metrics_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void merge_shard(Shard* into, Shard* from){
+	for (int i = 0; i < NUM_METRICS; i++) {
+		bump(into->values[i], from->values[i].load(memory_order_relaxed));
+		atomic<int64_t>* src = from->hist[i].load(memory_order_acquire);
+		if (src == NULL) continue;
+		atomic<int64_t>* dst = into->hist[i].load(memory_order_relaxed);
+		if (dst == NULL) {
+			dst = new atomic<int64_t>[HIST_BUCKETS + 1]();
+			into->hist[i].store(dst, memory_order_release);
+		}
+		for (int b = 0; b <= HIST_BUCKETS; b++) {
+			bump(dst[b], src[b].load(memory_order_relaxed));
+		}
+	}
+}
+
+static void retire_shard(Shard* shard){
+	pthread_mutex_lock(&shards_mutex);
+	merge_shard(&RETIRED, shard);
+	SHARDS.erase(find(SHARDS.begin(), SHARDS.end(), shard));
+	pthread_mutex_unlock(&shards_mutex);
+
+	for (int i = 0; i < METRICS_MAX; i++) {
+		delete[] shard->hist[i].load(memory_order_relaxed);
+	}
+	delete shard;
+}
+
+static string format_seconds(int64_t ns){
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%.9g", ns / 1e9);
+	return string(buf);
+}
+
+string metrics_render(){
+	// sum retired and live shards into a snapshot
+	Shard* total = new Shard();
+	pthread_mutex_lock(&shards_mutex);
+	merge_shard(total, &RETIRED);
+	for (int i = 0; i < SHARDS.size(); i++) {
+		merge_shard(total, SHARDS[i]);
+	}
+	pthread_mutex_unlock(&shards_mutex);
+
+	string out;
+	const int first = bucket_of(1024); // buckets below 1us are folded into the first one
+	for (int i = 0; i < NUM_METRICS; i++) {
+		Metric& m = METRICS[i];
+		// HELP and TYPE once per family
+		bool seen = false;
+		for (int j = 0; j < i; j++) {
+			if (METRICS[j].name == m.name) seen = true;
+		}
+		if (!seen) {
+			const char* type = m.type == COUNTER ? "counter" : m.type == GAUGE ? "gauge" : "histogram";
+			out += "# HELP " + m.name + " " + m.help + "\n";
+			out += "# TYPE " + m.name + " " + type + "\n";
+		}
+		if (m.type != HISTOGRAM) {
+			out += m.name + " " + to_string(total->values[i].load()) + "\n";
+			continue;
+		}
+
+		string sep = m.label.empty() ? "" : ",";
+		string labels = m.label.empty() ? "" : "{" + m.label + "}";
+		atomic<int64_t>* hist = total->hist[i].load();
+		int64_t count = 0;
+		for (int b = 0; b < HIST_BUCKETS; b++) {
+			if (hist != NULL) count += hist[b].load();
+			if (b < first) continue;
+			out += m.name + "_bucket{" + m.label + sep + "le=\"" + format_seconds(bucket_bound(b)) + "\"} " + to_string(count) + "\n";
+		}
+		out += m.name + "_bucket{" + m.label + sep + "le=\"+Inf\"} " + to_string(count) + "\n";
+		out += m.name + "_sum" + labels + " " + format_seconds(hist != NULL ? hist[HIST_BUCKETS].load() : 0) + "\n";
+		out += m.name + "_count" + labels + " " + to_string(count) + "\n";
+	}
+
+	for (int i = 0; i < METRICS_MAX; i++) {
+		delete[] total->hist[i].load();
+	}
+	delete total;
+	return out;
+}
+
+// addr is a TCP port on the loopback interface, or a unix socket path if it contains a '/'
+static int open_metrics_socket(const char* addr){
+	int listen_fd;
+	if (strchr(addr, '/') != NULL) {
+		struct sockaddr_un unaddr;
+		bzero(&unaddr, sizeof(unaddr));
+		unaddr.sun_family = AF_UNIX;
+		strncpy(unaddr.sun_path, addr, sizeof(unaddr.sun_path) - 1);
+		unlink(addr);
+		listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&unaddr, sizeof(unaddr)) < 0) {
+			cerr << "cannot open metrics socket\r\n";
+			exit(2);
+		}
+	} else {
+		struct sockaddr_in servaddr;
+		bzero(&servaddr, sizeof(servaddr));
+		servaddr.sin_family = AF_INET;
+		servaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		servaddr.sin_port = htons(atoi(addr));
+		listen_fd = socket(PF_INET, SOCK_STREAM, 0);
+		const int REUSE = 1;
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &REUSE, sizeof(REUSE));
+		if (listen_fd < 0) {
+			cerr << "cannot open metrics port\r\n";
+			exit(2);
+		}
+		if (bind(listen_fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
+			close(listen_fd);
+			return -1;
+		}
+	}
+	listen(listen_fd, 10);
+	return listen_fd;
+}
+
+static void *metrics_thread(void *arg){
+	const char* addr = (const char*)arg;
+
+	// an instance we took over from keeps the port until it has drained
+	int listen_fd;
+	bool warned = false;
+	while ((listen_fd = open_metrics_socket(addr)) < 0) {
+		if (!warned) log_event(LOG_WARN, -1, "Metrics port busy, retrying: ", addr);
+		warned = true;
+		sleep(1);
+	}
+
+	while (true) {
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) continue;
+
+		// any request gets the metrics page, HTTP/1.0 so we just close afterwards
+		char request[1024];
+		read(fd, request, sizeof(request));
+		string body = metrics_render();
+		string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+			+ to_string(body.length()) + "\r\n\r\n" + body;
+		for (size_t off = 0; off < response.length();) {
+			int w = write(fd, response.data() + off, response.length() - off);
+			if (w <= 0) break;
+			off += w;
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+void metrics_serve(const char* addr){
+	pthread_t thread;
+	pthread_create(&thread, NULL, metrics_thread, (void*)addr);
+	pthread_detach(thread);
+}
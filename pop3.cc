@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <openssl/md5.h>
+#include <openssl/evp.h>
 #include <unistd.h>
 #include <iostream>
 #include <fstream>
@@ -14,8 +15,23 @@
 #include <set>
 #include <time.h>
 #include <algorithm>
+#include "metrics.h"
+#include "log.h"
+#include "admission.h"
+#include "timer.h"
+#include "handoff.h"
+#include <poll.h>
+#include <fcntl.h>
+#include "mailbox.h"
+#include "scan.h"
+#include "tls.h"
+#include "auth.h"
+#include "affinity.h"
+#include "record.h"
 using namespace std;
 
+namespace pop3 {
+
 // message
 const char* SERVER_READY    = "+OK localhost pop3 server ready\r\n";
 const char* SERVICE_CLOSE   = "+OK localhost service closing transmission channel\r\n";
@@ -28,9 +44,18 @@ const char* MAILBOX_EXIST   = "+OK Mailbox exists\r\n";
 const char* INVALID_PASS	= "-ERR Invalid password\r\n";
 const char* VALID_PASS	    = "+OK Valid password, mailbox ready\r\n";
 const char* MSG_NA	        = "-ERR No such message\r\n";
+const char* NOT_REMOVED     = "-ERR some deleted messages not removed\r\n";
 const char* MSG_DELETED     = "+OK Message deleted\r\n";
 const char* MSG_RESET 	    = "+OK Messages reseted\r\n";
 const char* OK              = "+OK\r\n";
+const char* CAPABILITIES    = "+OK Capability list follows\r\nUSER\r\nTOP\r\nUIDL\r\nPIPELINING\r\nSASL PLAIN\r\n.\r\n";
+const char* CAPABILITIES_STLS = "+OK Capability list follows\r\nUSER\r\nTOP\r\nUIDL\r\nPIPELINING\r\nSASL PLAIN\r\nSTLS\r\n.\r\n";
+const char* TLS_READY       = "+OK Begin TLS negotiation\r\n";
+const char* TLS_ACTIVE      = "-ERR Command not permitted when TLS active\r\n";
+const char* SASL_CONTINUE   = "+ \r\n";
+const char* AUTH_NA         = "-ERR Unsupported authentication mechanism\r\n";
+const char* AUTH_CANCELED   = "-ERR Authentication canceled\r\n";
+const char* TIMEOUT         = "-ERR localhost autologout timer expired, closing connection\r\n";
 const char* NEW_CONN        = "New connection\r\n";
 const char* CLOSE_CONN      = "Connection closed\r\n";
 
@@ -38,52 +63,101 @@ const char* CLOSE_CONN      = "Connection closed\r\n";
 const int BUFF_SIZE = 5000;
 const int CMD_SIZE = 5;
 const int RSP_SIZE = 100;
-const int ARG_SIZE = 50;
+const int ARG_SIZE = 256; // longest argument kept, the rest is cut off
+const int OUTPUT_SIZE = 65536; // responses are flushed at this size, or when no command is left
 bool DEBUG = false;
+int IDLE_TIMEOUT = 600; // seconds, RFC 1939: autologout timer of at least 10 minutes
+int MIN_RATE = 100;     // bytes/s averaged over a transfer window, 0 only requires progress
 vector<int> SOCKETS;
 vector<pthread_t> THREADS;
-set<string> MAILBOXES;
-char* MAILBOX_DIR;
-static pthread_mutex_t mutexes[1000]; // mutexes for mailbox updating, assume max 1000 mailboxes
+char* UPGRADE_PATH = NULL; // unix socket for listener handoff, see handoff.h
+static int POP3S_STOP[2] = {-1, -1}; // pipe, written to close the POP3S listener
+
+// metrics, registered in init_metrics()
+const char* VERBS[] = {"USER", "PASS", "AUTH", "CAPA", "STAT", "LIST", "UIDL", "RETR", "TOP", "DELE", "RSET", "QUIT", "NOOP", "STLS", "OTHER"};
+const int NUM_VERBS = 15;
+int M_ACCEPTS, M_REJECTED, M_SESSIONS, M_BYTES_IN, M_BYTES_OUT, M_LOCK_WAIT;
+int M_VERB[NUM_VERBS];
+
+// responses of the session on this thread, not written yet
+static thread_local string OUTPUT;
+static thread_local Watchdog* WATCHDOG;
+static thread_local Tls* TLS; // after STLS, or on the POP3S port
+
+// a connection of either listener, handed to worker_thread()
+struct Session : Client {
+	bool tls; // POP3S, TLS from the start (RFC 8314)
+};
 
-// Message struct for easier delete and reset
-struct Message{
-	string data;
-	bool deleted;
-	Message(const string _data){
-		data = _data;
-		deleted = false;
-	}
+// the mailbox index of a logged in session, with the totals STAT and LIST
+// report kept up to date by DELE and RSET
+struct Maildrop {
+	vector<Message> messages;
+	int count;      // messages not deleted
+	off_t octets;   // their size
+	string listing; // LIST lines of those messages, made on the first LIST
+	bool listed;    // listing is up to date
 };
 
-void load_mailboxes();
+// a message on its way to queue_chunk()
+struct Outgoing {
+	int fd;
+	char last; // byte queued before, '\n' at the start of the message
+	bool stuff; // false for a message stored with its dots stuffed
+};
+
+void init_metrics();
+int verb_index(const char* command);
 int pop3_server(unsigned int port);
+void pop3s_serve(unsigned int port);
+void *pop3s_thread(void *arg);
+void pop3s_stop();
+int open_pop3s_socket(unsigned int port);
 void signal_handler(int arg);
+void close_sockets();
 void *worker_thread(void *arg);
-void handle_user(int comm_fd, int* state, char* buff, string& user);
-void handle_pass(int comm_fd, int* state, char* buff, string& user, vector<Message>& messages, vector<string>& headers);
-void handle_stat(int comm_fd, int* state, vector<Message>& messages);
-void handle_list(int comm_fd, int* state, char* buff, vector<Message>& messages);
-void handle_uidl(int comm_fd, int* state, char* buff, vector<Message>& messages);
-void handle_retr(int comm_fd, int* state, char* buff, vector<Message>& messages);
-void handle_dele(int comm_fd, int* state, char* buff, vector<Message>& messages);
-void handle_rset(int comm_fd, int* state, vector<Message>& messages);
-void handle_quit(int comm_fd, int* state, string& user, vector<Message>& messages, vector<string>& headers, bool* QUIT);
+void handle_user(int comm_fd, int* state, char* buff, Mailbox** mailbox);
+void handle_pass(int comm_fd, int* state, char* buff, Mailbox** mailbox, Maildrop& drop);
+void handle_auth(int comm_fd, int* state, char* buff, Mailbox** mailbox, Maildrop& drop, bool* sasl);
+void open_maildrop(int comm_fd, int* state, Mailbox* mailbox, Maildrop& drop);
+void handle_stat(int comm_fd, int* state, Maildrop& drop);
+void handle_list(int comm_fd, int* state, char* buff, Maildrop& drop);
+void handle_uidl(int comm_fd, int* state, char* buff, Mailbox* mailbox, Maildrop& drop);
+void handle_retr(int comm_fd, int* state, char* buff, Mailbox* mailbox, vector<Message>& messages, Watchdog* watchdog);
+void handle_top(int comm_fd, int* state, char* buff, Mailbox* mailbox, vector<Message>& messages, Watchdog* watchdog);
+void handle_dele(int comm_fd, int* state, char* buff, Maildrop& drop);
+void handle_rset(int comm_fd, int* state, Maildrop& drop);
+void handle_quit(int comm_fd, int* state, Mailbox* mailbox, Maildrop& drop, bool* QUIT);
+bool handle_stls(int comm_fd, int* state, Mailbox** mailbox, Watchdog* watchdog, bool* QUIT);
 void handle_response(int comm_fd, const char* response);
+void send_message(int comm_fd, Mailbox* mailbox, Message& m, int lines, Watchdog* watchdog);
+bool queue_chunk(void* arg, const char* data, size_t len);
+void flush_output(int comm_fd);
 void clear_buffer(char* buffer, char*end);
 void parse_command(char* extra, char* src);
 void list_msg(int comm_fd, int idx, vector<Message>& messages, bool prefix);
-void uidl_msg(int comm_fd, int idx, vector<Message>& messages, bool prefix);
+void uidl_msg(int comm_fd, int idx, Mailbox* mailbox, vector<Message>& messages, bool prefix);
 void computeDigest(char *data, int dataLengthBytes, unsigned char *digestBuffer);
-void read_mailbox(string& user, vector<Message>& messages, vector<string>& headers);
-void update_mailbox(string& user, vector<Message>& messages, vector<string>& headers);
 
+}
+using namespace pop3;
+
+// maild runs this server next to smtp and has its own main()
+#ifndef NO_MAIN
 int main(int argc, char *argv[]){
 	int c;
 	unsigned int port = 11000;
+	char* metrics_addr = NULL;
+	int max_sessions = 1000, max_per_ip = 0;
+	long cache_kb = CACHE_BUDGET_KB;
+	char* tls_files = NULL;
+	char* affinity = NULL;
+	char* capture = NULL;
+	unsigned int pop3s_port = 0;
+	char* passwords = NULL;
 
 	// getopt() for command parsing
-	while((c=getopt(argc,argv,"p:av"))!=-1){
+	while((c=getopt(argc,argv,"p:avm:c:i:t:r:u:b:k:o:w:x:e:"))!=-1){
 		switch(c){
 		case 'p': //set port num
 			port = atoi(optarg);
@@ -91,116 +165,327 @@ int main(int argc, char *argv[]){
 		case 'a': //exit
 	    	cerr << "Wudao Ling (wudao) @UPenn\r\n";
 	    	exit(1);
-		case 'v': //debug mode
+		case 'v': //debug mode, log every command and response
 			DEBUG = true;
 			break;
+		case 'm': //metrics endpoint, port or unix socket path
+			metrics_addr = optarg;
+			break;
+		case 'c': //max concurrent sessions, 0 for unlimited
+			max_sessions = atoi(optarg);
+			break;
+		case 'i': //max concurrent sessions per client IP, 0 for unlimited
+			max_per_ip = atoi(optarg);
+			break;
+		case 't': //idle timeout in seconds
+			IDLE_TIMEOUT = atoi(optarg);
+			break;
+		case 'r': //minimum transfer rate in bytes/s
+			MIN_RATE = atoi(optarg);
+			break;
+		case 'u': //upgrade socket: take over a running instance, hand over to the next
+			UPGRADE_PATH = optarg;
+			break;
+		case 'b': //memory for cached mailbox indexes in KB, 0 to disable
+			cache_kb = atol(optarg);
+			break;
+		case 'k': //TLS certificate[:key], PEM, offers STLS
+			tls_files = optarg;
+			break;
+		case 'o': //POP3S port, TLS from the start; needs -k
+			pop3s_port = atoi(optarg);
+			break;
+		case 'w': //password file, see auth.h; without it every password is cis505
+			passwords = optarg;
+			break;
+		case 'x': //CPUs of the threads, role=cpus:..., see affinity.h
+			affinity = optarg;
+			break;
+		case 'e': //append sanitized session captures to this file, see record.h
+			capture = optarg;
+			break;
 		default:
-			cerr <<"Syntax: "<< argv[0] << " [-p port] [-a] [-v] <mailboxes directory>\r\n";
+			cerr <<"Syntax: "<< argv[0] << " [-p port] [-a] [-v] [-m metrics port|socket] [-c max sessions] [-i max sessions per IP] [-t idle timeout] [-r min rate] [-u upgrade socket] [-b cache KB] [-k certificate[:key]] [-o pop3s port] [-w password file] [-x affinity] [-e capture file] <mailboxes directory>\r\n";
 			exit(1);
 		}
 	}
 
 	// check mailbox directory: remaining non-option arguments
 	if (optind == argc) {
-		cerr <<"Syntax: "<< argv[0] << " [-p port] [-a] [-v] <mailbox directory>\r\n";
+		cerr <<"Syntax: "<< argv[0] << " [-p port] [-a] [-v] [-m metrics port|socket] [-c max sessions] [-i max sessions per IP] [-t idle timeout] [-r min rate] [-u upgrade socket] [-b cache KB] [-k certificate[:key]] [-o pop3s port] [-w password file] [-x affinity] [-e capture file] <mailbox directory>\r\n";
 		exit(1);
 	}
 
-	MAILBOX_DIR = new char;
-	strcpy(MAILBOX_DIR, argv[optind]);
-	load_mailboxes();
+	if (pop3s_port != 0 && tls_files == NULL) {
+		cerr << "POP3S needs a certificate, -k\r\n";
+		exit(1);
+	}
+
+	mailbox_init(argv[optind], true, cache_kb, 0, 0);
+
+	log_init(DEBUG ? LOG_DEBUG : LOG_INFO);
+	init_metrics();
+	if (affinity != NULL) affinity_init(affinity); // before any thread starts
+	if (capture != NULL) record_init(capture);
+	if (tls_files != NULL) tls_init(tls_files);
+	if (passwords != NULL) auth_init(passwords, sysconf(_SC_NPROCESSORS_ONLN));
+	if (metrics_addr != NULL) metrics_serve(metrics_addr);
+	admission_init(max_sessions, max_per_ip);
+	timer_start();
+	if (pop3s_port != 0) pop3s_serve(pop3s_port);
+
+	// handle ctrl+c signal
+	signal(SIGINT, signal_handler);
+	// writes to sockets shut down by a timeout must fail, not kill the process
+	signal(SIGPIPE, SIG_IGN);
 
-    //smtp server
+    //pop3 server
     pop3_server(port);
 }
+#endif
+
+namespace pop3 {
+
+void init_metrics(){
+	M_ACCEPTS = metrics_counter("pop3_accepts_total", "Connections accepted.");
+	M_REJECTED = metrics_counter("pop3_rejected_total", "Connections refused by admission control.");
+	M_SESSIONS = metrics_gauge("pop3_sessions_active", "Sessions currently open.");
+	M_BYTES_IN = metrics_counter("pop3_bytes_in_total", "Bytes read from clients.");
+	M_BYTES_OUT = metrics_counter("pop3_bytes_out_total", "Bytes written to clients.");
+	for (int i = 0; i < NUM_VERBS; i++) {
+		M_VERB[i] = metrics_histogram("pop3_command_duration_seconds", "Time to handle a command.", "verb", VERBS[i]);
+	}
+	M_LOCK_WAIT = metrics_histogram("pop3_mailbox_lock_wait_seconds", "Time spent waiting for a mailbox lock.", NULL, NULL);
+}
 
-void load_mailboxes(){
-	DIR *dir;
-	struct dirent *ent;
-	if ((dir = opendir(MAILBOX_DIR)) != NULL) {
-		while ((ent = readdir (dir)) != NULL) {
-			if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0){
-				string mailbox(ent->d_name);
-				MAILBOXES.insert(mailbox);
-			}
+// metric index of a command, OTHER if unknown
+int verb_index(const char* command){
+	for (int i = 0; i < NUM_VERBS - 1; i++) {
+		if (strncasecmp(command, VERBS[i], strlen(VERBS[i])) == 0) return i;
+	}
+	return NUM_VERBS - 1;
+}
+
+int pop3_server(unsigned int port){
+	affinity_pin(AFFINITY_ACCEPT);
+	// take over the listening socket of a running instance, if there is one
+	int listen_fd = -1;
+	if (UPGRADE_PATH != NULL) listen_fd = handoff_receive(UPGRADE_PATH, "pop3");
+	if (listen_fd >= 0) {
+		log_event(LOG_INFO, -1, "Took over listening socket from running instance");
+	} else {
+	    // create a new socket (TCP)
+		listen_fd = socket(PF_INET, SOCK_STREAM, 0);
+		if (listen_fd < 0) {
+			cerr << "cannot open socket\r\n";
+		    exit(2);
 		}
-		closedir (dir);
 
-		// init mutexes
-	    for (int i = 0; i < MAILBOXES.size(); i++){
-	        pthread_mutex_init(&mutexes[i], NULL);
-	    }
+	    // set port for reuse
+		const int REUSE = 1;
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &REUSE, sizeof(REUSE));
 
-	} else {
-		cerr << "cannot open mailbox directory\r\n";
-	    exit(4);
+		// bind server with a port
+		struct sockaddr_in servaddr;
+		bzero(&servaddr, sizeof(servaddr));
+		servaddr.sin_family = AF_INET;
+		servaddr.sin_addr.s_addr = htons(INADDR_ANY);
+		servaddr.sin_port = htons(port);
+		bind(listen_fd, (struct sockaddr*)&servaddr, sizeof(servaddr));
+
+		listen(listen_fd, 100); // length of queue of pending connections
+	}
+	SOCKETS.push_back(listen_fd);
+	int handoff_fd = UPGRADE_PATH != NULL ? handoff_serve(UPGRADE_PATH, "pop3", listen_fd) : -1;
+
+	// both instances poll the shared socket during a handoff, accept must not block
+	fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+	struct pollfd fds[2] = {{listen_fd, POLLIN, 0}, {handoff_fd, POLLIN, 0}};
+
+	// accept until the listening socket is handed to a new instance
+	while(true){
+		poll(fds, handoff_fd >= 0 ? 2 : 1, -1);
+		if (handoff_fd >= 0 && fds[1].revents != 0) break;
+
+		struct sockaddr_in clientaddr;
+		socklen_t clientaddrlen = sizeof(clientaddr);
+		int fd = accept(listen_fd, (struct sockaddr*)&clientaddr, &clientaddrlen);
+		if (fd < 0) continue;
+		metrics_add(M_ACCEPTS, 1);
+
+		// shed load over the session caps before spending a thread on it
+		Session* client = new Session;
+		client->fd = fd;
+		client->ip = clientaddr.sin_addr.s_addr;
+		client->tls = false;
+		if (!admission_acquire(client->ip)) {
+			admission_reject(fd, SERVICE_NA);
+			metrics_add(M_REJECTED, 1);
+			log_event(LOG_WARN, fd, "Connection refused, over session limit from ", inet_ntoa(clientaddr.sin_addr));
+			delete client;
+			continue;
+		}
+
+		// dispatcher assign connection to worker threads
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, worker_thread, client) != 0) {
+			admission_release(client->ip);
+			admission_reject(fd, SERVICE_NA);
+			metrics_add(M_REJECTED, 1);
+			delete client;
+			continue;
+		}
+		SOCKETS.push_back(fd);
+		THREADS.push_back(thread);
+		// mark resource of thread for reclaim when it terminates
+		pthread_detach(thread);
+    }
+
+	// drain: the new instance takes new connections, ours run to completion;
+	// it waits for the POP3S port, which busy clients would keep open
+	close(listen_fd);
+	pop3s_stop();
+	log_event(LOG_INFO, -1, "Draining sessions: ", to_string(admission_active()).c_str());
+	while (admission_active() > 0) {
+		usleep(100000);
 	}
+	log_event(LOG_INFO, -1, "All sessions drained, exiting");
+	exit(0);
 }
 
-int pop3_server(unsigned int port){
-	// handle ctrl+c signal
-	signal(SIGINT, signal_handler);
+// POP3S listener, TLS before the greeting. Its sessions run the same
+// worker_thread() as those of the plain port.
+void pop3s_serve(unsigned int port){
+	if (pipe(POP3S_STOP) != 0) {
+		cerr << "cannot open pop3s socket\r\n";
+		exit(2);
+	}
+	pthread_t thread;
+	pthread_create(&thread, NULL, pop3s_thread, (void*)(long)port);
+	pthread_detach(thread);
+}
 
-    // create a new socket (TCP)
+// -1 if the port is busy
+int open_pop3s_socket(unsigned int port){
 	int listen_fd = socket(PF_INET, SOCK_STREAM, 0);
 	if (listen_fd < 0) {
-		cerr << "cannot open socket\r\n";
-	    exit(2);
+		cerr << "cannot open pop3s socket\r\n";
+		exit(2);
 	}
-	SOCKETS.push_back(listen_fd);
-
-    // set port for reuse
 	const int REUSE = 1;
 	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &REUSE, sizeof(REUSE));
-
-	// bind server with a port
 	struct sockaddr_in servaddr;
 	bzero(&servaddr, sizeof(servaddr));
 	servaddr.sin_family = AF_INET;
-	servaddr.sin_addr.s_addr = htons(INADDR_ANY);
+	servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
 	servaddr.sin_port = htons(port);
-	bind(listen_fd, (struct sockaddr*)&servaddr, sizeof(servaddr));
+	if (bind(listen_fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
+		close(listen_fd);
+		return -1;
+	}
+	listen(listen_fd, 100);
+	return listen_fd;
+}
 
-	// listen and accept
-	listen(listen_fd, 100); // length of queue of pending connections
-	while(true){
+void *pop3s_thread(void *arg){
+	unsigned int port = (unsigned int)(long)arg;
+	affinity_pin(AFFINITY_ACCEPT);
+
+	// during an upgrade the running instance holds the port until it exits
+	int listen_fd;
+	bool warned = false;
+	while ((listen_fd = open_pop3s_socket(port)) < 0) {
+		if (!warned) log_event(LOG_WARN, -1, "POP3S port busy, retrying: ", to_string(port).c_str());
+		warned = true;
+		sleep(1);
+	}
+
+	// accept until pop3s_stop()
+	struct pollfd fds[2] = {{listen_fd, POLLIN, 0}, {POP3S_STOP[0], POLLIN, 0}};
+	while (true) {
+		poll(fds, 2, -1);
+		if (fds[1].revents != 0) break;
 		struct sockaddr_in clientaddr;
 		socklen_t clientaddrlen = sizeof(clientaddr);
 		int fd = accept(listen_fd, (struct sockaddr*)&clientaddr, &clientaddrlen);
-		SOCKETS.push_back(fd);
+		if (fd < 0) continue;
+		metrics_add(M_ACCEPTS, 1);
+
+		Session* client = new Session;
+		client->fd = fd;
+		client->ip = clientaddr.sin_addr.s_addr;
+		client->tls = true;
+		if (!admission_acquire(client->ip)) {
+			// no TLS yet, so no response either
+			close(fd);
+			metrics_add(M_REJECTED, 1);
+			log_event(LOG_WARN, fd, "Connection refused, over session limit from ", inet_ntoa(clientaddr.sin_addr));
+			delete client;
+			continue;
+		}
 
-		// dispatcher assign connection to worker threads, concurrent <=100
 		pthread_t thread;
-		pthread_create(&thread, NULL, worker_thread, &fd);
-		THREADS.push_back(thread);
-		// mark resource of thread for reclaim when it terminates
+		if (pthread_create(&thread, NULL, worker_thread, client) != 0) {
+			admission_release(client->ip);
+			close(fd);
+			metrics_add(M_REJECTED, 1);
+			delete client;
+			continue;
+		}
 		pthread_detach(thread);
-    }
-    return 0;
+	}
+	close(listen_fd);
+	log_event(LOG_INFO, -1, "POP3S listener closed for the new instance");
+	return NULL;
+}
+
+// closes the POP3S listener, if there is one; its sessions go on
+void pop3s_stop(){
+	if (POP3S_STOP[1] >= 0) write(POP3S_STOP[1], "", 1);
 }
 
 void signal_handler(int arg) {
+	close_sockets();
+	exit(3);
+}
+
+void close_sockets() {
+	if (SOCKETS.empty()) return;
 	// close listen_fd first to prevent incoming sockets
 	close(SOCKETS[0]);
-	delete MAILBOX_DIR;
 
 	for (int i = 1; i < SOCKETS.size(); i++) {
 		write(SOCKETS[i], SERVICE_NA, strlen(SERVICE_NA));
 		close(SOCKETS[i]);
 		pthread_kill(THREADS[i - 1], 0);
 	}
-	exit(3);
 }
 
 void *worker_thread(void *arg){
-	int comm_fd = *(int*)arg;
-
-	// send greeting message
-	write(comm_fd, SERVER_READY, strlen(SERVER_READY));
-	if (DEBUG){
-		cerr << "["<< comm_fd << "] " << NEW_CONN;
+	Session* client = (Session*)arg;
+	int comm_fd = client->fd;
+	bool QUIT = false;
+	affinity_pin_session(comm_fd); // before the session allocates anything
+
+	metrics_add(M_SESSIONS, 1);
+	log_event(LOG_DEBUG, comm_fd, NEW_CONN);
+	Watchdog watchdog;
+	watchdog_init(&watchdog, comm_fd, TIMEOUT, IDLE_TIMEOUT * 1000, MIN_RATE);
+	WATCHDOG = &watchdog;
+
+	// POP3S: the handshake comes first, within the idle timeout; a timeout
+	// closes without a response then, which would be sent in the clear
+	if (client->tls) {
+		watchdog_idle(&watchdog);
+		TLS = tls_accept(comm_fd);
+		QUIT = TLS == NULL;
+		watchdog.response = "";
 	}
 
+	// send greeting message, with the first flush
+	if (!QUIT) handle_response(comm_fd, SERVER_READY);
+	record_open(client->tls ? RECORD_POP3S : RECORD_POP3); // after the greeting, a reply to no command
+
 	int state = 0;
 	// 0 - AUTHORIZATION
 	// 1 - TRANSACTION
@@ -210,17 +495,21 @@ void *worker_thread(void *arg){
 	// maintain a buffer
 	char buff[BUFF_SIZE];
 	char* curr = buff;
-	bool QUIT = false;
+	bool sasl = false; // next line is a response to an AUTH challenge
 
 	// user data
-	string user;
-	vector<Message> messages;
-	vector<string> headers;
+	Mailbox* mailbox = NULL;
+	Maildrop drop;
 
-	while(true){
+	while(!QUIT){
 		char* end = new char;
+		// all pipelined commands are handled, send their responses at once
+		flush_output(comm_fd);
+		watchdog_idle(&watchdog);
 		// expect to read (BUF_SIZE-curr_len) bytes to curr, assuming already read (curr_len) bytes
-		int len = read(comm_fd, curr, BUFF_SIZE-strlen(buff));
+		int len = TLS != NULL ? tls_read(TLS, curr, BUFF_SIZE-strlen(buff)) : read(comm_fd, curr, BUFF_SIZE-strlen(buff));
+		if (len <= 0) break; // client closed the connection without QUIT, or timed out
+		metrics_add(M_BYTES_IN, len);
 
 		while((end=strstr(buff,"\r\n"))!=NULL){ // check whether command terminate
 			// strstr return 1st index, move to real end
@@ -230,42 +519,63 @@ void *worker_thread(void *arg){
 			strncpy(command, buff, CMD_SIZE);
 			command[CMD_SIZE] = '\0'; // strncpy doesn't append \0 at the en
 
-			if (DEBUG) cerr << "["<< comm_fd << "] " << "C: "<< command <<endl;
+			log_event(LOG_DEBUG, comm_fd, "C: ", command);
+			int verb = verb_index(command);
+			bool challenged = sasl;
+			int64_t start = metrics_now();
 
             // handle command
-		    if (strcasecmp(command, "user ") == 0){
+		    if (sasl){
+		    	// response to the AUTH challenge, not a command
+		    	handle_auth(comm_fd, &state, buff, &mailbox, drop, &sasl);
+		    } else if (strcasecmp(command, "user ") == 0){
 		    	// USER name, tells the server which user is logging in;
-			    handle_user(comm_fd, &state, buff, user);
+			    handle_user(comm_fd, &state, buff, &mailbox);
 		    } else if (strcasecmp(command, "pass ") == 0){
 		    	// PASS str, specifies the user's password;
-		    	handle_pass(comm_fd, &state, buff, user, messages, headers);
+		    	handle_pass(comm_fd, &state, buff, &mailbox, drop);
+			} else if (strcasecmp(command, "auth ") == 0 || strcasecmp(command, "auth\r") == 0){
+				// AUTH mechanism [initial-response], SASL authentication (RFC 5034);
+				handle_auth(comm_fd, &state, buff, &mailbox, drop, &sasl);
+			} else if (strcasecmp(command, "capa\r") == 0){
+				// CAPA, lists the capabilities of the server (RFC 2449);
+				handle_response(comm_fd, tls_running() && TLS == NULL ? CAPABILITIES_STLS : CAPABILITIES);
 			} else if (strcasecmp(command, "stat\r") == 0){
 				// STAT, returns the number of messages and the size of the mailbox;
-	            handle_stat(comm_fd, &state, messages);
+	            handle_stat(comm_fd, &state, drop);
 			} else if (strcasecmp(command, "list ") == 0 || strcasecmp(command, "list\r") == 0){
 				// LIST [msg], shows the size of a particular message, or all the messages;
-				handle_list(comm_fd, &state, buff, messages);
-			} else if (strcasecmp(command, "uidl") == 0 || strcasecmp(command, "uidl\r") == 0){
+				handle_list(comm_fd, &state, buff, drop);
+			} else if (strcasecmp(command, "uidl ") == 0 || strcasecmp(command, "uidl\r") == 0){
 				// UIDL [msg], shows a list of messages, along with a unique ID for each message;
-				handle_uidl(comm_fd, &state, buff, messages);
+				handle_uidl(comm_fd, &state, buff, mailbox, drop);
 			} else if (strcasecmp(command, "retr ") == 0){
 				// RETR msg, retrieves a particular message;
-				handle_retr(comm_fd, &state, buff, messages);
+				handle_retr(comm_fd, &state, buff, mailbox, drop.messages, &watchdog);
+			} else if (strncasecmp(command, "top ", 4) == 0){
+				// TOP msg n, retrieves the headers and first n body lines of a message;
+				handle_top(comm_fd, &state, buff, mailbox, drop.messages, &watchdog);
 			} else if (strcasecmp(command, "dele ") == 0){
 				// DELE msg, deletes a message;
-				handle_dele(comm_fd, &state, buff, messages);
+				handle_dele(comm_fd, &state, buff, drop);
 			} else if (strcasecmp(command, "rset\r") == 0){
 				// RSET, undelete all the messages that have been deleted with DELE;
-				handle_rset(comm_fd, &state, messages);
+				handle_rset(comm_fd, &state, drop);
 			} else if (strcasecmp(command, "quit\r") == 0 ) {
 				// QUIT, which terminates the connection
-				handle_quit(comm_fd, &state, user, messages, headers, &QUIT);
+				handle_quit(comm_fd, &state, mailbox, drop, &QUIT);
 			} else if (strcasecmp(command, "noop\r") == 0){
 				// NOOP, which does nothing
 				handle_response(comm_fd, OK);
+			} else if (strcasecmp(command, "stls\r") == 0){
+				// STLS, the rest of the session is encrypted (RFC 2595); any
+				// command pipelined after it was sent in the clear and is dropped
+				if (handle_stls(comm_fd, &state, &mailbox, &watchdog, &QUIT)) end = buff + strlen(buff);
 			} else { // unknown command
 				handle_response(comm_fd, UNKNOWN_CMD);
 			}
+			metrics_observe(M_VERB[verb], metrics_now() - start);
+			record_command(challenged ? "SASL" : VERBS[verb], buff, start);
 
 			delete[] command;
 			if (QUIT) break;
@@ -282,74 +592,150 @@ void *worker_thread(void *arg){
 		}
 	}
 
+	flush_output(comm_fd);
+	watchdog_stop(&watchdog);
+	if (watchdog.expired) log_event(LOG_INFO, comm_fd, "Connection timed out");
+	record_close();
+
+	// session ended without QUIT: no UPDATE, but release the maildrop
+	if (state == 1) pthread_mutex_unlock(&mailbox->maildrop);
+
     // terminate socket
+	if (TLS != NULL) tls_close(TLS);
+	TLS = NULL;
 	close(comm_fd);
-	if (DEBUG) {
-		cerr << "[" << comm_fd << "] " << CLOSE_CONN;
-	}
+	metrics_add(M_SESSIONS, -1);
+	admission_release(client->ip);
+	delete client;
+	log_event(LOG_DEBUG, comm_fd, CLOSE_CONN);
 	pthread_exit(NULL);
 }
 
-void handle_user(int comm_fd, int* state, char* buff, string& user) {
-	if (*state != 0 || user.length()!=0) {
+void handle_user(int comm_fd, int* state, char* buff, Mailbox** mailbox) {
+	if (*state != 0 || *mailbox != NULL) {
 		handle_response(comm_fd, BAD_SEQ);
 	} else {
 		// parse user name
 		char rcpt[ARG_SIZE];
 		parse_command(rcpt, buff);
-		string mailbox(rcpt);
-		mailbox += ".mbox";
+		string name(rcpt);
+		name += ".mbox";
 
-		if (MAILBOXES.find(mailbox)==MAILBOXES.end()){
+		*mailbox = mailbox_find(name);
+		if (*mailbox == NULL){
 			handle_response(comm_fd, MAILBOX_NA);
 		} else {
-			user = mailbox;
 			handle_response(comm_fd, MAILBOX_EXIST);
 		}
 	}
 }
 
-void handle_pass(int comm_fd, int* state, char* buff, string& user, vector<Message>& messages, vector<string>& headers){
-	if (*state != 0 || user.length()==0){
+void handle_pass(int comm_fd, int* state, char* buff, Mailbox** mailbox, Maildrop& drop){
+	if (*state != 0 || *mailbox == NULL){
 		handle_response(comm_fd, BAD_SEQ);
 	} else {
 		// parse password
 		char password[ARG_SIZE];
 		parse_command(password, buff);
 
-		// check password
-		if (strcmp(password, "cis505")==0){
-			*state = 1;
-			int j = distance(MAILBOXES.begin(), MAILBOXES.find(user)); // get a constant index for a mailbox
-			pthread_mutex_lock(&mutexes[j]);// mutex lock
-			read_mailbox(user, messages, headers); // right, read messages and headers from mailbox
-			handle_response(comm_fd, VALID_PASS);
+		// check password, see auth.h
+		string user = (*mailbox)->name.substr(0, (*mailbox)->name.length() - 5); // without .mbox
+		if (auth_check(user, password)){
+			open_maildrop(comm_fd, state, *mailbox, drop); // right
 		} else {
-			user.clear(); // wrong, clear user name
+			*mailbox = NULL; // wrong, clear user name
 			handle_response(comm_fd, INVALID_PASS);
 		}
 	}
 }
 
-void handle_stat(int comm_fd, int* state, vector<Message>& messages){
-	if (*state != 1) {
+void handle_auth(int comm_fd, int* state, char* buff, Mailbox** mailbox, Maildrop& drop, bool* sasl){
+	if (!*sasl && (*state != 0 || *mailbox != NULL)) {
 		handle_response(comm_fd, BAD_SEQ);
+		return;
+	}
+
+	// the credentials come with the command or on the next line
+	string arg(buff, strstr(buff, "\r\n") - buff);
+	if (*sasl) {
+		*sasl = false;
+		if (arg == "*") {
+			handle_response(comm_fd, AUTH_CANCELED);
+			return;
+		}
 	} else {
-		// build response
-		int count = 0, size = 0;
-		for (int i = 0; i < messages.size(); i++) {
-			if (!messages[i].deleted) {
-				count++;
-				size += messages[i].data.length();
-			}
+		arg = arg.length() > 5 ? arg.substr(5) : "";
+		size_t space = arg.find(' ');
+		string mechanism = arg.substr(0, space);
+		if (strcasecmp(mechanism.c_str(), "plain") != 0) {
+			handle_response(comm_fd, AUTH_NA);
+			return;
+		}
+		if (space == string::npos) {
+			*sasl = true;
+			handle_response(comm_fd, SASL_CONTINUE);
+			return;
 		}
-		string ans = "+OK " + to_string(count) + " " + to_string(size) + "\r\n";
+		arg = arg.substr(space + 1);
+	}
+
+	// PLAIN (RFC 4616): base64 of authzid NUL authcid NUL password
+	string decoded(arg.length() / 4 * 3 + 3, '\0');
+	int len = arg.length() % 4 == 0 ? EVP_DecodeBlock((unsigned char*)&decoded[0], (const unsigned char*)arg.data(), arg.length()) : -1;
+	if (len < 0) {
+		handle_response(comm_fd, SYNTAX_ERR);
+		return;
+	}
+	for (int i = arg.length() - 1; i >= 0 && arg[i] == '='; i--) len--; // padding decodes to zeros
+	decoded.resize(len);
+
+	size_t first = decoded.find('\0');
+	size_t second = first == string::npos ? string::npos : decoded.find('\0', first + 1);
+	if (second == string::npos) {
+		handle_response(comm_fd, SYNTAX_ERR);
+		return;
+	}
+	string authzid = decoded.substr(0, first);
+	string user = decoded.substr(first + 1, second - first - 1);
+	string password = decoded.substr(second + 1);
+
+	Mailbox* mb = mailbox_find(user + ".mbox");
+	if (mb == NULL || (!authzid.empty() && authzid != user)) {
+		handle_response(comm_fd, MAILBOX_NA);
+	} else if (!auth_check(user, password)) {
+		handle_response(comm_fd, INVALID_PASS);
+	} else {
+		*mailbox = mb;
+		open_maildrop(comm_fd, state, mb, drop);
+	}
+}
+
+void open_maildrop(int comm_fd, int* state, Mailbox* mailbox, Maildrop& drop){
+	*state = 1;
+	int64_t wait_start = metrics_now();
+	pthread_mutex_lock(&mailbox->maildrop); // one session per maildrop
+	metrics_observe(M_LOCK_WAIT, metrics_now() - wait_start);
+	mailbox_open(mailbox, drop.messages); // get the message index of the mailbox
+	drop.count = drop.messages.size();
+	drop.octets = 0;
+	for (int i = 0; i < drop.messages.size(); i++) {
+		drop.octets += drop.messages[i].octets;
+	}
+	drop.listed = false;
+	handle_response(comm_fd, VALID_PASS);
+}
+
+void handle_stat(int comm_fd, int* state, Maildrop& drop){
+	if (*state != 1) {
+		handle_response(comm_fd, BAD_SEQ);
+	} else {
+		string ans = "+OK " + to_string(drop.count) + " " + to_string(drop.octets) + "\r\n";
 
 		handle_response(comm_fd, ans.c_str());
 	}
 }
 
-void handle_list(int comm_fd, int* state, char* buff, vector<Message>& messages){
+void handle_list(int comm_fd, int* state, char* buff, Maildrop& drop){
 	if (*state != 1) {
 		handle_response(comm_fd, BAD_SEQ);
 	} else {
@@ -357,19 +743,28 @@ void handle_list(int comm_fd, int* state, char* buff, vector<Message>& messages)
 		char msg[ARG_SIZE];
 		parse_command(msg, buff);
 		if (strlen(msg) == 0) {
-			string header = "+OK " + to_string(messages.size()) + " messages\r\n";
-			handle_response(comm_fd, header.c_str());
-			for (int i=0; i<messages.size();i++){
-				list_msg(comm_fd, i+1, messages, false);
+			// the lines are kept until the next DELE or RSET, and queued at once
+			if (!drop.listed) {
+				drop.listing.clear();
+				char line[48];
+				for (int i = 0; i < drop.messages.size(); i++) {
+					if (drop.messages[i].deleted) continue;
+					int n = snprintf(line, sizeof(line), "%d %lld\r\n", i + 1, (long long)drop.messages[i].octets);
+					drop.listing.append(line, n);
+				}
+				drop.listed = true;
 			}
+			string header = "+OK " + to_string(drop.count) + " messages (" + to_string(drop.octets) + " octets)\r\n";
+			handle_response(comm_fd, header.c_str());
+			handle_response(comm_fd, drop.listing.c_str());
 			handle_response(comm_fd, ".\r\n");
 		} else {
-			list_msg(comm_fd, atoi(msg), messages, true);
+			list_msg(comm_fd, atoi(msg), drop.messages, true);
 		}
 	}
 }
 
-void handle_uidl(int comm_fd, int* state, char* buff, vector<Message>& messages){
+void handle_uidl(int comm_fd, int* state, char* buff, Mailbox* mailbox, Maildrop& drop){
 	if (*state != 1) {
 		handle_response(comm_fd, BAD_SEQ);
 	} else {
@@ -377,19 +772,19 @@ void handle_uidl(int comm_fd, int* state, char* buff, vector<Message>& messages)
 		char msg[ARG_SIZE];
 		parse_command(msg, buff);
 		if (strlen(msg) == 0) {
-			string header = "+OK " + to_string(messages.size()) + " messages\r\n";
+			string header = "+OK " + to_string(drop.count) + " messages\r\n";
 			handle_response(comm_fd, header.c_str());
-			for (int i=0; i<messages.size();i++){
-				uidl_msg(comm_fd, i+1, messages, false);
+			for (int i=0; i<drop.messages.size();i++){
+				if (!drop.messages[i].deleted) uidl_msg(comm_fd, i+1, mailbox, drop.messages, false);
 			}
 			handle_response(comm_fd, ".\r\n");
 		} else {
-			uidl_msg(comm_fd, atoi(msg), messages, true);
+			uidl_msg(comm_fd, atoi(msg), mailbox, drop.messages, true);
 		}
 	}
 }
 
-void handle_retr(int comm_fd, int* state, char* buff, vector<Message>& messages){
+void handle_retr(int comm_fd, int* state, char* buff, Mailbox* mailbox, vector<Message>& messages, Watchdog* watchdog){
 	if (*state != 1) {
 		handle_response(comm_fd, BAD_SEQ);
 	} else {
@@ -406,27 +801,42 @@ void handle_retr(int comm_fd, int* state, char* buff, vector<Message>& messages)
 				// message not available
 				handle_response(comm_fd, MSG_NA);
 			} else {
-				string data = messages[idx - 1].data;
-				string header = "+OK " + to_string(data.length()) + " octets\r\n";
+				string header = "+OK " + to_string(messages[idx-1].octets) + " octets\r\n";
 				handle_response(comm_fd, header.c_str());
+				send_message(comm_fd, mailbox, messages[idx-1], -1, watchdog);
+				handle_response(comm_fd, ".\r\n");
+			}
+		}
+	}
+}
 
-				// write mail line by line
-				int end;
-				string line;
-				for (int start=0;start<data.length();){
-					end = data.find('\n',start);
-					line = data.substr(start,end-start+1);
-					handle_response(comm_fd, line.c_str());
-					start = end+1;
-				}
+void handle_top(int comm_fd, int* state, char* buff, Mailbox* mailbox, vector<Message>& messages, Watchdog* watchdog){
+	if (*state != 1) {
+		handle_response(comm_fd, BAD_SEQ);
+	} else {
+		// parse message and number of lines
+		char arg[ARG_SIZE];
+		parse_command(arg, buff);
+		int idx, lines;
+		char extra;
 
+		if (sscanf(arg, "%d %d %c", &idx, &lines, &extra) != 2 || lines < 0) {
+			handle_response(comm_fd, SYNTAX_ERR);
+		} else {
+			if (idx<1 || idx>messages.size() || messages[idx-1].deleted){
+				// message not available
+				handle_response(comm_fd, MSG_NA);
+			} else {
+				// only the headers and the wanted lines are read, see mailbox_stream()
+				handle_response(comm_fd, OK);
+				send_message(comm_fd, mailbox, messages[idx-1], lines, watchdog);
 				handle_response(comm_fd, ".\r\n");
 			}
 		}
 	}
 }
 
-void handle_dele(int comm_fd, int* state, char* buff, vector<Message>& messages){
+void handle_dele(int comm_fd, int* state, char* buff, Maildrop& drop){
 	if (*state != 1) {
 		handle_response(comm_fd, BAD_SEQ);
 	} else {
@@ -439,29 +849,37 @@ void handle_dele(int comm_fd, int* state, char* buff, vector<Message>& messages)
 			handle_response(comm_fd, SYNTAX_ERR);
 		} else {
 			int idx = atoi(msg);
-			if (idx<1 || idx>messages.size() || messages[idx-1].deleted){
+			if (idx<1 || idx>drop.messages.size() || drop.messages[idx-1].deleted){
 				// message not available
 				handle_response(comm_fd, MSG_NA);
 			} else {
-				messages[idx-1].deleted = true;
+				drop.messages[idx-1].deleted = true;
+				drop.count--;
+				drop.octets -= drop.messages[idx-1].octets;
+				drop.listed = false;
 				handle_response(comm_fd, MSG_DELETED);
 			}
 		}
 	}
 }
 
-void handle_rset(int comm_fd, int* state, vector<Message>& messages){
+void handle_rset(int comm_fd, int* state, Maildrop& drop){
 	if (*state != 1) {
 		handle_response(comm_fd, BAD_SEQ);
 	} else {
-		for(int i=0; i<messages.size();i++){
-			messages[i].deleted = false;
+		for(int i=0; i<drop.messages.size();i++){
+			if (drop.messages[i].deleted) {
+				drop.messages[i].deleted = false;
+				drop.count++;
+				drop.octets += drop.messages[i].octets;
+				drop.listed = false;
+			}
 		}
 		handle_response(comm_fd, MSG_RESET);
 	}
 }
 
-void handle_quit(int comm_fd, int* state, string& user, vector<Message>& messages, vector<string>& headers, bool* QUIT){
+void handle_quit(int comm_fd, int* state, Mailbox* mailbox, Maildrop& drop, bool* QUIT){
 	if (*state == 0){
 		*QUIT = true;
 		handle_response(comm_fd, SERVICE_CLOSE);
@@ -470,21 +888,107 @@ void handle_quit(int comm_fd, int* state, string& user, vector<Message>& message
 	} else { //*state==1
 		*state = 2;
 		*QUIT = true;
-		handle_response(comm_fd, SERVICE_CLOSE);
-		update_mailbox(user, messages, headers);
+		// +OK only once the deletions are on disk
+		handle_response(comm_fd, mailbox_commit(mailbox, drop.messages) ? SERVICE_CLOSE : NOT_REMOVED);
+		pthread_mutex_unlock(&mailbox->maildrop); //mutex release
+	}
+}
 
-		int j = distance(MAILBOXES.begin(), MAILBOXES.find(user)); // get a constant index for a mailbox
-		pthread_mutex_unlock(&mutexes[j]); //mutex release
+// Returns true once the session is encrypted; sets QUIT if the handshake
+// failed, the connection cannot be used after that.
+bool handle_stls(int comm_fd, int* state, Mailbox** mailbox, Watchdog* watchdog, bool* QUIT){
+	if (!tls_running()) {
+		handle_response(comm_fd, UNKNOWN_CMD);
+	} else if (TLS != NULL) {
+		handle_response(comm_fd, TLS_ACTIVE);
+	} else if (*state != 0) {
+		handle_response(comm_fd, BAD_SEQ);
+	} else {
+		handle_response(comm_fd, TLS_READY);
+		flush_output(comm_fd);
+		TLS = tls_accept(comm_fd);
+		if (TLS == NULL) {
+			*QUIT = true;
+			return false;
+		}
+		// a USER given in the clear is forgotten; a timeout closes without
+		// a response, which would be sent in the clear
+		*mailbox = NULL;
+		watchdog->response = "";
+		return true;
 	}
+	return false;
 }
 
+// queues a response, see flush_output()
 void handle_response(int comm_fd, const char* response){
-	write(comm_fd, response, strlen(response));
-	if (DEBUG) {
-		cerr << "["<< comm_fd << "] " << "S: "<< response;
+	OUTPUT += response;
+	log_event(LOG_DEBUG, comm_fd, "S: ", response);
+	record_reply(response);
+	if (OUTPUT.length() >= OUTPUT_SIZE) flush_output(comm_fd);
+}
+
+// Streams a message to the client as it is read (and inflated), so it is
+// never held in memory whole. The client has to keep up with the minimum rate.
+void send_message(int comm_fd, Mailbox* mailbox, Message& m, int lines, Watchdog* watchdog){
+	watchdog_transfer(watchdog);
+	Outgoing out = {comm_fd, '\n', !m.stuffed};
+	if (!mailbox_stream(mailbox, m, lines, queue_chunk, &out)) {
+		log_event(LOG_ERROR, comm_fd, "Cannot read message from ", mailbox->name.c_str());
 	}
 }
 
+// Queues message data, with a second dot before a line that starts with one
+// (RFC 1939 3) unless the message was stored stuffed; the data comes with
+// CRLF line ends.
+bool queue_chunk(void* arg, const char* data, size_t len){
+	Outgoing* out = (Outgoing*)arg;
+	int comm_fd = out->fd;
+	if (len == 0) return true;
+	if (log_enabled(LOG_DEBUG)) {
+		for (size_t start = 0, end; start < len; start = end + 1) {
+			const char* nl = (const char*)memchr(data + start, '\n', len - start);
+			end = nl != NULL ? nl - data : len - 1;
+			log_event(LOG_DEBUG, comm_fd, "S: ", data + start, end - start + 1);
+		}
+	}
+
+	// a line start at the edge of the chunk first, then those inside it
+	size_t start = 0;
+	if (out->stuff) {
+		if (data[0] == '.' && out->last == '\n') {
+			OUTPUT += '.';
+		} else if (len > 1 && data[0] == '\n' && data[1] == '.' && out->last == '\r') {
+			OUTPUT += "\n.";
+			start = 1;
+		}
+		const char* end = data + len;
+		for (const char* dot = scan_dot_line(data + start, end); dot != NULL; dot = scan_dot_line(dot + 3, end)) {
+			OUTPUT.append(data + start, dot + 2 - (data + start));
+			OUTPUT += '.';
+			start = dot + 2 - data;
+		}
+	}
+	OUTPUT.append(data + start, len - start);
+	out->last = data[len - 1];
+	if (OUTPUT.length() >= OUTPUT_SIZE) flush_output(comm_fd);
+	return true;
+}
+
+// Writes the queued responses. Pipelined commands (RFC 2449) are all handled
+// before this, so a batch of them costs one write.
+void flush_output(int comm_fd){
+	for (int start = 0; start < OUTPUT.length();) {
+		int len = TLS != NULL ? tls_write(TLS, OUTPUT.data() + start, OUTPUT.length() - start)
+			: write(comm_fd, OUTPUT.data() + start, OUTPUT.length() - start);
+		if (len <= 0) break; // client is gone, or timed out
+		metrics_add(M_BYTES_OUT, len);
+		if (WATCHDOG != NULL) watchdog_progress(WATCHDOG, len);
+		start += len;
+	}
+	OUTPUT.clear();
+}
+
 void clear_buffer(char *buff, char *end){
 	char* curr = buff;
 	// move remaining to the start
@@ -512,7 +1016,7 @@ void parse_command(char* arg, char* src){
 
 	// with argument
 	i++; // ' ' not included
-	while(src[i] != '\r'){
+	while(src[i] != '\r' && j < ARG_SIZE - 1){
 		arg[j++] = src[i++];
 	}
 	arg[j] = '\0';
@@ -522,7 +1026,7 @@ void list_msg(int comm_fd, int idx, vector<Message>& messages, bool prefix){
 	if (idx < 1 || idx > messages.size() || messages[idx - 1].deleted) {
 		handle_response(comm_fd, MSG_NA);
 	} else {
-		int len = messages[idx-1].data.length();
+		int len = messages[idx-1].octets;
 
 		string ans;
 		if (prefix){
@@ -534,16 +1038,17 @@ void list_msg(int comm_fd, int idx, vector<Message>& messages, bool prefix){
 	}
 }
 
-void uidl_msg(int comm_fd, int idx, vector<Message>& messages, bool prefix){
-	if (idx < 1 || idx > messages.size() || messages[idx - 1].deleted) {
+void uidl_msg(int comm_fd, int idx, Mailbox* mailbox, vector<Message>& messages, bool prefix){
+	string data;
+	if (idx < 1 || idx > messages.size() || messages[idx - 1].deleted || !mailbox_read(mailbox, messages[idx - 1], data)) {
 		handle_response(comm_fd, MSG_NA);
 	} else {
 		unsigned char* digest = new unsigned char[MD5_DIGEST_LENGTH];
 		char* uid = new char[MD5_DIGEST_LENGTH + 1];
 
 		// hashing message; type requirement
-		char msg[messages[idx-1].data.length() + 1];
-		strcpy(msg, messages[idx-1].data.c_str());
+		char msg[data.length() + 1];
+		strcpy(msg, data.c_str());
 		computeDigest(msg, strlen(msg), digest);
 
 		// pop3 protocol use hex, format digest to uid
@@ -574,51 +1079,4 @@ void computeDigest(char *data, int dataLengthBytes, unsigned char *digestBuffer)
 	MD5_Final(digestBuffer, &c);
 }
 
-void read_mailbox(string& user, vector<Message>& messages, vector<string>& headers){
-	ifstream mailbox;
-	mailbox.open(string(MAILBOX_DIR) + "/" + user, ios_base::in);
-
-	// read mailbox line by line until reading header, then save a message
-	string data, line;
-	string header = "From ";
-	while (getline(mailbox, line)) {
-		if (line.compare(0, header.size(), header) == 0) {
-			// end with last message
-			messages.push_back(Message(data));
-			data = "";
-
-			// replace \n to \r\n and save line to headers
-			line.pop_back();
-			line += "\r\n";
-			headers.push_back(line);
-		} else {
-			// replace \n to \r\n and add line to data
-			line.pop_back();
-			line += "\r\n";
-			data += line;
-		}
-	}
-	mailbox.close();
-
-	// drop first message(empty), and add last message, except no messages
-	if (!messages.empty()) {
-		messages.erase(messages.begin());
-		messages.push_back(Message(data));
-	}
-}
-
-void update_mailbox(string& user, vector<Message>& messages, vector<string>& headers){
-	// discard old and write new
-	ofstream mailbox;
-	mailbox.open(string(MAILBOX_DIR) + "/" + user, ios_base::out | ios_base::trunc);
-
-	for (int i=0; i<messages.size();i++){
-		if (messages[i].deleted) continue; // drop deleted message
-		mailbox << headers[i];
-		mailbox << messages[i].data;
-	}
-	mailbox.close();
 }
-
-
-
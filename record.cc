@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <string>
+#include <atomic>
+#include "record.h"
+#include "metrics.h"
+using namespace std;
+
+// the session on this thread
+struct Capture {
+	uint32_t session;
+	int64_t opened;  // metrics_now()
+	int16_t reply;   // of the command being handled
+	string entries;
+};
+
+static int FD = -1;
+static int64_t START_MS; // of the file, wall clock
+static atomic<uint32_t> NEXT_SESSION(1);
+static thread_local Capture* CAPTURE;
+static int M_SESSIONS, M_BYTES;
+
+void record_init(const char* path){
+	M_SESSIONS = metrics_counter("record_sessions_total", "Sessions written to the capture file.");
+	M_BYTES = metrics_counter("record_bytes_total", "Bytes written to the capture file.");
+
+	FD = open(path, O_RDWR | O_APPEND | O_CREAT, 0600);
+	struct stat st;
+	RecordHeader h;
+	if (FD < 0 || fstat(FD, &st) != 0) {
+		cerr << "cannot open capture file\r\n";
+		exit(2);
+	}
+	if (st.st_size == 0) {
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		memcpy(h.magic, RECORD_MAGIC, sizeof(h.magic));
+		h.start_ms = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+		write(FD, &h, sizeof(h));
+	} else if (pread(FD, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, RECORD_MAGIC, sizeof(h.magic)) != 0) {
+		cerr << "not a capture file\r\n";
+		exit(2);
+	}
+	// appended to, e.g. after a restart: sessions go on from the time of the
+	// first start, and the session numbers from one the file cannot have yet
+	START_MS = h.start_ms;
+	NEXT_SESSION = (uint32_t)(st.st_size / sizeof(RecordEntry)) + 1;
+}
+
+static void flush(){
+	if (CAPTURE->entries.empty()) return;
+	// one write per batch, O_APPEND keeps batches of concurrent sessions apart
+	if (write(FD, CAPTURE->entries.data(), CAPTURE->entries.length()) > 0) {
+		metrics_add(M_BYTES, CAPTURE->entries.length());
+	}
+	CAPTURE->entries.clear();
+}
+
+static void add(RecordEntry& e){
+	e.session = CAPTURE->session;
+	CAPTURE->entries.append((const char*)&e, sizeof(e));
+	if (CAPTURE->entries.length() >= RECORD_FLUSH) flush();
+}
+
+void record_open(int protocol){
+	if (FD < 0) return;
+	CAPTURE = new Capture;
+	CAPTURE->session = NEXT_SESSION++;
+	CAPTURE->opened = metrics_now();
+	CAPTURE->reply = -1;
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	RecordEntry e = {};
+	e.type = RECORD_OPEN;
+	e.offset_us = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000 - START_MS;
+	e.arg = protocol;
+	e.reply = -1;
+	add(e);
+}
+
+// Keeps the verb and, for the verbs that take them, the message numbers; the
+// rest of the line is dropped.
+void record_command(const char* verb, const char* line, int64_t start){
+	if (CAPTURE == NULL) return;
+	RecordEntry e = {};
+	e.type = RECORD_COMMAND;
+	e.verb = RECORD_NUM_VERBS - 1;
+	for (int i = 0; i < RECORD_NUM_VERBS - 1; i++) {
+		if (strcmp(verb, RECORD_VERBS[i]) == 0) e.verb = i;
+	}
+	e.offset_us = (start - CAPTURE->opened) / 1000;
+	e.duration_us = (metrics_now() - start) / 1000;
+	e.reply = CAPTURE->reply;
+	CAPTURE->reply = -1;
+
+	const char* v = RECORD_VERBS[e.verb];
+	if (strcmp(v, "LIST") == 0 || strcmp(v, "UIDL") == 0 || strcmp(v, "RETR") == 0 || strcmp(v, "TOP") == 0 || strcmp(v, "DELE") == 0) {
+		const char* p = line + strlen(v);
+		char* end;
+		while (e.args < 2 && *p == ' ') {
+			unsigned long n = strtoul(p + 1, &end, 10);
+			if (end == p + 1) break;
+			if (e.args++ == 0) e.arg = n;
+			else e.arg2 = n;
+			p = end;
+		}
+	}
+	add(e);
+}
+
+// the first reply to a command classifies it
+void record_reply(const char* response){
+	if (CAPTURE == NULL || CAPTURE->reply != -1) return;
+	if (strncmp(response, "+OK", 3) == 0) CAPTURE->reply = 1;
+	else if (strncmp(response, "+ ", 2) == 0) CAPTURE->reply = 2;
+	else if (response[0] == '-') CAPTURE->reply = 0;
+	else CAPTURE->reply = atoi(response);
+}
+
+// lines of mail data in a row make one block
+void record_data(uint32_t bytes){
+	if (CAPTURE == NULL) return;
+	string& entries = CAPTURE->entries;
+	if (!entries.empty()) {
+		RecordEntry* last = (RecordEntry*)&entries[entries.length() - sizeof(RecordEntry)];
+		if (last->type == RECORD_DATA) {
+			last->arg += bytes;
+			return;
+		}
+	}
+	RecordEntry e = {};
+	e.type = RECORD_DATA;
+	e.offset_us = (metrics_now() - CAPTURE->opened) / 1000;
+	e.arg = bytes;
+	e.reply = -1;
+	add(e);
+}
+
+void record_close(){
+	if (CAPTURE == NULL) return;
+	RecordEntry e = {};
+	e.type = RECORD_CLOSE;
+	e.offset_us = (metrics_now() - CAPTURE->opened) / 1000;
+	e.reply = -1;
+	add(e);
+	flush();
+	metrics_add(M_SESSIONS, 1);
+	delete CAPTURE;
+	CAPTURE = NULL;
+}
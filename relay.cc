@@ -0,0 +1,612 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <time.h>
+#include <iostream>
+#include <map>
+#include <set>
+#include <vector>
+#include "relay.h"
+#include "affinity.h"
+#include "mailbox.h"
+#include "metrics.h"
+#include "log.h"
+#include "scan.h"
+using namespace std;
+
+// A queue file holds the envelope as the commands that send it, then an
+// empty line and the mail data as received (CRLF lines, dots not stuffed):
+//   MAIL FROM:<sender>\r\n
+//   RCPT TO:<rcpt>\r\n ...
+//   \r\n
+//   data
+// It is written under a tmp. name, synced and renamed into place. While a
+// sender thread works on a file it holds flock() on it, so a process that
+// took over the queue does not send it a second time. The directory is
+// scanned again every RELAY_RESCAN, for mail an instance that handed over
+// its listener queued while it drained or left waiting for a retry.
+
+const int RELAY_BATCH = 16;        // mails taken by a sender at once
+const int RELAY_IDLE = 30;         // seconds an unused connection stays open
+const int RELAY_TIMEOUT = 300;     // seconds to wait for a reply, RFC 5321 4.5.3.2
+const int RELAY_RETRY_MIN = 2;     // seconds before the first retry, doubled each time
+const int RELAY_RETRY_MAX = 3600;
+const int RELAY_RESCAN = 60;       // seconds between scans of the queue directory
+
+// a mail in the queue directory, read when it is sent
+struct Queued {
+	string name;
+	time_t queued;
+	int tries;
+};
+
+// a connection to the smarthost
+struct Connection {
+	int fd;
+	bool pipelining;
+	string in; // read and not used yet
+};
+
+enum { SENT, DEFERRED, DROPPED };
+
+static string QUEUE_DIR;
+static string HOST;
+static string PORT;
+static multimap<time_t, Queued*> QUEUE; // by time of the next try
+static set<string> KNOWN;               // names of the files this process has queued or sends
+static time_t DOWN_UNTIL = 0;           // smarthost unreachable, no connections before
+static int DOWN_TRIES = 0;
+static uint64_t SEQ = 0;
+static bool RUNNING = false;
+static vector<pair<uint32_t, uint32_t> > NETWORKS; // address and mask, host byte order
+static pthread_mutex_t RELAY_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t QUEUED = PTHREAD_COND_INITIALIZER;
+static int M_QUEUED, M_SENT, M_DEFERRED, M_DROPPED, M_CONNECTIONS, M_QUEUE_SIZE, M_TRANSACTION;
+
+static void* sender_thread(void* arg);
+static void* scan_thread(void* arg);
+static int scan_queue();
+static void requeue(Queued* q, time_t at);
+
+// "10.0.0.0/8,127.0.0.1/32" into NETWORKS, false if malformed
+static bool parse_networks(const string& list){
+	size_t start = 0;
+	while (start < list.length()) {
+		size_t comma = list.find(',', start);
+		string item = list.substr(start, comma == string::npos ? string::npos : comma - start);
+		start = comma == string::npos ? list.length() : comma + 1;
+		size_t slash = item.find('/');
+		struct in_addr addr;
+		char* end;
+		long bits = slash == string::npos ? 32 : strtol(item.c_str() + slash + 1, &end, 10);
+		if (inet_pton(AF_INET, item.substr(0, slash).c_str(), &addr) != 1 || bits < 0 || bits > 32
+			|| (slash != string::npos && (end == item.c_str() + slash + 1 || *end != '\0'))) return false;
+		uint32_t mask = bits == 0 ? 0 : 0xffffffffu << (32 - bits);
+		NETWORKS.push_back(make_pair(ntohl(addr.s_addr) & mask, mask));
+	}
+	return !NETWORKS.empty();
+}
+
+void relay_init(const char* smarthost, int connections, const char* networks){
+	M_QUEUED = metrics_counter("relay_queued_total", "Mails queued for the smarthost.");
+	M_SENT = metrics_counter("relay_sent_total", "Recipients the smarthost accepted mail for.");
+	M_DEFERRED = metrics_counter("relay_deferred_total", "Tries that left recipients to try again.");
+	M_DROPPED = metrics_counter("relay_dropped_total", "Recipients refused by the smarthost or expired.");
+	M_CONNECTIONS = metrics_counter("relay_connections_total", "Connections opened to the smarthost.");
+	M_QUEUE_SIZE = metrics_gauge("relay_queue_size", "Mails in the relay queue.");
+	M_TRANSACTION = metrics_histogram("relay_transaction_duration_seconds", "Time to send one mail to the smarthost.", NULL, NULL);
+
+	if (!parse_networks(networks)) {
+		cerr << "malformed relay networks " << networks << "\r\n";
+		exit(1);
+	}
+	HOST = smarthost;
+	PORT = "25";
+	size_t colon = HOST.rfind(':');
+	if (colon != string::npos) {
+		PORT = HOST.substr(colon + 1);
+		HOST.erase(colon);
+	}
+	QUEUE_DIR = string(MAILBOX_DIR) + "/.relay";
+	mkdir(QUEUE_DIR.c_str(), 0700);
+	DIR* d = opendir(QUEUE_DIR.c_str());
+	if (d == NULL) {
+		cerr << "cannot open relay queue directory\r\n";
+		exit(4);
+	}
+	closedir(d);
+
+	// mail left by a stopped process goes first
+	if (scan_queue() > 0) log_event(LOG_INFO, 0, "Sending mail left in the relay queue");
+
+	pthread_t scanner;
+	pthread_create(&scanner, NULL, scan_thread, NULL);
+	pthread_detach(scanner);
+	for (int i = 0; i < connections; i++) {
+		pthread_t thread;
+		pthread_create(&thread, NULL, sender_thread, NULL);
+		pthread_detach(thread);
+	}
+	RUNNING = true;
+}
+
+bool relay_running(){
+	return RUNNING;
+}
+
+bool relay_allowed(uint32_t ip){
+	for (size_t i = 0; i < NETWORKS.size(); i++) {
+		if ((ntohl(ip) & NETWORKS[i].second) == NETWORKS[i].first) return true;
+	}
+	return false;
+}
+
+// Queues the files in the queue directory this process does not know yet,
+// unless a sender of another process has one open; returns how many. tmp.
+// files of a stopped process were never acknowledged.
+static int scan_queue(){
+	DIR* d = opendir(QUEUE_DIR.c_str());
+	if (d == NULL) return 0;
+	time_t now = time(0);
+	int found = 0;
+	struct dirent* ent;
+	while ((ent = readdir(d)) != NULL) {
+		if (ent->d_name[0] == '.') continue;
+		string path = QUEUE_DIR + "/" + ent->d_name;
+		if (strncmp(ent->d_name, "tmp.", 4) == 0) {
+			pid_t pid = atoi(ent->d_name + 4);
+			if (kill(pid, 0) != 0 && errno == ESRCH) unlink(path.c_str());
+			continue;
+		}
+		pthread_mutex_lock(&RELAY_LOCK);
+		bool known = KNOWN.count(ent->d_name) > 0;
+		pthread_mutex_unlock(&RELAY_LOCK);
+		if (known) continue;
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) continue;
+		bool busy = flock(fd, LOCK_EX | LOCK_NB) != 0;
+		close(fd);
+		if (busy) continue;
+
+		Queued* q = new Queued();
+		q->name = ent->d_name;
+		q->queued = atol(ent->d_name);
+		q->tries = 0;
+		pthread_mutex_lock(&RELAY_LOCK);
+		KNOWN.insert(q->name);
+		pthread_mutex_unlock(&RELAY_LOCK);
+		requeue(q, now);
+		metrics_add(M_QUEUE_SIZE, 1);
+		found++;
+	}
+	closedir(d);
+	return found;
+}
+
+static void* scan_thread(void* arg){
+	affinity_pin(AFFINITY_DELIVERY);
+	while (true) {
+		sleep(RELAY_RESCAN);
+		int found = scan_queue();
+		if (found > 0) log_event(LOG_INFO, 0, "Took over mail in the relay queue: ", to_string(found).c_str());
+	}
+	return NULL;
+}
+
+// done with a mail, sent, dropped or gone
+static void forget(Queued* q){
+	pthread_mutex_lock(&RELAY_LOCK);
+	KNOWN.erase(q->name);
+	pthread_mutex_unlock(&RELAY_LOCK);
+	metrics_add(M_QUEUE_SIZE, -1);
+	delete q;
+}
+
+static void requeue(Queued* q, time_t at){
+	pthread_mutex_lock(&RELAY_LOCK);
+	QUEUE.insert(make_pair(at, q));
+	pthread_cond_signal(&QUEUED);
+	pthread_mutex_unlock(&RELAY_LOCK);
+}
+
+static bool write_all(int fd, const char* p, size_t n){
+	while (n > 0) {
+		ssize_t w = write(fd, p, n);
+		if (w <= 0) return false;
+		p += w;
+		n -= w;
+	}
+	return true;
+}
+
+static void sync_dir(){
+	int fd = open(QUEUE_DIR.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd < 0) return;
+	fsync(fd);
+	close(fd);
+}
+
+// Writes a queue file in place of the one named, if any, once it is on disk.
+static bool write_queued(const string& name, const string& sender, const vector<string>& rcpts, const string& data){
+	pthread_mutex_lock(&RELAY_LOCK);
+	string tmp = QUEUE_DIR + "/tmp." + to_string(getpid()) + "-" + to_string(++SEQ);
+	pthread_mutex_unlock(&RELAY_LOCK);
+
+	string envelope = "MAIL FROM:<" + sender + ">\r\n";
+	for (size_t i = 0; i < rcpts.size(); i++) envelope += "RCPT TO:<" + rcpts[i] + ">\r\n";
+	envelope += "\r\n";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) return false;
+	bool ok = write_all(fd, envelope.data(), envelope.length()) && write_all(fd, data.data(), data.length()) && fsync(fd) == 0;
+	close(fd);
+	ok = ok && rename(tmp.c_str(), (QUEUE_DIR + "/" + name).c_str()) == 0;
+	if (!ok) {
+		unlink(tmp.c_str());
+		return false;
+	}
+	sync_dir();
+	return true;
+}
+
+// Returns once the mail is on disk in the queue, false if it could not be
+// written; a sender thread takes it from there.
+bool relay_enqueue(const string& sender, const vector<string>& rcpts, const string& data){
+	time_t now = time(0);
+	pthread_mutex_lock(&RELAY_LOCK);
+	string name = to_string(now) + "-" + to_string(getpid()) + "-" + to_string(++SEQ);
+	KNOWN.insert(name); // before the file is there for a scan to find
+	pthread_mutex_unlock(&RELAY_LOCK);
+	if (!write_queued(name, sender, rcpts, data)) {
+		pthread_mutex_lock(&RELAY_LOCK);
+		KNOWN.erase(name);
+		pthread_mutex_unlock(&RELAY_LOCK);
+		log_event(LOG_ERROR, 0, "Cannot write to the relay queue");
+		return false;
+	}
+	Queued* q = new Queued();
+	q->name = name;
+	q->queued = now;
+	q->tries = 0;
+	requeue(q, now);
+	metrics_add(M_QUEUED, 1);
+	metrics_add(M_QUEUE_SIZE, 1);
+	return true;
+}
+
+// Reads a queue file that no other process is sending, -1 if it is gone
+// (sent by another one) or busy (then busy is set).
+static int read_queued(const string& path, string& sender, vector<string>& rcpts, string& data, bool& busy){
+	busy = false;
+	while (true) {
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) return -1;
+		if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+			busy = true;
+			close(fd);
+			return -1;
+		}
+		struct stat st;
+		if (fstat(fd, &st) != 0) {
+			close(fd);
+			return -1;
+		}
+		// replaced or removed while we waited for it
+		if (st.st_nlink == 0) {
+			close(fd);
+			continue;
+		}
+
+		string file(st.st_size, '\0');
+		size_t got = 0;
+		for (ssize_t r; got < file.size() && (r = read(fd, &file[got], file.size() - got)) > 0;) got += r;
+		file.resize(got);
+		size_t pos = 0, end;
+		while ((end = file.find("\r\n", pos)) != string::npos && end > pos) {
+			size_t open = file.find('<', pos), close = file.find('>', pos);
+			if (open < end && close < end) {
+				string address = file.substr(open + 1, close - open - 1);
+				if (file.compare(pos, 10, "MAIL FROM:") == 0) sender = address;
+				else rcpts.push_back(address);
+			}
+			pos = end + 2;
+		}
+		if (end == string::npos) {
+			log_event(LOG_ERROR, 0, "Damaged relay queue file ", path.c_str());
+			rcpts.clear();
+		} else {
+			data = file.substr(end + 2);
+		}
+		return fd;
+	}
+}
+
+// mail data with a dot before every line that starts with one (RFC 5321
+// 4.5.2), a line ending after the last line and the terminating dot
+static void stuff_dots(const string& data, string& out){
+	const char* p = data.data();
+	const char* end = p + data.length();
+	out.reserve(data.length() + 16);
+	if (p < end && *p == '.') out += '.';
+	for (const char* dot = scan_dot_line(p, end); dot != NULL; dot = scan_dot_line(dot + 3, end)) {
+		out.append(p, dot + 3 - p);
+		out += '.';
+		p = dot + 3;
+	}
+	out.append(p, end - p);
+	if (out.length() > 0 && (out.length() < 2 || out.compare(out.length() - 2, 2, "\r\n") != 0)) out += "\r\n";
+	out += ".\r\n";
+}
+
+static bool send_all(Connection& c, const string& s){
+	for (size_t at = 0; at < s.length();) {
+		ssize_t w = send(c.fd, s.data() + at, s.length() - at, MSG_NOSIGNAL);
+		if (w <= 0) return false;
+		at += w;
+	}
+	return true;
+}
+
+// Reads a reply, all lines of a multiline one, and returns its code, 0 if
+// the connection failed. The text of every line goes to lines if given.
+static int read_reply(Connection& c, vector<string>* lines = NULL){
+	while (true) {
+		size_t nl = c.in.find("\r\n");
+		if (nl == string::npos) {
+			char buff[4096];
+			ssize_t r = read(c.fd, buff, sizeof(buff));
+			if (r <= 0) return 0;
+			c.in.append(buff, r);
+			continue;
+		}
+		string line = c.in.substr(0, nl);
+		c.in.erase(0, nl + 2);
+		if (line.length() < 3) return 0;
+		if (lines != NULL) lines->push_back(line.length() > 4 ? line.substr(4) : "");
+		if (line.length() == 3 || line[3] == ' ') return atoi(line.c_str());
+	}
+}
+
+static void hang_up(Connection& c){
+	if (c.fd < 0) return;
+	if (send_all(c, "QUIT\r\n")) read_reply(c);
+	close(c.fd);
+	c.fd = -1;
+	c.in.clear();
+}
+
+// Opens a connection to the smarthost and greets it, false if it cannot be
+// reached or does not take mail.
+static bool dial(Connection& c){
+	struct addrinfo hints, *res;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(HOST.c_str(), PORT.c_str(), &hints, &res) != 0) return false;
+	c.fd = -1;
+	for (struct addrinfo* ai = res; ai != NULL && c.fd < 0; ai = ai->ai_next) {
+		c.fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (c.fd < 0) continue;
+		struct timeval tv = {RELAY_TIMEOUT, 0};
+		setsockopt(c.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(c.fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if (connect(c.fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+			close(c.fd);
+			c.fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+	if (c.fd < 0) return false;
+	metrics_add(M_CONNECTIONS, 1);
+
+	c.in.clear();
+	c.pipelining = false;
+	vector<string> lines;
+	int code = read_reply(c) == 220 && send_all(c, "EHLO localhost\r\n") ? read_reply(c, &lines) : 0;
+	if (code >= 500 && code < 600) {
+		// no ESMTP
+		code = send_all(c, "HELO localhost\r\n") ? read_reply(c) : 0;
+	}
+	for (size_t i = 0; i < lines.size(); i++) {
+		if (strncasecmp(lines[i].c_str(), "PIPELINING", 10) == 0) c.pipelining = true;
+	}
+	if (code / 100 != 2) {
+		hang_up(c);
+		return false;
+	}
+	return true;
+}
+
+// outcome of a reply for the recipients it applies to
+static int outcome(int code){
+	if (code / 100 == 2) return SENT;
+	return code / 100 == 5 ? DROPPED : DEFERRED;
+}
+
+// Sends one mail over c and sets the outcome for each recipient. The
+// commands up to DATA go at once with PIPELINING, else one at a time. False
+// if the connection is no use any more.
+static bool send_mail(Connection& c, const string& sender, const vector<string>& rcpts, const string& data, vector<int>& result){
+	vector<string> commands;
+	commands.push_back("MAIL FROM:<" + sender + ">\r\n");
+	for (size_t i = 0; i < rcpts.size(); i++) commands.push_back("RCPT TO:<" + rcpts[i] + ">\r\n");
+	commands.push_back("DATA\r\n");
+	result.assign(rcpts.size(), DEFERRED);
+
+	vector<int> codes;
+	if (c.pipelining) {
+		string all;
+		for (size_t i = 0; i < commands.size(); i++) all += commands[i];
+		if (!send_all(c, all)) return false;
+		for (size_t i = 0; i < commands.size(); i++) {
+			codes.push_back(read_reply(c));
+			if (codes.back() == 0) return false;
+		}
+	} else {
+		// no RCPT after a refused MAIL, no DATA without a recipient
+		bool any = false;
+		for (size_t i = 0; i < commands.size(); i++) {
+			if ((i > 0 && codes[0] / 100 != 2) || (i == commands.size() - 1 && !any)) break;
+			if (!send_all(c, commands[i])) return false;
+			codes.push_back(read_reply(c));
+			if (codes.back() == 0) return false;
+			if (i > 0 && codes.back() / 100 == 2) any = true;
+		}
+	}
+
+	int mail = codes[0];
+	int final = codes.size() == commands.size() ? codes.back() : 0;
+	bool any = false;
+	for (size_t i = 0; i < rcpts.size(); i++) {
+		result[i] = outcome(mail / 100 != 2 ? mail : i + 1 < codes.size() ? codes[i + 1] : 450);
+		if (result[i] == SENT) any = true;
+	}
+	if (final == 354) {
+		// a server that takes DATA without a recipient gets no mail
+		string text;
+		if (any) stuff_dots(data, text);
+		else text = ".\r\n";
+		if (!send_all(c, text)) return false;
+		final = read_reply(c);
+		if (final == 0) return false;
+	} else if (mail / 100 == 2) {
+		// the transaction is open on the server
+		if (!send_all(c, "RSET\r\n") || read_reply(c) == 0) return false;
+	}
+	for (size_t i = 0; i < rcpts.size(); i++) {
+		if (result[i] == SENT && final / 100 != 2) result[i] = final == 0 ? DEFERRED : outcome(final);
+	}
+	return final != 421 && mail != 421;
+}
+
+// Sends a queued mail, then removes its file, or rewrites it with the
+// recipients to try again. Returns false if it has to be tried again.
+static bool deliver(Connection& c, Queued* q){
+	string path = QUEUE_DIR + "/" + q->name;
+	string sender, data;
+	vector<string> rcpts;
+	bool busy;
+	int fd = read_queued(path, sender, rcpts, data, busy);
+	if (fd < 0) return !busy;
+
+	int64_t start = metrics_now();
+	vector<int> result;
+	if (!rcpts.empty() && !send_mail(c, sender, rcpts, data, result)) {
+		close(c.fd);
+		c.fd = -1;
+		c.in.clear();
+	}
+	metrics_observe(M_TRANSACTION, metrics_now() - start);
+
+	vector<string> again;
+	for (size_t i = 0; i < result.size(); i++) {
+		if (result[i] == SENT) {
+			metrics_add(M_SENT, 1);
+		} else if (result[i] == DROPPED) {
+			metrics_add(M_DROPPED, 1);
+			log_event(LOG_WARN, 0, "Smarthost refused mail for ", rcpts[i].c_str());
+		} else {
+			again.push_back(rcpts[i]);
+		}
+	}
+	if (again.empty()) unlink(path.c_str());
+	else if (again.size() < rcpts.size() && !write_queued(q->name, sender, again, data)) log_event(LOG_ERROR, 0, "Cannot update relay queue file ", path.c_str());
+	close(fd);
+	return again.empty();
+}
+
+// Back in the queue after a try that left recipients, with the wait doubled,
+// or dropped when it has been tried for RELAY_LIFETIME.
+static void retry(Queued* q){
+	time_t now = time(0);
+	metrics_add(M_DEFERRED, 1);
+	if (now - q->queued > RELAY_LIFETIME) {
+		log_event(LOG_WARN, 0, "Dropped mail the smarthost did not take in time: ", q->name.c_str());
+		unlink((QUEUE_DIR + "/" + q->name).c_str());
+		metrics_add(M_DROPPED, 1);
+		forget(q);
+		return;
+	}
+	int wait = RELAY_RETRY_MAX;
+	if (q->tries < 20) wait = min(RELAY_RETRY_MIN << q->tries, RELAY_RETRY_MAX);
+	q->tries++;
+	requeue(q, now + wait);
+}
+
+// Waits for mail that is due and takes up to RELAY_BATCH of it. With a
+// connection open it gives up after RELAY_IDLE, so the connection is closed.
+static vector<Queued*> take_batch(bool connected){
+	vector<Queued*> batch;
+	pthread_mutex_lock(&RELAY_LOCK);
+	time_t idle_until = time(0) + RELAY_IDLE;
+	while (true) {
+		time_t now = time(0);
+		time_t due = QUEUE.empty() ? 0 : max(QUEUE.begin()->first, DOWN_UNTIL);
+		if (!QUEUE.empty() && due <= now) break;
+		if (connected && now >= idle_until) break;
+		if (QUEUE.empty() && !connected) {
+			pthread_cond_wait(&QUEUED, &RELAY_LOCK);
+			continue;
+		}
+		struct timespec wake = {QUEUE.empty() ? idle_until : connected ? min(due, idle_until) : due, 0};
+		pthread_cond_timedwait(&QUEUED, &RELAY_LOCK, &wake);
+	}
+	time_t now = time(0);
+	while (!QUEUE.empty() && QUEUE.begin()->first <= now && DOWN_UNTIL <= now && batch.size() < RELAY_BATCH) {
+		batch.push_back(QUEUE.begin()->second);
+		QUEUE.erase(QUEUE.begin());
+	}
+	pthread_mutex_unlock(&RELAY_LOCK);
+	return batch;
+}
+
+// One connection of the pool: kept open while there is mail to send.
+static void* sender_thread(void* arg){
+	affinity_pin(AFFINITY_DELIVERY);
+	Connection c;
+	c.fd = -1;
+	while (true) {
+		vector<Queued*> batch = take_batch(c.fd >= 0);
+		if (batch.empty()) {
+			hang_up(c);
+			continue;
+		}
+
+		if (c.fd < 0 && !dial(c)) {
+			// the other threads wait too
+			pthread_mutex_lock(&RELAY_LOCK);
+			DOWN_UNTIL = time(0) + min(RELAY_RETRY_MIN << min(DOWN_TRIES, 20), RELAY_RETRY_MAX);
+			DOWN_TRIES++;
+			pthread_mutex_unlock(&RELAY_LOCK);
+			log_event(LOG_WARN, 0, "Cannot reach smarthost ", HOST.c_str());
+			for (size_t i = 0; i < batch.size(); i++) retry(batch[i]);
+			continue;
+		}
+		pthread_mutex_lock(&RELAY_LOCK);
+		DOWN_TRIES = 0;
+		pthread_mutex_unlock(&RELAY_LOCK);
+
+		for (size_t i = 0; i < batch.size(); i++) {
+			// the rest goes back when the connection broke
+			if (c.fd < 0) {
+				requeue(batch[i], time(0));
+				continue;
+			}
+			if (deliver(c, batch[i])) {
+				forget(batch[i]);
+			} else {
+				retry(batch[i]);
+			}
+		}
+	}
+	return NULL;
+}
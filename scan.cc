@@ -0,0 +1,145 @@
+#include <string.h>
+#include "scan.h"
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+using namespace std;
+
+// A match needs the first and the last byte of the needle at the right
+// distance, so a block is tested with two unaligned loads and the few
+// candidates left are checked with memcmp. Blocks stop short of end, the rest
+// goes through the scalar loop.
+
+static int cpu_level(){
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") ? SCAN_AVX2 : SCAN_SSE2;
+#else
+	return SCAN_SCALAR;
+#endif
+}
+
+static const int CPU_LEVEL = cpu_level();
+static int LEVEL = CPU_LEVEL;
+
+int scan_level(){
+	return LEVEL;
+}
+
+int scan_use(int level){
+	LEVEL = level < CPU_LEVEL ? level : CPU_LEVEL;
+	return LEVEL;
+}
+
+const char* scan_name(int level){
+	const char* names[] = {"scalar", "sse2", "avx2"};
+	return names[level];
+}
+
+static const char* find_scalar(const char* p, const char* end, const char* needle, size_t k){
+	for (; p + k <= end; p++) {
+		if (*p == needle[0] && memcmp(p + 1, needle + 1, k - 1) == 0) return p;
+	}
+	return NULL;
+}
+
+static size_t bare_lf_scalar(const char* p, const char* end, char last){
+	size_t n = 0;
+	for (; p < end; last = *p++) {
+		if (*p == '\n' && last != '\r') n++;
+	}
+	return n;
+}
+
+#ifdef SCAN_X86
+static const char* find_sse2(const char* p, const char* end, const char* needle, size_t k){
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[k - 1]);
+	for (; p + k - 1 + 16 <= end; p += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)p);
+		__m128i b = _mm_loadu_si128((const __m128i*)(p + k - 1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+		for (; mask != 0; mask &= mask - 1) {
+			int i = __builtin_ctz(mask);
+			if (memcmp(p + i + 1, needle + 1, k - 2) == 0) return p + i;
+		}
+	}
+	return find_scalar(p, end, needle, k);
+}
+
+__attribute__((target("avx2")))
+static const char* find_avx2(const char* p, const char* end, const char* needle, size_t k){
+	const __m256i first = _mm256_set1_epi8(needle[0]);
+	const __m256i last = _mm256_set1_epi8(needle[k - 1]);
+	for (; p + k - 1 + 32 <= end; p += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)p);
+		__m256i b = _mm256_loadu_si256((const __m256i*)(p + k - 1));
+		unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+		for (; mask != 0; mask &= mask - 1) {
+			int i = __builtin_ctz(mask);
+			if (memcmp(p + i + 1, needle + 1, k - 2) == 0) return p + i;
+		}
+	}
+	return find_sse2(p, end, needle, k);
+}
+
+// the byte before each block is loaded too, to see the CR of a CRLF that
+// straddles two blocks
+static size_t bare_lf_sse2(const char* p, const char* end, char last){
+	if (p == end) return 0;
+	size_t n = *p == '\n' && last != '\r';
+	const __m128i lf = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+	for (p++; p + 16 <= end; p += 16) {
+		unsigned a = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), lf));
+		unsigned b = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p - 1)), cr));
+		n += __builtin_popcount(a & ~b);
+	}
+	return n + bare_lf_scalar(p, end, p[-1]);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t bare_lf_avx2(const char* p, const char* end, char last){
+	if (p == end) return 0;
+	size_t n = *p == '\n' && last != '\r';
+	const __m256i lf = _mm256_set1_epi8('\n'), cr = _mm256_set1_epi8('\r');
+	for (p++; p + 32 <= end; p += 32) {
+		unsigned a = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), lf));
+		unsigned b = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p - 1)), cr));
+		n += __builtin_popcount(a & ~b);
+	}
+	return n + bare_lf_scalar(p, end, p[-1]);
+}
+#endif
+
+static const char* find(const char* p, const char* end, const char* needle, size_t k){
+#ifdef SCAN_X86
+	if (LEVEL == SCAN_AVX2) return find_avx2(p, end, needle, k);
+	if (LEVEL == SCAN_SSE2) return find_sse2(p, end, needle, k);
+#endif
+	return find_scalar(p, end, needle, k);
+}
+
+const char* scan_crlf(const char* p, const char* end){
+	return find(p, end, "\r\n", 2);
+}
+
+const char* scan_data_end(const char* p, const char* end){
+	return find(p, end, "\r\n.\r\n", 5);
+}
+
+const char* scan_dot_line(const char* p, const char* end){
+	return find(p, end, "\r\n.", 3);
+}
+
+const char* scan_from(const char* p, const char* end){
+	return find(p, end, "\nFrom ", 6);
+}
+
+size_t scan_bare_lf(const char* p, const char* end, char last){
+#ifdef SCAN_X86
+	if (LEVEL == SCAN_AVX2) return bare_lf_avx2(p, end, last);
+	if (LEVEL == SCAN_SSE2) return bare_lf_sse2(p, end, last);
+#endif
+	return bare_lf_scalar(p, end, last);
+}
@@ -13,19 +13,46 @@
 #include <set>
 #include <time.h>
 #include <algorithm>
+#include "metrics.h"
+#include "log.h"
+#include "admission.h"
+#include "timer.h"
+#include "handoff.h"
+#include <poll.h>
+#include <fcntl.h>
+#include "mailbox.h"
+#include "scan.h"
+#include "journal.h"
+#include "relay.h"
+#include "tls.h"
+#include "affinity.h"
+#include "record.h"
+#include <sys/un.h>
 using namespace std;
 
+namespace smtp {
+
 // message
 const char* SERVER_READY    = "220 localhost smtp server ready\r\n";
+const char* LMTP_READY      = "220 localhost LMTP server ready\r\n";
 const char* SERVICE_CLOSE   = "221 localhost service closing transmission channel\r\n";
 const char* SERVICE_NA      = "421 localhost service not available, closing transmission channel\r\n";
 const char* HELO            = "250 localhost\r\n";
+const char* EHLO            = "250-localhost\r\n";
+const char* PIPELINING      = "250-PIPELINING\r\n";
+const char* STARTTLS        = "250-STARTTLS\r\n";
+const char* TLS_READY       = "220 Ready to start TLS\r\n";
 const char* OK              = "250 OK\r\n";
 const char* START_MAIL      = "354 Start mail input; end with <CRLF>.\r\n";
 const char* UNKNOWN_CMD     = "500 Syntax error, command unrecognized\r\n";
 const char* SYNTAX_ERR      = "501 Syntax error in parameters or arguments\r\n";
 const char* BAD_SEQ         = "503 Bad sequence of commands\r\n";
 const char* MAILBOX_NA      = "550 Requested action not taken: mailbox unavailable\r\n";
+const char* RELAY_DENIED    = "550 Requested action not taken: relaying denied\r\n";
+const char* TOO_BIG         = "552 Message size exceeds fixed maximum message size\r\n";
+const char* LOCAL_ERR       = "451 Requested action aborted: local error in processing\r\n";
+const char* OVER_QUOTA      = "552 Requested mail action aborted: exceeded storage allocation\r\n";
+const char* TIMEOUT         = "421 localhost timeout, closing transmission channel\r\n";
 const char* NEW_CONN        = "New connection\r\n";
 const char* CLOSE_CONN 		= "Connection closed\r\n";
 
@@ -33,36 +60,78 @@ const char* CLOSE_CONN 		= "Connection closed\r\n";
 const int BUFF_SIZE = 5000;
 const int CMD_SIZE = 5;
 const int RSP_SIZE = 100;
-const int MAILBOX_SIZE = 50;
+const int MAILBOX_SIZE = 256; // RFC 5321 4.5.3.1.3, longest path
+const int OUTPUT_SIZE = 65536; // responses are flushed at this size, or when no command is left
 bool DEBUG = false;
+int IDLE_TIMEOUT = 300; // seconds, RFC 5321: wait at least 5 minutes for a command
+int MIN_RATE = 100;     // bytes/s averaged over a transfer window, 0 only requires progress
+off_t MAX_SIZE = 25600 * 1024; // bytes of a message, RFC 1870 SIZE, 0 for unlimited
 vector<int> SOCKETS;
 vector<pthread_t> THREADS;
-set<string> MAILBOXES;
-char* MAILBOX_DIR;
-static pthread_mutex_t mutexes[1000]; // mutexes for mailbox updating, assume max 1000 mailboxes
+char* UPGRADE_PATH = NULL; // unix socket for listener handoff, see handoff.h
+static int LMTP_STOP[2] = {-1, -1}; // pipe, written to close the LMTP listener
+static thread_local string OUTPUT;
+static thread_local Tls* TLS; // once the session did STARTTLS
+
+// a connection of either listener, handed to worker_thread()
+struct Session : Client {
+	bool lmtp; // LMTP (RFC 2033) from an upstream MTA, else SMTP
+};
+
+// metrics, registered in init_metrics()
+const char* VERBS[] = {"HELO", "EHLO", "MAIL", "RCPT", "DATA", "RSET", "NOOP", "QUIT", "LHLO", "STARTTLS", "OTHER"};
+const int NUM_VERBS = 11;
+int M_ACCEPTS, M_REJECTED, M_SESSIONS, M_BYTES_IN, M_BYTES_OUT, M_LOCK_WAIT, M_DELIVERY;
+int M_VERB[NUM_VERBS];
 
 
 int smtp_server(unsigned int port);
+void lmtp_serve(const char* addr);
+void *lmtp_thread(void *arg);
+void lmtp_stop();
+int open_lmtp_socket(const char* addr);
 void signal_handler(int arg);
+void close_sockets();
 void *worker_thread(void *arg);
-void handle_helo(int comm_fd, int* state, char* buff);
-void handle_from(int comm_fd, int* state, char* buff, string& sender);
-void handle_to(int comm_fd, int* state, char* buff, vector<string>& rcpts);
-void handle_data(int comm_fd, int* state, char* buff, char* end, string& data, string& sender, vector<string>& rcpts);
-void handle_rset(int comm_fd, int* state, string& data, string& sender, vector<string>& rcpts);
+void handle_helo(int comm_fd, int* state, char* buff, bool extended, bool lmtp);
+void handle_from(int comm_fd, int* state, char* buff, string& sender, off_t* size);
+void handle_to(int comm_fd, int* state, char* buff, vector<string>& rcpts, vector<string>& remote, off_t* size, bool relay);
+void handle_data(int comm_fd, int* state, char* buff, char* end, string& data, string& sender, vector<string>& rcpts, vector<string>& remote, off_t* size, bool lmtp);
+void handle_rset(int comm_fd, int* state, string& data, string& sender, vector<string>& rcpts, vector<string>& remote, off_t* size);
+bool handle_starttls(int comm_fd, int* state, Watchdog* watchdog, bool* QUIT);
 void handle_response(int comm_fd, const char* response);
+void flush_output(int comm_fd);
 void clear_buffer(char* buffer, char*end);
+char* data_block(char* buff, char* stop);
+void append_unstuffed(string& data, const char* p, const char* end);
 void parse_mailbox(char* dest, char* src);
 void parse_mailbox(char* dest, char* host, char* src);
-void load_mailboxes();
+void init_metrics();
+int verb_index(const char* command);
 
+}
+using namespace smtp;
 
+// maild runs this server next to pop3 and has its own main()
+#ifndef NO_MAIN
 int main(int argc, char *argv[]){
 	int c;
 	unsigned int port = 2500;
+	char* metrics_addr = NULL;
+	int max_sessions = 1000, max_per_ip = 0;
+	int compress = 0;
+	long quota_kb = 0;
+	int writers = 0;
+	char* smarthost = NULL;
+	int connections = RELAY_CONNECTIONS;
+	const char* networks = RELAY_NETWORKS;
+	char* lmtp_addr = NULL;
+	char* tls_files = NULL;
+	char* affinity = NULL;
+	char* capture = NULL;
 
 	// getopt() for command parsing
-	while((c=getopt(argc,argv,"p:av"))!=-1){
+	while((c=getopt(argc,argv,"p:avm:c:i:t:r:u:z:l:q:j:g:n:y:d:k:x:e:"))!=-1){
 		switch(c){
 		case 'p': //set port num
 			port = atoi(optarg);
@@ -70,116 +139,345 @@ int main(int argc, char *argv[]){
 		case 'a': //exit
 	    	cerr << "Wudao Ling (wudao) @UPenn\r\n";
 	    	exit(1);
-		case 'v': //debug mode
+		case 'v': //debug mode, log every command and response
 			DEBUG = true;
 			break;
+		case 'm': //metrics endpoint, port or unix socket path
+			metrics_addr = optarg;
+			break;
+		case 'c': //max concurrent sessions, 0 for unlimited
+			max_sessions = atoi(optarg);
+			break;
+		case 'i': //max concurrent sessions per client IP, 0 for unlimited
+			max_per_ip = atoi(optarg);
+			break;
+		case 't': //idle timeout in seconds
+			IDLE_TIMEOUT = atoi(optarg);
+			break;
+		case 'r': //minimum transfer rate in bytes/s
+			MIN_RATE = atoi(optarg);
+			break;
+		case 'u': //upgrade socket: take over a running instance, hand over to the next
+			UPGRADE_PATH = optarg;
+			break;
+		case 'z': //compress delivered mail with this zlib level, 1-9
+			compress = atoi(optarg);
+			break;
+		case 'l': //max message size in KB, 0 for unlimited
+			MAX_SIZE = (off_t)atol(optarg) * 1024;
+			break;
+		case 'q': //mailbox quota in KB, 0 for unlimited
+			quota_kb = atol(optarg);
+			break;
+		case 'j': //deliver through the journal with this many writer threads
+			writers = atoi(optarg);
+			break;
+		case 'g': //relay mail for other hosts to this smarthost, host[:port]
+			smarthost = optarg;
+			break;
+		case 'n': //connections to the smarthost
+			connections = atoi(optarg);
+			break;
+		case 'y': //clients that may relay, address/bits,...
+			networks = optarg;
+			break;
+		case 'd': //LMTP for delivery from an upstream MTA, port or unix socket path
+			lmtp_addr = optarg;
+			break;
+		case 'k': //TLS certificate[:key], PEM, offers STARTTLS
+			tls_files = optarg;
+			break;
+		case 'x': //CPUs of the threads, role=cpus:..., see affinity.h
+			affinity = optarg;
+			break;
+		case 'e': //append sanitized session captures to this file, see record.h
+			capture = optarg;
+			break;
 		default:
-			cerr <<"Syntax: "<< argv[0] << " [-p port] [-a] [-v] <mailboxes directory>\r\n";
+			cerr <<"Syntax: "<< argv[0] << " [-p port] [-a] [-v] [-m metrics port|socket] [-c max sessions] [-i max sessions per IP] [-t idle timeout] [-r min rate] [-u upgrade socket] [-z zlib level] [-l max message KB] [-q quota KB] [-j journal writers] [-g smarthost[:port]] [-n smarthost connections] [-y relay networks] [-d lmtp port|socket] [-k certificate[:key]] [-x affinity] [-e capture file] <mailboxes directory>\r\n";
 			exit(1);
 		}
 	}
 
 	// check mailbox directory: remaining non-option arguments
 	if (optind == argc) {
-		cerr <<"Syntax: "<< argv[0] << " [-p port] [-a] [-v] <mailbox directory>\r\n";
+		cerr <<"Syntax: "<< argv[0] << " [-p port] [-a] [-v] [-m metrics port|socket] [-c max sessions] [-i max sessions per IP] [-t idle timeout] [-r min rate] [-u upgrade socket] [-z zlib level] [-l max message KB] [-q quota KB] [-j journal writers] [-g smarthost[:port]] [-n smarthost connections] [-y relay networks] [-d lmtp port|socket] [-k certificate[:key]] [-x affinity] [-e capture file] <mailbox directory>\r\n";
 		exit(1);
 	}
 
-	MAILBOX_DIR = new char;
-	strcpy(MAILBOX_DIR, argv[optind]);
-	load_mailboxes();
+	mailbox_init(argv[optind], true, 0, compress, quota_kb); // smtp alone never reads an index
+
+	log_init(DEBUG ? LOG_DEBUG : LOG_INFO);
+	init_metrics();
+	if (affinity != NULL) affinity_init(affinity); // before any thread starts
+	if (capture != NULL) record_init(capture);
+	if (tls_files != NULL) tls_init(tls_files);
+	if (writers > 0) journal_init(writers); // delivers what a stopped process left
+	if (smarthost != NULL) relay_init(smarthost, connections, networks); // sends what a stopped process queued
+	if (metrics_addr != NULL) metrics_serve(metrics_addr);
+	admission_init(max_sessions, max_per_ip);
+	timer_start();
+	if (lmtp_addr != NULL) lmtp_serve(lmtp_addr);
+
+	// handle ctrl+c signal
+	signal(SIGINT, signal_handler);
+	// writes to sockets shut down by a timeout must fail, not kill the process
+	signal(SIGPIPE, SIG_IGN);
 
     //smtp server
     smtp_server(port);
 }
+#endif
+
+namespace smtp {
+
+void init_metrics(){
+	M_ACCEPTS = metrics_counter("smtp_accepts_total", "Connections accepted.");
+	M_REJECTED = metrics_counter("smtp_rejected_total", "Connections refused by admission control.");
+	M_SESSIONS = metrics_gauge("smtp_sessions_active", "Sessions currently open.");
+	M_BYTES_IN = metrics_counter("smtp_bytes_in_total", "Bytes read from clients.");
+	M_BYTES_OUT = metrics_counter("smtp_bytes_out_total", "Bytes written to clients.");
+	for (int i = 0; i < NUM_VERBS; i++) {
+		M_VERB[i] = metrics_histogram("smtp_command_duration_seconds", "Time to handle a command.", "verb", VERBS[i]);
+	}
+	M_LOCK_WAIT = metrics_histogram("smtp_mailbox_lock_wait_seconds", "Time spent waiting for a mailbox lock.", NULL, NULL);
+	M_DELIVERY = metrics_histogram("smtp_delivery_duration_seconds", "Time to append a mail to all recipients.", NULL, NULL);
+}
 
-void load_mailboxes(){
-	DIR *dir;
-	struct dirent *ent;
-	if ((dir = opendir(MAILBOX_DIR)) != NULL) {
-		while ((ent = readdir (dir)) != NULL) {
-			int i = 0;
-			if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0){
-				string mailbox(ent->d_name);
-				MAILBOXES.insert(mailbox);
-			}
-		}
-		closedir (dir);
-
-		// init mutexes
-	    for (int i = 0; i < MAILBOXES.size(); i++){
-	        pthread_mutex_init(&mutexes[i], NULL);
-	    }
-
-	} else {
-		cerr << "cannot open mailbox directory\r\n";
-	    exit(4);
+// metric index of a command, OTHER if unknown
+int verb_index(const char* command){
+	for (int i = 0; i < NUM_VERBS - 1; i++) {
+		if (strncasecmp(command, VERBS[i], 4) == 0) return i;
 	}
+	return NUM_VERBS - 1;
 }
 
 int smtp_server(unsigned int port){
-	// handle ctrl+c signal
-	signal(SIGINT, signal_handler);
+	affinity_pin(AFFINITY_ACCEPT);
+	// take over the listening socket of a running instance, if there is one
+	int listen_fd = -1;
+	if (UPGRADE_PATH != NULL) listen_fd = handoff_receive(UPGRADE_PATH, "smtp");
+	if (listen_fd >= 0) {
+		log_event(LOG_INFO, -1, "Took over listening socket from running instance");
+	} else {
+	    // create a new socket (TCP)
+		listen_fd = socket(PF_INET, SOCK_STREAM, 0);
+		if (listen_fd < 0) {
+			cerr << "cannot open socket\r\n";
+		    exit(2);
+		}
+
+	    // set port for reuse
+		const int REUSE = 1;
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &REUSE, sizeof(REUSE));
 
-    // create a new socket (TCP)
-	int listen_fd = socket(PF_INET, SOCK_STREAM, 0);
-	if (listen_fd < 0) {
-		cerr << "cannot open socket\r\n";
-	    exit(2);
+		// bind server with a port
+		struct sockaddr_in servaddr;
+		bzero(&servaddr, sizeof(servaddr));
+		servaddr.sin_family = AF_INET;
+		servaddr.sin_addr.s_addr = htons(INADDR_ANY);
+		servaddr.sin_port = htons(port);
+		bind(listen_fd, (struct sockaddr*)&servaddr, sizeof(servaddr));
+
+		listen(listen_fd, 100); // length of queue of pending connections
 	}
 	SOCKETS.push_back(listen_fd);
+	int handoff_fd = UPGRADE_PATH != NULL ? handoff_serve(UPGRADE_PATH, "smtp", listen_fd) : -1;
 
-    // set port for reuse
-	const int REUSE = 1;
-	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &REUSE, sizeof(REUSE));
-
-	// bind server with a port
-	struct sockaddr_in servaddr;
-	bzero(&servaddr, sizeof(servaddr));
-	servaddr.sin_family = AF_INET;
-	servaddr.sin_addr.s_addr = htons(INADDR_ANY);
-	servaddr.sin_port = htons(port);
-	bind(listen_fd, (struct sockaddr*)&servaddr, sizeof(servaddr));
+	// both instances poll the shared socket during a handoff, accept must not block
+	fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+	struct pollfd fds[2] = {{listen_fd, POLLIN, 0}, {handoff_fd, POLLIN, 0}};
 
-	// listen and accept
-	listen(listen_fd, 100); // length of queue of pending connections
+	// accept until the listening socket is handed to a new instance
 	while(true){
+		poll(fds, handoff_fd >= 0 ? 2 : 1, -1);
+		if (handoff_fd >= 0 && fds[1].revents != 0) break;
+
 		struct sockaddr_in clientaddr;
 		socklen_t clientaddrlen = sizeof(clientaddr);
 		int fd = accept(listen_fd, (struct sockaddr*)&clientaddr, &clientaddrlen);
-		SOCKETS.push_back(fd);
+		if (fd < 0) continue;
+		metrics_add(M_ACCEPTS, 1);
+
+		// shed load over the session caps before spending a thread on it
+		Session* client = new Session;
+		client->fd = fd;
+		client->ip = clientaddr.sin_addr.s_addr;
+		client->lmtp = false;
+		if (!admission_acquire(client->ip)) {
+			admission_reject(fd, SERVICE_NA);
+			metrics_add(M_REJECTED, 1);
+			log_event(LOG_WARN, fd, "Connection refused, over session limit from ", inet_ntoa(clientaddr.sin_addr));
+			delete client;
+			continue;
+		}
 
-		// dispatcher assign connection to worker threads, concurrent <=100
+		// dispatcher assign connection to worker threads
 		pthread_t thread;
-		pthread_create(&thread, NULL, worker_thread, &fd);
+		if (pthread_create(&thread, NULL, worker_thread, client) != 0) {
+			admission_release(client->ip);
+			admission_reject(fd, SERVICE_NA);
+			metrics_add(M_REJECTED, 1);
+			delete client;
+			continue;
+		}
+		SOCKETS.push_back(fd);
 		THREADS.push_back(thread);
 		// mark resource of thread for reclaim when it terminates
 		pthread_detach(thread);
     }
-    return 0;
+
+	// drain: the new instance takes new connections, ours run to completion;
+	// it waits for the LMTP port, which a busy upstream MTA would keep open
+	close(listen_fd);
+	lmtp_stop();
+	log_event(LOG_INFO, -1, "Draining sessions: ", to_string(admission_active()).c_str());
+	while (admission_active() > 0) {
+		usleep(100000);
+	}
+	// mail acknowledged with 250 but still in our journal, which the new
+	// instance could not take over while we hold it
+	journal_drain();
+	log_event(LOG_INFO, -1, "All sessions drained, exiting");
+	exit(0);
+}
+
+// LMTP (RFC 2033) listener for an upstream MTA, a TCP port on loopback or a
+// unix socket: it is not authenticated and takes mail for local mailboxes
+// only. Its sessions run the same worker_thread() as SMTP ones.
+void lmtp_serve(const char* addr){
+	if (pipe(LMTP_STOP) != 0) {
+		cerr << "cannot open lmtp socket\r\n";
+		exit(2);
+	}
+	pthread_t thread;
+	pthread_create(&thread, NULL, lmtp_thread, (void*)addr);
+	pthread_detach(thread);
+}
+
+// port, or path of a unix socket if addr has a '/'; -1 if the port is busy
+int open_lmtp_socket(const char* addr){
+	int listen_fd;
+	if (strchr(addr, '/') != NULL) {
+		struct sockaddr_un unaddr;
+		bzero(&unaddr, sizeof(unaddr));
+		unaddr.sun_family = AF_UNIX;
+		strncpy(unaddr.sun_path, addr, sizeof(unaddr.sun_path) - 1);
+		unlink(addr);
+		listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&unaddr, sizeof(unaddr)) < 0) {
+			cerr << "cannot open lmtp socket\r\n";
+			exit(2);
+		}
+	} else {
+		struct sockaddr_in servaddr;
+		bzero(&servaddr, sizeof(servaddr));
+		servaddr.sin_family = AF_INET;
+		servaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		servaddr.sin_port = htons(atoi(addr));
+		listen_fd = socket(PF_INET, SOCK_STREAM, 0);
+		if (listen_fd < 0) {
+			cerr << "cannot open lmtp port\r\n";
+			exit(2);
+		}
+		const int REUSE = 1;
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &REUSE, sizeof(REUSE));
+		if (bind(listen_fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
+			close(listen_fd);
+			return -1;
+		}
+	}
+	listen(listen_fd, 100);
+	return listen_fd;
+}
+
+void *lmtp_thread(void *arg){
+	const char* addr = (const char*)arg;
+	affinity_pin(AFFINITY_ACCEPT);
+
+	// during an upgrade the running instance holds the port until it exits
+	int listen_fd;
+	bool warned = false;
+	while ((listen_fd = open_lmtp_socket(addr)) < 0) {
+		if (!warned) log_event(LOG_WARN, -1, "LMTP port busy, retrying: ", addr);
+		warned = true;
+		sleep(1);
+	}
+
+	// accept until lmtp_stop()
+	struct pollfd fds[2] = {{listen_fd, POLLIN, 0}, {LMTP_STOP[0], POLLIN, 0}};
+	while (true) {
+		poll(fds, 2, -1);
+		if (fds[1].revents != 0) break;
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) continue;
+		metrics_add(M_ACCEPTS, 1);
+
+		// the MTA is local, it counts against the per IP cap as loopback
+		Session* client = new Session;
+		client->fd = fd;
+		client->ip = htonl(INADDR_LOOPBACK);
+		client->lmtp = true;
+		if (!admission_acquire(client->ip)) {
+			admission_reject(fd, SERVICE_NA);
+			metrics_add(M_REJECTED, 1);
+			log_event(LOG_WARN, fd, "LMTP connection refused, over session limit from ", addr);
+			delete client;
+			continue;
+		}
+
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, worker_thread, client) != 0) {
+			admission_release(client->ip);
+			admission_reject(fd, SERVICE_NA);
+			metrics_add(M_REJECTED, 1);
+			delete client;
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	close(listen_fd);
+	log_event(LOG_INFO, -1, "LMTP listener closed for the new instance");
+	return NULL;
+}
+
+// closes the LMTP listener, if there is one; its sessions go on
+void lmtp_stop(){
+	if (LMTP_STOP[1] >= 0) write(LMTP_STOP[1], "", 1);
 }
 
 void signal_handler(int arg) {
+	close_sockets();
+	exit(3);
+}
+
+void close_sockets() {
+	if (SOCKETS.empty()) return;
 	// close listen_fd first to prevent incoming sockets
 	close(SOCKETS[0]);
-	delete MAILBOX_DIR;
 
 	for (int i = 1; i < SOCKETS.size(); i++) {
 		write(SOCKETS[i], SERVICE_NA, strlen(SERVICE_NA));
 		close(SOCKETS[i]);
 		pthread_kill(THREADS[i - 1], 0);
 	}
-	exit(3);
 }
 
 void *worker_thread(void *arg){
-	int comm_fd = *(int*)arg;
+	Session* client = (Session*)arg;
+	int comm_fd = client->fd;
+	bool lmtp = client->lmtp;
+	affinity_pin_session(comm_fd); // before the session allocates anything
 
 	// send greeting message
-	write(comm_fd, SERVER_READY, strlen(SERVER_READY));
-	if (DEBUG){
-		cerr << "["<< comm_fd << "] " << NEW_CONN;
-	}
+	const char* greeting = lmtp ? LMTP_READY : SERVER_READY;
+	metrics_add(M_SESSIONS, 1);
+	int sent = write(comm_fd, greeting, strlen(greeting));
+	if (sent > 0) metrics_add(M_BYTES_OUT, sent);
+	log_event(LOG_DEBUG, comm_fd, NEW_CONN);
+	record_open(lmtp ? RECORD_LMTP : RECORD_SMTP);
+	Watchdog watchdog;
+	watchdog_init(&watchdog, comm_fd, TIMEOUT, IDLE_TIMEOUT * 1000, MIN_RATE);
 
 	int state = 0;
 	// 0 - INIT
@@ -187,7 +485,6 @@ void *worker_thread(void *arg){
 	// 2 - MAIL
 	// 3 - RCPT
 	// 4 - DATA start
-	// 5 - DATA end
     // 6 - QUIT
 
 	// maintain a buffer
@@ -198,39 +495,70 @@ void *worker_thread(void *arg){
 	// mail data
 	string sender;
 	vector<string> rcpts;
+	vector<string> remote; // addresses on other hosts, for the smarthost
+	bool relay = !lmtp && relay_running() && relay_allowed(client->ip); // LMTP only delivers to the store
 	string data;
+	off_t size = 0; // declared with MAIL FROM, then as received in DATA
 
 	while(true){
 		char* end = new char;
-		// expect to read (BUF_SIZE-curr_len) bytes to curr, assuming already read (curr_len) bytes
-		int len = read(comm_fd, curr, BUFF_SIZE-strlen(buff));
+		// next command within the idle timeout, mail data at the minimum rate
+		if (state == 4) watchdog_transfer(&watchdog);
+		else watchdog_idle(&watchdog);
+		// replies to pipelined commands go out together
+		flush_output(comm_fd);
 
-		while((end=strstr(buff,"\r\n"))!=NULL){ // check whether command terminate
-			// strstr return 1st index, move to real end
+		// expect to read (BUF_SIZE-curr_len) bytes to curr, assuming already read (curr_len) bytes
+		int len = TLS != NULL ? tls_read(TLS, curr, BUFF_SIZE-strlen(buff)) : read(comm_fd, curr, BUFF_SIZE-strlen(buff));
+		if (len <= 0) break; // client closed the connection without QUIT, or timed out
+		metrics_add(M_BYTES_IN, len);
+		watchdog_progress(&watchdog, len);
+
+		char* stop = buff + strlen(buff);
+		while((end=(char*)scan_crlf(buff, stop))!=NULL){ // check whether command terminate
+			// scan_crlf return 1st index, move to real end
 			end += 2;
+			// in DATA take all complete lines up to the terminating dot at once
+			if (state == 4 && strncmp(buff, ".\r\n", 3) != 0) end = data_block(buff, stop);
 			// read command
 			char *command = new char[CMD_SIZE];
 			strncpy(command, buff, CMD_SIZE);
 			command[CMD_SIZE] = '\0'; // strncpy doesn't append \0 at the en
 
-			if (DEBUG) cerr << "["<< comm_fd << "] " << "C: "<< command <<endl;
+			log_event(LOG_DEBUG, comm_fd, "C: ", command);
+			// time commands per verb, in DATA only the terminating dot counts (as DATA)
+			int verb = verb_index(command);
+			if (state == 4) verb = strncmp(buff, ".\r\n", 3) == 0 ? 4 : -1;
+			bool in_data = state == 4;
+			size_t line_len = end - buff;
+			int64_t start = metrics_now();
 
 			// handle command
 		    if (strcasecmp(command, "data\r") == 0 || state ==4){
 		    	// DATA, which is followed by the text of the email and then a dot (.) on a line by itself
-			    handle_data(comm_fd, &state, buff, end, data, sender, rcpts);
-		    } else if (strcasecmp(command, "helo ") == 0){
+			    handle_data(comm_fd, &state, buff, end, data, sender, rcpts, remote, &size, lmtp);
+		    } else if (strcasecmp(command, "helo ") == 0 && !lmtp){
 		    	// HELO <domain>, which starts a connection
-				handle_helo(comm_fd, &state, buff);
+				handle_helo(comm_fd, &state, buff, false, false);
+		    } else if (strcasecmp(command, "ehlo ") == 0 && !lmtp){
+		    	// EHLO <domain>, starts a connection and lists the extensions (RFC 5321)
+				handle_helo(comm_fd, &state, buff, true, false);
+		    } else if (strcasecmp(command, "lhlo ") == 0 && lmtp){
+		    	// LHLO <domain>, the EHLO of LMTP (RFC 2033 4.1)
+				handle_helo(comm_fd, &state, buff, true, true);
 			} else if (strcasecmp(command, "mail ") == 0){
-				// MAIL FROM:, which tells the server who the sender of the email is
-				handle_from(comm_fd, &state, buff, sender);
+				// MAIL FROM: [SIZE=n], which tells the server who the sender of the email is
+				handle_from(comm_fd, &state, buff, sender, &size);
 			} else if (strcasecmp(command, "rcpt ") == 0){
 				// RCPT TO:, which specifies the recipient
-				handle_to(comm_fd, &state, buff, rcpts);
+				handle_to(comm_fd, &state, buff, rcpts, remote, &size, relay);
 			} else if (strcasecmp(command, "rset\r") == 0){
 				// RSET, aborts a mail transaction
-				handle_rset(comm_fd, &state, data, sender, rcpts);
+				handle_rset(comm_fd, &state, data, sender, rcpts, remote, &size);
+			} else if (strncasecmp(buff, "starttls\r\n", 10) == 0 && !lmtp){
+				// STARTTLS, the rest of the session is encrypted (RFC 3207); any
+				// command pipelined after it was sent in the clear and is dropped
+				if (handle_starttls(comm_fd, &state, &watchdog, &QUIT)) end = stop;
 			} else if (strcasecmp(command, "noop\r") == 0){
 				// NOOP, which does nothing
 				handle_response(comm_fd, OK);
@@ -242,10 +570,15 @@ void *worker_thread(void *arg){
 			} else { // unknown command
 				handle_response(comm_fd, UNKNOWN_CMD);
 			}
+			if (verb >= 0) metrics_observe(M_VERB[verb], metrics_now() - start);
+			// a capture keeps the verb, or the size of a block of mail data
+			if (verb < 0) record_data(line_len);
+			else record_command(in_data ? "." : VERBS[verb], buff, start);
 
 			delete[] command;
 			if (QUIT) break;
 			clear_buffer(buff, end);
+			stop -= end - buff;
 		}
 
 		if (QUIT) break;
@@ -258,15 +591,23 @@ void *worker_thread(void *arg){
 		}
 	}
 
+	flush_output(comm_fd);
+	watchdog_stop(&watchdog);
+	if (watchdog.expired) log_event(LOG_INFO, comm_fd, "Connection timed out");
+	record_close();
+
     // terminate socket
+	if (TLS != NULL) tls_close(TLS);
+	TLS = NULL;
 	close(comm_fd);
-	if (DEBUG) {
-		cerr << "[" << comm_fd << "] " << CLOSE_CONN;
-	}
+	metrics_add(M_SESSIONS, -1);
+	admission_release(client->ip);
+	delete client;
+	log_event(LOG_DEBUG, comm_fd, CLOSE_CONN);
 	pthread_exit(NULL);
 }
 
-void handle_helo(int comm_fd, int* state, char* buff){
+void handle_helo(int comm_fd, int* state, char* buff, bool extended, bool lmtp){
 	// further check <domain>
 	if (strlen(buff) <= CMD_SIZE){
 		handle_response(comm_fd, SYNTAX_ERR);
@@ -276,11 +617,20 @@ void handle_helo(int comm_fd, int* state, char* buff){
 		handle_response(comm_fd, BAD_SEQ);
 	} else {
 		*state = 1;
-		handle_response(comm_fd, HELO);
+		if (extended) {
+			// RFC 1870: SIZE without a number means no fixed maximum
+			string size = MAX_SIZE > 0 ? "250 SIZE " + to_string(MAX_SIZE) + "\r\n" : "250 SIZE\r\n";
+			handle_response(comm_fd, EHLO);
+			if (lmtp) handle_response(comm_fd, PIPELINING); // required by RFC 2033
+			if (!lmtp && tls_running() && TLS == NULL) handle_response(comm_fd, STARTTLS);
+			handle_response(comm_fd, size.c_str());
+		} else {
+			handle_response(comm_fd, HELO);
+		}
 	}
 }
 
-void handle_from(int comm_fd, int* state, char* buff, string& sender) {
+void handle_from(int comm_fd, int* state, char* buff, string& sender, off_t* size) {
 	// further check command
 	char extra[5];
 	strncpy(extra, buff+CMD_SIZE, 5);
@@ -295,20 +645,29 @@ void handle_from(int comm_fd, int* state, char* buff, string& sender) {
 		char send[MAILBOX_SIZE];
 		parse_mailbox(send, buff);
 
+		// SIZE=n parameter after the address, the client's estimate
+		char* params = strchr(buff, '>');
+		char* param = params != NULL ? strcasestr(params, " size=") : NULL;
+		long long declared = param != NULL ? atoll(param + 6) : 0;
+
 		// check sender mail address
 		string candidate(send);
 		if (count(candidate.begin(),candidate.end(),'@')!=1 || candidate.find("@")==0 || candidate.find("@")==candidate.length()-1){
 			// only one '@', not at start or end
 			handle_response(comm_fd, SYNTAX_ERR);
+		} else if (MAX_SIZE > 0 && declared > MAX_SIZE) {
+			// refused before any data is sent
+			handle_response(comm_fd, TOO_BIG);
 		} else {
 			*state = 2;
 			sender = candidate;
+			*size = declared;
 			handle_response(comm_fd, OK);
 		}
 	}
 }
 
-void handle_to(int comm_fd, int* state, char* buff, vector<string>& rcpts) {
+void handle_to(int comm_fd, int* state, char* buff, vector<string>& rcpts, vector<string>& remote, off_t* size, bool relay) {
 	// further check command
 	char extra[3];
 	strncpy(extra, buff+CMD_SIZE, 3);
@@ -317,8 +676,14 @@ void handle_to(int comm_fd, int* state, char* buff, vector<string>& rcpts) {
 		handle_response(comm_fd, UNKNOWN_CMD);
 	}
 
+	// <user@host>, which may be relayed, so it must not be cut short
+	char* open = strchr(buff, '<');
+	char* close = open != NULL ? strchr(open, '>') : NULL;
+
 	if (*state < 2 || *state > 3) {
 		handle_response(comm_fd, BAD_SEQ);
+	} else if (close == NULL || close - open > MAILBOX_SIZE - 1 || memchr(open, '@', close - open) == NULL) {
+		handle_response(comm_fd, SYNTAX_ERR);
 	} else {
 		char rcpt[MAILBOX_SIZE];
 		char host[MAILBOX_SIZE];
@@ -326,8 +691,19 @@ void handle_to(int comm_fd, int* state, char* buff, vector<string>& rcpts) {
 		string mailbox(rcpt);
 		mailbox += ".mbox";
 
-		if (strcmp(host, "localhost") != 0 || MAILBOXES.find(mailbox)==MAILBOXES.end() ){
+		Mailbox* mb = strcmp(host, "localhost") == 0 ? mailbox_find(mailbox) : NULL;
+		if (mb == NULL && strcmp(host, "localhost") != 0 && relay){
+			// queued for the smarthost, which checks the address
+			*state = 3;
+			remote.push_back(string(rcpt) + "@" + host);
+			handle_response(comm_fd, OK);
+		} else if (mb == NULL && strcmp(host, "localhost") != 0 && relay_running()){
+			handle_response(comm_fd, RELAY_DENIED);
+		} else if (mb == NULL){
 			handle_response(comm_fd, MAILBOX_NA);
+		} else if (!mailbox_fits(mb, *size)){
+			// full, or no room for the declared size
+			handle_response(comm_fd, OVER_QUOTA);
 		} else {
 			// TODO: check duplicate recipients?
 			*state = 3;
@@ -337,52 +713,113 @@ void handle_to(int comm_fd, int* state, char* buff, vector<string>& rcpts) {
 	}
 }
 
-void handle_data(int comm_fd, int* state, char* buff, char* end, string& data, string& sender, vector<string>& rcpts){
+void handle_data(int comm_fd, int* state, char* buff, char* end, string& data, string& sender, vector<string>& rcpts, vector<string>& remote, off_t* size, bool lmtp){
 	if (*state < 3 || *state > 4){
 		handle_response(comm_fd, BAD_SEQ);
 	} else if(*state ==3){
 		*state = 4;
+		*size = 0;
 		handle_response(comm_fd, START_MAIL);
-	} else if(strcmp(buff,".\r\n")!=0){ // data continue
-		string line(buff,end-buff);
-		data += line;
+	} else if(strncmp(buff,".\r\n",3)!=0){ // data continue, one or more lines
+		// past the maximum the rest is only counted, the mail is refused at the end
+		*size += end - buff;
+		if (MAX_SIZE == 0 || *size <= MAX_SIZE) append_unstuffed(data, buff, end);
 	} else { // data ends
-		cout << "data ends"<<endl;
-		*state = 5;
+		*state = 1; // the transaction is over, another may follow
+
+		// the declared size may have been wrong, check what was received;
+		// SMTP refuses the mail if a recipient has no room for it, LMTP only
+		// that recipient (RFC 2033 4.2). The room is reserved as it is found,
+		// so concurrent sessions cannot all take it, and given back below.
+		bool too_big = MAX_SIZE > 0 && *size > MAX_SIZE;
+		bool fits = !too_big;
+		vector<const char*> replies(rcpts.size(), OK);
+		vector<Mailbox*> mailboxes; // each once, however often it was given
+		vector<Mailbox*> rcpt_mailboxes(rcpts.size());
+		for (int i = 0; i < rcpts.size(); i++) {
+			Mailbox* mb = rcpt_mailboxes[i] = mailbox_find(rcpts[i]);
+			if (too_big) {
+				replies[i] = TOO_BIG;
+			} else if (find(mailboxes.begin(), mailboxes.end(), mb) != mailboxes.end()) {
+				continue;
+			} else if (!mailbox_fits(mb, *size, true)) {
+				replies[i] = OVER_QUOTA;
+				fits = false;
+			} else {
+				mailboxes.push_back(mb);
+			}
+		}
+		if (!fits && !lmtp) {
+			log_event(LOG_WARN, comm_fd, "Refused mail over size or quota from ", sender.c_str());
+			for (int i = 0; i < mailboxes.size(); i++) mailbox_reserve(mailboxes[i], -*size);
+			data.clear();
+			sender.clear();
+			rcpts.clear();
+			remote.clear();
+			handle_response(comm_fd, too_big ? TOO_BIG : OVER_QUOTA);
+			return;
+		} else if (!fits) {
+			log_event(LOG_WARN, comm_fd, "Refused mail over size or quota for some recipients from ", sender.c_str());
+		}
 
 		// prepare mail
-		time_t now = time(0);
-		string time = ctime(&now); // convert raw time to calendar time
-		string header = "From <" + sender + "> " + time;
-
-		// append mail to each mailbox with mutex
-		// TODO: add flock for smtp/pop3 sync
-		for (int i=0; i<rcpts.size();i++){
-			int j = distance(MAILBOXES.begin(), MAILBOXES.find(rcpts[i])); // get a constant index for a mailbox
-			cout << "start lock"<<endl;
-		    pthread_mutex_lock(&mutexes[j]); // lock
-		    cout << "after lock"<<endl;
-			ofstream mailbox;
-			mailbox.open(string(MAILBOX_DIR) + "/" + rcpts[i], ios_base::app);
-			mailbox << header << data;
-			mailbox.close();
-			cout << "finish mailbox writing"<<endl;
-		    pthread_mutex_unlock(&mutexes[j]); // release
-		    cout << "release lock"<<endl;
+		string header = mailbox_from_line(sender, time(0));
+
+		// queue mail for other hosts first, nothing is delivered if that fails;
+		// then append it to each mailbox, see mailbox.h for locking, or to the
+		// journal that does it for us, in one batch
+		int64_t delivery_start = metrics_now();
+		vector<Mailbox*> failed; // appends that did not make it, LMTP tells their recipients
+		bool journaled = false;
+		bool delivered = remote.empty() || relay_enqueue(sender, remote, data);
+		if (delivered && !mailboxes.empty()) {
+			Mail mail;
+			mailbox_prepare(mail, data);
+			if (journal_running()) {
+				delivered = journal_append(mailboxes, header, mail, *size);
+				journaled = true;
+			} else {
+				for (int i=0; i<mailboxes.size();i++){
+					int64_t waited;
+					if (!mailbox_deliver(mailboxes[i], header, mail, &waited)) {
+						log_event(LOG_ERROR, comm_fd, "Cannot append mail to ", mailboxes[i]->name.c_str());
+						failed.push_back(mailboxes[i]);
+					}
+					metrics_observe(M_LOCK_WAIT, waited);
+				}
+				delivered = failed.empty();
+			}
+		}
+		// give back the room reserved above, unless the journal took it over
+		if (!journaled) {
+			for (int i = 0; i < mailboxes.size(); i++) mailbox_reserve(mailboxes[i], -*size);
+		}
+		metrics_observe(M_DELIVERY, metrics_now() - delivery_start);
+		if (log_enabled(LOG_INFO)) {
+			string note = "<" + sender + "> to " + to_string(mailboxes.size() + remote.size()) + " recipient(s)";
+			log_event(LOG_INFO, comm_fd, "Delivered mail from ", note.c_str());
 		}
 
 		// clear all
 		data.clear();
 		sender.clear();
 		rcpts.clear();
-		cout << "finish clear"<<endl;
+		remote.clear();
 
-		handle_response(comm_fd, OK);
+		if (!lmtp) {
+			handle_response(comm_fd, delivered ? OK : LOCAL_ERR);
+		} else {
+			// one reply per accepted recipient, in order
+			for (int i = 0; i < replies.size(); i++) {
+				bool lost = !delivered && (failed.empty() || find(failed.begin(), failed.end(), rcpt_mailboxes[i]) != failed.end());
+				handle_response(comm_fd, replies[i] != OK ? replies[i] : lost ? LOCAL_ERR : OK);
+			}
+		}
 	}
 
 }
 
-void handle_rset(int comm_fd, int* state, string& data, string& sender, vector<string>& rcpts) {
+void handle_rset(int comm_fd, int* state, string& data, string& sender, vector<string>& rcpts, vector<string>& remote, off_t* size) {
 	if (*state == 0) {
 		handle_response(comm_fd, BAD_SEQ);
 	} else {
@@ -391,16 +828,76 @@ void handle_rset(int comm_fd, int* state, string& data, string& sender, vector<s
 		data.clear();
 		sender.clear();
 		rcpts.clear();
+		remote.clear();
+		*size = 0;
 
 		handle_response(comm_fd, OK);
 	}
 }
 
+// Returns true once the session is encrypted; sets QUIT if the handshake
+// failed, the connection cannot be used after that.
+bool handle_starttls(int comm_fd, int* state, Watchdog* watchdog, bool* QUIT){
+	if (!tls_running()) {
+		handle_response(comm_fd, UNKNOWN_CMD);
+	} else if (TLS != NULL || *state > 1) {
+		handle_response(comm_fd, BAD_SEQ);
+	} else {
+		handle_response(comm_fd, TLS_READY);
+		flush_output(comm_fd);
+		TLS = tls_accept(comm_fd);
+		if (TLS == NULL) {
+			*QUIT = true;
+			return false;
+		}
+		// the client starts over with EHLO; a timeout closes without a
+		// response, which would be sent in the clear
+		*state = 0;
+		watchdog->response = "";
+		return true;
+	}
+	return false;
+}
+
 void handle_response(int comm_fd, const char* response){
-	write(comm_fd, response, strlen(response));
-	if (DEBUG) {
-		cerr << "["<< comm_fd << "] " << "S: "<< response;
+	OUTPUT += response;
+	log_event(LOG_DEBUG, comm_fd, "S: ", response);
+	record_reply(response);
+	if (OUTPUT.length() >= OUTPUT_SIZE) flush_output(comm_fd);
+}
+
+void flush_output(int comm_fd){
+	for (int start = 0; start < OUTPUT.length();) {
+		int len = TLS != NULL ? tls_write(TLS, OUTPUT.data() + start, OUTPUT.length() - start)
+			: write(comm_fd, OUTPUT.data() + start, OUTPUT.length() - start);
+		if (len <= 0) break; // client is gone, or timed out
+		metrics_add(M_BYTES_OUT, len);
+		start += len;
 	}
+	OUTPUT.clear();
+}
+
+// End of the mail data in the buffer: just past the CRLF before the
+// terminating dot, else past the last complete line.
+char* data_block(char* buff, char* stop){
+	char* dot = (char*)scan_data_end(buff, stop);
+	if (dot != NULL) return dot + 2;
+	char* nl = stop;
+	do {
+		nl = (char*)memrchr(buff, '\n', nl - buff);
+	} while (nl[-1] != '\r'); // there is a CRLF, the caller found one
+	return nl + 1;
+}
+
+// Appends lines of mail data, removing the dot a client puts before a line
+// that starts with one (RFC 5321 4.5.2).
+void append_unstuffed(string& data, const char* p, const char* end){
+	if (*p == '.') p++;
+	for (const char* dot = scan_dot_line(p, end); dot != NULL; dot = scan_dot_line(dot + 3, end)) {
+		data.append(p, dot + 2 - p);
+		p = dot + 3;
+	}
+	data.append(p, end - p);
 }
 
 void clear_buffer(char *buff, char *end){
@@ -416,13 +913,14 @@ void clear_buffer(char *buff, char *end){
 	}
 }
 
+// dest holds MAILBOX_SIZE bytes, a longer address is cut short
 void parse_mailbox(char* dest, char* src){
 	int i = 0, j = 0;
 	while(src[i] != '<'){
 		i++;
 	}
 	i++; // <> not included
-	while(src[i] != '>'){
+	while(src[i] != '>' && j < MAILBOX_SIZE - 1){
 		dest[j++] = src[i++];
 	}
 	dest[j] = '\0';
@@ -434,18 +932,16 @@ void parse_mailbox(char* dest, char* host, char* src){
 		i++;
 	}
 	i++; // <> not included
-	while(src[i] != '@'){
+	while(src[i] != '@' && j < MAILBOX_SIZE - 1){
 		dest[j++] = src[i++];
 	}
 	dest[j] = '\0';
 	i++; // @ not included
 	j = 0;
-	while(src[i] != '>'){
+	while(src[i] != '>' && j < MAILBOX_SIZE - 1){
 		host[j++] = src[i++];
 	}
 	host[j] = '\0';
 }
 
-
-
-
+}
\ No newline at end of file
@@ -0,0 +1,187 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "test.h"
+
+using namespace std;
+
+// Kill -9 torture test for the pop3 QUIT commit. In every round a pop3 server
+// is started on a mailbox, a client deletes a few messages and sends QUIT, and
+// the server is killed at a random moment around the commit. After the next
+// start the mailbox must hold either all of the messages or all but the
+// deleted ones, the latter for sure if the QUIT got its +OK, and every
+// message must read back intact.
+
+const int BODY_LINES = 30;
+const int MIN_MESSAGES = 20;
+const int REFILL_MESSAGES = 40;
+const int LINE_SIZE = 1000;
+
+void appendMessages(const char *path, int first, int count)
+{
+  FILE *f = fopen(path, "a");
+  if (!f)
+    panic("Cannot open %s (%s)", path, strerror(errno));
+  for (int id=first; id<first+count; id++) {
+    fprintf(f, "From <torture@localhost> Mon Oct 19 05:31:55 2026\nSubject: message %d\n\n", id);
+    for (int i=0; i<BODY_LINES; i++)
+      fprintf(f, "%s\n", bodyLine(id, i).c_str());
+  }
+  fclose(f);
+}
+
+// retrieves every message and checks its text; returns the message ids in order
+vector<int> readMailbox(struct connection *conn)
+{
+  char line[LINE_SIZE];
+  int count;
+  sendCommand(conn, "STAT\r\n");
+  if (!readLine(conn, line, sizeof(line)) || sscanf(line, "+OK %d", &count) != 1)
+    panic("Bad STAT response '%s'", line);
+
+  vector<int> ids;
+  for (int i=1; i<=count; i++) {
+    char cmd[32];
+    snprintf(cmd, sizeof(cmd), "RETR %d\r\n", i);
+    sendCommand(conn, cmd);
+    expectLine(conn, "+OK");
+
+    int id;
+    if (!readLine(conn, line, sizeof(line)) || sscanf(line, "Subject: message %d", &id) != 1)
+      panic("Message %d starts with '%s'", i, line);
+    expectLine(conn, "");
+    for (int j=0; j<BODY_LINES; j++) {
+      if (!readLine(conn, line, sizeof(line)) || bodyLine(id, j) != line)
+        panic("Message %d (id %d) line %d is '%s'", i, id, j, line);
+    }
+    expectLine(conn, ".");
+    ids.push_back(id);
+  }
+  return ids;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 4)
+    panic("Syntax: %s <pop3 binary> <port> <rounds>", argv[0]);
+  const char *binary = argv[1];
+  const char *port = argv[2];
+  int rounds = atoi(argv[3]);
+
+  char dir[] = "/tmp/commit-test-XXXXXX";
+  if (!mkdtemp(dir))
+    panic("Cannot create a temporary directory (%s)", strerror(errno));
+  string path = string(dir) + "/torture.mbox";
+  int nextId = 0;
+  appendMessages(path.c_str(), nextId, REFILL_MESSAGES);
+  nextId += REFILL_MESSAGES;
+
+  struct connection conn;
+  initializeBuffers(&conn, 65536);
+  srand(getpid());
+
+  vector<int> before, after;
+  bool acked = false;
+  int committed = 0, rolledBack = 0, compactions = 0;
+  struct stat st;
+  stat(path.c_str(), &st);
+  ino_t ino = st.st_ino;
+
+  // the last round only checks the mailbox
+  for (int round=0; round<=rounds; round++) {
+    pid_t pid = startServer(binary, "-p", port, dir, (char*)NULL);
+    connectRetry(&conn, atoi(port));
+    expectLine(&conn, "+OK");
+    sendCommand(&conn, "USER torture\r\n");
+    expectLine(&conn, "+OK");
+    sendCommand(&conn, "PASS cis505\r\n");
+    expectLine(&conn, "+OK");
+
+    vector<int> ids = readMailbox(&conn);
+    if (round > 0) {
+      if (ids == after) {
+        committed++;
+      } else if (ids == before && !acked) {
+        rolledBack++;
+      } else {
+        panic("Round %d: %d messages after the crash, expected %d%s", round, (int)ids.size(), (int)after.size(),
+              acked ? " (QUIT was acknowledged)" : " or all of them");
+      }
+    }
+    if (round == rounds) {
+      sendCommand(&conn, "QUIT\r\n");
+      expectLine(&conn, "+OK");
+      closeConnection(&conn);
+      kill(pid, SIGKILL);
+      waitpid(pid, NULL, 0);
+      break;
+    }
+
+    // delete a few messages in one go and crash around the QUIT
+    before = ids;
+    vector<int> picked;
+    int deletes = 1 + rand() % 5;
+    string commands;
+    for (int i=0; i<deletes && i<(int)ids.size(); i++) {
+      int idx = rand() % ids.size();
+      if (find(picked.begin(), picked.end(), idx) != picked.end())
+        continue;
+      picked.push_back(idx);
+      commands += "DELE " + to_string(idx+1) + "\r\n";
+    }
+    after.clear();
+    for (int i=0; i<(int)ids.size(); i++) {
+      if (find(picked.begin(), picked.end(), i) == picked.end())
+        after.push_back(ids[i]);
+    }
+    commands += "QUIT\r\n";
+    sendCommand(&conn, commands.c_str());
+    // some kills land before the server has read the commands, some after
+    // a compaction
+    int delay = rand() % 2 ? rand() % 600 - 100 : rand() % 5000;
+    if (delay > 0)
+      usleep(delay);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+
+    char line[LINE_SIZE];
+    int replies = 0;
+    acked = false;
+    while (readLine(&conn, line, sizeof(line))) {
+      if (++replies == (int)picked.size() + 1)
+        acked = strncmp(line, "+OK", 3) == 0;
+    }
+    closeConnection(&conn);
+
+    stat(path.c_str(), &st);
+    if (st.st_ino != ino)
+      compactions++;
+    ino = st.st_ino;
+
+    // mail arrives while the server is down
+    if ((int)after.size() < MIN_MESSAGES) {
+      appendMessages(path.c_str(), nextId, REFILL_MESSAGES);
+      for (int i=0; i<REFILL_MESSAGES; i++) {
+        before.push_back(nextId + i);
+        after.push_back(nextId + i);
+      }
+      nextId += REFILL_MESSAGES;
+    }
+  }
+
+  printf("%d rounds: %d committed, %d rolled back, %d compactions\n", rounds, committed, rolledBack, compactions);
+  string cleanup = string("rm -rf ") + dir;
+  system(cleanup.c_str());
+  freeBuffers(&conn);
+  return 0;
+}
@@ -5,11 +5,15 @@
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <vector>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
 #include "test.h"
 
+using namespace std;
+
 // This function prints data we sent to the server or received from it. The main 
 // difference to a simple printf() is that this function replaces non-printable
 // characters (say, a zero byte) with <0xAB>, where 0xAB is the ASCII code of 
@@ -52,6 +56,19 @@ void writeString(struct connection *conn, const char *data)
   }
 }
 
+// The same as writeString(), without the log.
+
+void sendCommand(struct connection *conn, const char *data)
+{
+  int len = strlen(data);
+  for (int wptr=0; wptr<len;) {
+    int w = write(conn->fd, &data[wptr], len-wptr);
+    if (w<=0)
+      panic("Cannot write to connection (%s)", strerror(errno));
+    wptr += w;
+  }
+}
+
 // This function verifies that the server has sent us more data at this point.
 // It does this by temporarily putting the socket into nonblocking mode and then
 // attempting a read, which (if there is no data) should return EAGAIN. 
@@ -98,6 +115,66 @@ void connectToPort(struct connection *conn, int portno)
   conn->bytesInBuffer = 0;
 }
 
+// Like connectToPort(), but waits for a server that was just started to come
+// up, for drivers that start the server themselves.
+
+void connectRetry(struct connection *conn, int portno)
+{
+  struct sockaddr_in servaddr;
+  bzero(&servaddr, sizeof(servaddr));
+  servaddr.sin_family=AF_INET;
+  servaddr.sin_port=htons(portno);
+  inet_pton(AF_INET, "127.0.0.1", &(servaddr.sin_addr));
+
+  for (int tries=0; tries<500; tries++) {
+    conn->fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (connect(conn->fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) == 0) {
+      conn->bytesInBuffer = 0;
+      return;
+    }
+    close(conn->fd);
+    usleep(10000);
+  }
+  panic("Cannot connect to localhost:%d", portno);
+}
+
+// Starts a server for drivers that test a binary of their own: the arguments
+// after the binary, up to a NULL, are its command line. The server's output
+// goes to /dev/null.
+
+pid_t startServer(const char *binary, ...)
+{
+  vector<const char*> argv(1, binary);
+  va_list args;
+  va_start(args, binary);
+  for (const char *arg; (arg = va_arg(args, const char*)) != NULL;)
+    argv.push_back(arg);
+  va_end(args);
+  argv.push_back(NULL);
+
+  pid_t pid = fork();
+  if (pid < 0)
+    panic("Cannot fork (%s)", strerror(errno));
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    dup2(null, 2);
+    execv(binary, (char* const*)&argv[0]);
+    _exit(127);
+  }
+  return pid;
+}
+
+// Line 'line' of the body of message 'id', for drivers that check that mail
+// reads back unchanged.
+
+string bodyLine(int id, int line)
+{
+  char buf[100];
+  snprintf(buf, sizeof(buf), "message %d line %d: the quick brown fox jumps over the lazy dog", id, line);
+  return buf;
+}
+
 // Reads a line of text from the server (until it sees a LF) and then compares
 // the line to the argument. The argument should not end with a LF; the function
 // strips off any LF or CRLF from the incoming data before doing the comparison. 
@@ -180,6 +257,50 @@ void expectToRead(struct connection *conn, const char *data)
   conn->bytesInBuffer -= (lfpos+1);
 }
 
+// Reads a line of text from the server into 'line', without its LF or CRLF and
+// without logging it. Returns false if the connection was closed (or reset)
+// before a whole line arrived.
+
+bool readLine(struct connection *conn, char *line, int maxLen)
+{
+  while (true) {
+    for (int i=0; i<conn->bytesInBuffer; i++) {
+      if (conn->buf[i] == '\n') {
+        int len = (i>0 && conn->buf[i-1] == '\r') ? i-1 : i;
+        if (len >= maxLen)
+          len = maxLen-1;
+        memcpy(line, conn->buf, len);
+        line[len] = 0;
+        for (int j=i+1; j<conn->bytesInBuffer; j++)
+          conn->buf[j-(i+1)] = conn->buf[j];
+        conn->bytesInBuffer -= (i+1);
+        return true;
+      }
+    }
+
+    if (conn->bytesInBuffer >= conn->bufferSizeBytes)
+      panic("Read %d bytes, but no CRLF found", conn->bufferSizeBytes);
+
+    int bytesRead = read(conn->fd, &conn->buf[conn->bytesInBuffer], conn->bufferSizeBytes - conn->bytesInBuffer);
+    if (bytesRead <= 0)
+      return false;
+    conn->bytesInBuffer += bytesRead;
+  }
+}
+
+// This function reads a line and checks that it starts with 'prefix'. Unlike
+// expectToRead(), it logs nothing and stops the test on a mismatch; it is meant
+// for drivers that exchange thousands of lines.
+
+void expectLine(struct connection *conn, const char *prefix)
+{
+  char line[1000];
+  if (!readLine(conn, line, sizeof(line)))
+    panic("Connection closed, expected '%s'", prefix);
+  if (strncmp(line, prefix, strlen(prefix)) != 0)
+    panic("Got '%s', expected '%s'", line, prefix);
+}
+
 // This function verifies that the remote end has closed the connection.
 
 void expectRemoteClose(struct connection *conn)
@@ -0,0 +1,148 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <vector>
+#include <string>
+
+#include "test.h"
+
+using namespace std;
+
+// Test for the framing of stored mail. The driver starts a maild with -z on a
+// fresh mailbox directory and sends it mail whose data looks like the lines
+// the mailbox file is framed with: a first line that is a zlib frame line
+// (with a bare LF, as a client can send it), lines starting with "From ",
+// lines starting with dots, next to mail that is stored compressed. Then the
+// server is restarted, so the file is parsed afresh, and pop3 must list every
+// mail and read each one back with only the framing lines quoted. A mailbox
+// written the way mail was stored before DATA was unstuffed, with its dots
+// stuffed and no mark on the From line, must read back the same.
+//
+//   test/frame-test ./maild 2450 11050
+
+const int BODY_LINES = 30;
+const int LINE_SIZE = 1000;
+
+// reads a multi-line pop3 response up to the dot
+vector<string> readLines(struct connection *conn)
+{
+  vector<string> lines;
+  char line[LINE_SIZE];
+  while (true) {
+    if (!readLine(conn, line, sizeof(line)))
+      panic("Connection closed in a multi-line response");
+    if (strcmp(line, ".") == 0)
+      return lines;
+    lines.push_back(line[0] == '.' ? line + 1 : line);
+  }
+}
+
+// logs in as user and reads back every mail
+void checkMailbox(const char *port, const string &user, const vector<vector<string> > &expected)
+{
+  struct connection conn;
+  initializeBuffers(&conn, 65536);
+  connectRetry(&conn, atoi(port));
+  expectLine(&conn, "+OK");
+  sendCommand(&conn, ("USER " + user + "\r\n").c_str());
+  expectLine(&conn, "+OK");
+  sendCommand(&conn, "PASS cis505\r\n");
+  expectLine(&conn, "+OK");
+  char line[LINE_SIZE];
+  int count;
+  sendCommand(&conn, "STAT\r\n");
+  if (!readLine(&conn, line, sizeof(line)) || sscanf(line, "+OK %d", &count) != 1 || count != (int)expected.size())
+    panic("%s: STAT is '%s', expected %d messages", user.c_str(), line, (int)expected.size());
+  for (size_t m=0; m<expected.size(); m++) {
+    sendCommand(&conn, ("RETR " + to_string(m + 1) + "\r\n").c_str());
+    expectLine(&conn, "+OK");
+    if (readLines(&conn) != expected[m])
+      panic("%s: message %d does not read back as sent", user.c_str(), (int)m + 1);
+  }
+  sendCommand(&conn, "QUIT\r\n");
+  expectLine(&conn, "+OK");
+  closeConnection(&conn);
+  freeBuffers(&conn);
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 4)
+    panic("Syntax: %s <maild binary> <smtp port> <pop3 port>", argv[0]);
+  const char *binary = argv[1];
+  const char *smtpPort = argv[2];
+  const char *pop3Port = argv[3];
+
+  char dir[] = "/tmp/frame-test-XXXXXX";
+  if (!mkdtemp(dir))
+    panic("Cannot create a temporary directory (%s)", strerror(errno));
+  string cmd = string("touch ") + dir + "/frame.mbox";
+  system(cmd.c_str());
+  string legacy = "From <tester@localhost> Mon Oct 19 05:31:55 2026\nSubject: legacy\n\n..dot\n...\nplain\n";
+  FILE *f = fopen((string(dir) + "/legacy.mbox").c_str(), "w");
+  if (!f)
+    panic("Cannot create legacy.mbox (%s)", strerror(errno));
+  fwrite(legacy.data(), 1, legacy.length(), f);
+  fclose(f);
+
+  // the data of each mail, and its lines as pop3 must send them back
+  vector<string> mails;
+  vector<vector<string> > expected;
+  mails.push_back("=zlib 100000 1 1 1\nhi\r\n");
+  expected.push_back(vector<string>{">=zlib 100000 1 1 1", "hi"});
+  mails.push_back("=zlib 10 20 30 40\r\n\r\nbody\r\n");
+  expected.push_back(vector<string>{">=zlib 10 20 30 40", "", "body"});
+  mails.push_back("From the desk of the tester\r\nFrom here on\r\n");
+  expected.push_back(vector<string>{">From the desk of the tester", ">From here on"});
+  mails.push_back("..dot\r\n...\r\nplain\r\n");
+  expected.push_back(vector<string>{".dot", "..", "plain"});
+  for (int m=0; m<2; m++) {
+    string data = "Subject: message " + to_string(m) + "\r\n\r\n";
+    vector<string> lines{"Subject: message " + to_string(m), ""};
+    for (int j=0; j<BODY_LINES; j++) {
+      data += bodyLine(m, j) + "\r\n";
+      lines.push_back(bodyLine(m, j));
+    }
+    mails.push_back(data);
+    expected.push_back(lines);
+  }
+
+  pid_t pid = startServer(binary, "-s", smtpPort, "-p", pop3Port, "-z", "6", dir, (char*)NULL);
+  struct connection conn;
+  initializeBuffers(&conn, 65536);
+  connectRetry(&conn, atoi(smtpPort));
+  expectLine(&conn, "220");
+  sendCommand(&conn, "HELO tester\r\n");
+  expectLine(&conn, "250");
+  for (size_t m=0; m<mails.size(); m++) {
+    sendCommand(&conn, "MAIL FROM:<tester@localhost>\r\n");
+    expectLine(&conn, "250");
+    sendCommand(&conn, "RCPT TO:<frame@localhost>\r\n");
+    expectLine(&conn, "250");
+    sendCommand(&conn, "DATA\r\n");
+    expectLine(&conn, "354");
+    sendCommand(&conn, (mails[m] + ".\r\n").c_str());
+    expectLine(&conn, "250");
+  }
+  sendCommand(&conn, "QUIT\r\n");
+  expectLine(&conn, "221");
+  closeConnection(&conn);
+  freeBuffers(&conn);
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+
+  pid = startServer(binary, "-s", smtpPort, "-p", pop3Port, dir, (char*)NULL);
+  checkMailbox(pop3Port, "frame", expected);
+  checkMailbox(pop3Port, "legacy", vector<vector<string> >{{"Subject: legacy", "", ".dot", "..", "plain"}});
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+
+  printf("%d mails framed and read back, and a stored one\n", (int)mails.size());
+  string cleanup = string("rm -rf ") + dir;
+  system(cleanup.c_str());
+  return 0;
+}
@@ -1,6 +1,9 @@
 #ifndef __test_h__
 #define __test_h__
 
+#include <sys/types.h>
+#include <string>
+
 #define panic(a...) do { fprintf(stderr, a); fprintf(stderr, "\n"); exit(1); } while (0) 
 
 // For each connection we keep a) its file descriptor, and b) a buffer that contains
@@ -16,9 +19,15 @@ struct connection {
 
 void log(const char *prefix, const char *data, int len, const char *suffix);
 void writeString(struct connection *conn, const char *data);
+void sendCommand(struct connection *conn, const char *data);
 void expectNoMoreData(struct connection *conn);
 void connectToPort(struct connection *conn, int portno);
+void connectRetry(struct connection *conn, int portno);
+pid_t startServer(const char *binary, ...);
+std::string bodyLine(int id, int line);
 void expectToRead(struct connection *conn, const char *data);
+bool readLine(struct connection *conn, char *line, int maxLen);
+void expectLine(struct connection *conn, const char *prefix);
 void expectRemoteClose(struct connection *conn);
 void initializeBuffers(struct connection *conn, int bufferSizeBytes);
 void closeConnection(struct connection *conn);
@@ -0,0 +1,170 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <vector>
+#include <string>
+
+#include "test.h"
+
+using namespace std;
+
+// Test for the LMTP listener. The driver starts an smtp server with -d on a
+// fresh mailbox directory and sends it transactions with many recipients each,
+// MAIL, RCPT and DATA pipelined in one write and without RSET in between. Some
+// recipients do not exist or are on other hosts (550 at RCPT), one mailbox is
+// too full for the mail (552 after the dot, while the others still get it)
+// and some mails name a recipient twice (one copy). After the dot there must
+// be one reply per accepted recipient, in order, and every mailbox must hold
+// each of its mails exactly once, unchanged.
+//
+//   test/lmtp-test ./smtp 2400 100
+
+const int USERS = 10;
+const int BODY_LINES = 30;
+const int QUOTA_KB = 1024;
+const int LINE_SIZE = 1000;
+
+void writeFile(const string &path, const string &text)
+{
+  FILE *f = fopen(path.c_str(), "w");
+  if (!f)
+    panic("Cannot open %s (%s)", path.c_str(), strerror(errno));
+  fwrite(text.data(), 1, text.length(), f);
+  fclose(f);
+}
+
+// checks that the mailbox holds each of the mails once and intact
+void checkMailbox(const string &path, int mails)
+{
+  FILE *f = fopen(path.c_str(), "r");
+  if (!f)
+    panic("Cannot open %s (%s)", path.c_str(), strerror(errno));
+  vector<int> seen(mails, 0);
+  char line[LINE_SIZE];
+  int id = -1, next = 0;
+  while (fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "\r\n")] = '\0';
+    int subject;
+    if (sscanf(line, "Subject: lmtp %d", &subject) == 1 && subject >= 0 && subject < mails) {
+      if (id >= 0 && next != BODY_LINES)
+        panic("%s: mail %d has %d lines", path.c_str(), id, next);
+      id = subject;
+      next = -1; // the empty line after the header
+      seen[id]++;
+    } else if (id >= 0 && next == -1) {
+      next = 0;
+    } else if (id >= 0 && next < BODY_LINES) {
+      if (bodyLine(id, next) != line)
+        panic("%s: mail %d line %d is '%s'", path.c_str(), id, next, line);
+      next++;
+    }
+  }
+  fclose(f);
+  for (int i=0; i<mails; i++) {
+    if (seen[i] != 1)
+      panic("%s: mail %d is there %d times", path.c_str(), i, seen[i]);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 4)
+    panic("Syntax: %s <smtp binary> <lmtp port> <transactions>", argv[0]);
+  const char *binary = argv[1];
+  const char *port = argv[2];
+  int mails = atoi(argv[3]);
+
+  char dir[] = "/tmp/lmtp-test-XXXXXX";
+  if (!mkdtemp(dir))
+    panic("Cannot create a temporary directory (%s)", strerror(errno));
+  for (int i=0; i<USERS; i++)
+    writeFile(string(dir) + "/lmtp" + to_string(i) + ".mbox", "");
+  // a mailbox with room for nothing more than an empty mail
+  string full;
+  while (full.length() < QUOTA_KB * 1024 - 512)
+    full += "From <filler@localhost> Mon Oct 19 05:31:55 2026\nSubject: filler\n\n" + string(400, 'x') + "\n";
+  writeFile(string(dir) + "/full.mbox", full);
+
+  string quota = to_string(QUOTA_KB);
+  pid_t pid = startServer(binary, "-p", "0", "-q", quota.c_str(), "-d", port, dir, (char*)NULL);
+  struct connection conn;
+  initializeBuffers(&conn, 65536);
+  connectRetry(&conn, atoi(port));
+  expectLine(&conn, "220 localhost LMTP");
+  sendCommand(&conn, "HELO tester\r\n");
+  expectLine(&conn, "500");
+  sendCommand(&conn, "LHLO tester\r\n");
+  expectLine(&conn, "250-localhost");
+  expectLine(&conn, "250-PIPELINING");
+  expectLine(&conn, "250 SIZE");
+
+  int refused = 0;
+  for (int m=0; m<mails; m++) {
+    // recipients in order with the reply expected at RCPT, then after the dot
+    vector<string> rcpts;
+    vector<const char*> atRcpt, atDot;
+    for (int i=0; i<USERS; i++) {
+      rcpts.push_back("lmtp" + to_string((m + i) % USERS) + "@localhost");
+      atRcpt.push_back("250");
+      atDot.push_back("250");
+    }
+    if (m % 10 == 3) {
+      const char *unknown[] = {"nobody@localhost", "someone@example.com"};
+      for (int i=0; i<2; i++) {
+        rcpts.insert(rcpts.begin() + 2 + i, unknown[i]);
+        atRcpt.insert(atRcpt.begin() + 2 + i, "550");
+      }
+      rcpts.push_back("full@localhost");
+      atRcpt.push_back("250");
+      atDot.push_back("552");
+      refused++;
+    }
+    if (m % 10 == 7) {
+      rcpts.push_back(rcpts[0]);
+      atRcpt.push_back("250");
+      atDot.push_back("250");
+    }
+
+    string commands = "MAIL FROM:<tester@localhost>\r\n";
+    for (int i=0; i<(int)rcpts.size(); i++)
+      commands += "RCPT TO:<" + rcpts[i] + ">\r\n";
+    commands += "DATA\r\n";
+    sendCommand(&conn, commands.c_str());
+    expectLine(&conn, "250");
+    for (int i=0; i<(int)atRcpt.size(); i++)
+      expectLine(&conn, atRcpt[i]);
+    expectLine(&conn, "354");
+
+    string body = "Subject: lmtp " + to_string(m) + "\r\n\r\n";
+    for (int j=0; j<BODY_LINES; j++)
+      body += bodyLine(m, j) + "\r\n";
+    body += ".\r\n";
+    sendCommand(&conn, body.c_str());
+    for (int i=0; i<(int)atDot.size(); i++)
+      expectLine(&conn, atDot[i]);
+  }
+  sendCommand(&conn, "QUIT\r\n");
+  expectLine(&conn, "221");
+  closeConnection(&conn);
+  freeBuffers(&conn);
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+
+  for (int i=0; i<USERS; i++)
+    checkMailbox(string(dir) + "/lmtp" + to_string(i) + ".mbox", mails);
+  struct stat st;
+  stat((string(dir) + "/full.mbox").c_str(), &st);
+  if (st.st_size != (off_t)full.length())
+    panic("full.mbox changed from %d to %d bytes", (int)full.length(), (int)st.st_size);
+
+  printf("%d transactions: %d deliveries, %d refused for quota\n", mails, mails * USERS, refused);
+  string cleanup = string("rm -rf ") + dir;
+  system(cleanup.c_str());
+  return 0;
+}
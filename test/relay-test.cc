@@ -0,0 +1,310 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <map>
+#include <set>
+#include <string>
+
+#include "test.h"
+
+using namespace std;
+
+// Test for the smtp relay queue. This driver runs a sink SMTP server that
+// takes everything and records it, then sends mail for other hosts to an smtp
+// server started with -g 127.0.0.1:<sink port>, and waits for it to arrive
+// at the sink. Some recipients are refused by the sink for good (they must
+// not arrive) and some once with a 4xx (they must arrive on the retry).
+// Every other recipient must get its mail exactly once, unchanged, and the
+// relay must have reused its connections and pipelined its commands. Only
+// 127.0.0.1 may relay: a client connecting from 127.0.0.2 must get a 550 for
+// a recipient on another host.
+//
+//   ./smtp -p 2525 -g 127.0.0.1:2600 -y 127.0.0.1/32 /tmp/mb &
+//   test/relay-test 2525 2600 100
+
+const int WAIT_SECONDS = 60;
+
+struct Sink {
+  pthread_mutex_t lock;
+  map<string, int> received;  // "<id> <rcpt>" to times received
+  set<string> busy;           // recipients refused once already
+  int connections;
+  int pipelined;              // reads with more than one command in them
+  int retried;
+  int damaged;
+};
+
+Sink SINK;
+
+string expectedBody(int id)
+{
+  return "Subject: relay " + to_string(id) + "\r\n\r\n.line that starts with a dot\r\nlast line " + to_string(id) + "\r\n";
+}
+
+void reply(int fd, const char *text)
+{
+  int len = strlen(text);
+  if (write(fd, text, len) != len)
+    panic("Cannot write to relay connection (%s)", strerror(errno));
+}
+
+// mail data as received, dots unstuffed and the terminating line removed
+bool unstuff(const string &stuffed, string &data)
+{
+  size_t pos = 0;
+  while (pos < stuffed.length()) {
+    size_t nl = stuffed.find("\r\n", pos);
+    if (nl == string::npos)
+      return false;
+    if (stuffed[pos] == '.')
+      pos++;
+    data += stuffed.substr(pos, nl + 2 - pos);
+    pos = nl + 2;
+  }
+  return true;
+}
+
+void recordMail(const set<string> &rcpts, const string &stuffed)
+{
+  string data;
+  int id = -1;
+  if (!unstuff(stuffed, data) || sscanf(data.c_str(), "Subject: relay %d", &id) != 1 || data != expectedBody(id)) {
+    pthread_mutex_lock(&SINK.lock);
+    SINK.damaged++;
+    pthread_mutex_unlock(&SINK.lock);
+    return;
+  }
+  pthread_mutex_lock(&SINK.lock);
+  for (set<string>::iterator it = rcpts.begin(); it != rcpts.end(); it++)
+    SINK.received[to_string(id) + " " + *it]++;
+  pthread_mutex_unlock(&SINK.lock);
+}
+
+void *sinkSession(void *arg)
+{
+  int fd = (int)(long)arg;
+  reply(fd, "220 sink ready\r\n");
+  string in, data;
+  set<string> rcpts;
+  bool inData = false;
+  char buf[65536];
+
+  while (true) {
+    int r = read(fd, buf, sizeof(buf));
+    if (r <= 0)
+      break;
+    in.append(buf, r);
+
+    int commands = 0;
+    size_t nl;
+    while ((nl = in.find("\r\n")) != string::npos) {
+      string line = in.substr(0, nl);
+      in.erase(0, nl + 2);
+      if (inData) {
+        if (line == ".") {
+          recordMail(rcpts, data);
+          reply(fd, "250 OK\r\n");
+          inData = false;
+          rcpts.clear();
+          data.clear();
+        } else {
+          data += line + "\r\n";
+        }
+        continue;
+      }
+
+      commands++;
+      if (strncasecmp(line.c_str(), "EHLO", 4) == 0) {
+        reply(fd, "250-sink\r\n250-PIPELINING\r\n250 SIZE 10240000\r\n");
+      } else if (strncasecmp(line.c_str(), "MAIL FROM:", 10) == 0) {
+        rcpts.clear();
+        reply(fd, "250 OK\r\n");
+      } else if (strncasecmp(line.c_str(), "RCPT TO:<", 9) == 0) {
+        string rcpt = line.substr(9, line.find('>') - 9);
+        if (rcpt.compare(0, 7, "refused") == 0) {
+          reply(fd, "550 No such user\r\n");
+          continue;
+        }
+        pthread_mutex_lock(&SINK.lock);
+        bool busy = rcpt.compare(0, 4, "busy") == 0 && SINK.busy.insert(rcpt).second;
+        if (busy)
+          SINK.retried++;
+        pthread_mutex_unlock(&SINK.lock);
+        if (busy) {
+          reply(fd, "451 Try again later\r\n");
+        } else {
+          rcpts.insert(rcpt);
+          reply(fd, "250 OK\r\n");
+        }
+      } else if (strncasecmp(line.c_str(), "DATA", 4) == 0) {
+        if (rcpts.empty()) {
+          reply(fd, "554 No valid recipients\r\n");
+        } else {
+          inData = true;
+          reply(fd, "354 Go ahead\r\n");
+        }
+      } else if (strncasecmp(line.c_str(), "RSET", 4) == 0) {
+        rcpts.clear();
+        reply(fd, "250 OK\r\n");
+      } else if (strncasecmp(line.c_str(), "QUIT", 4) == 0) {
+        reply(fd, "221 Bye\r\n");
+        close(fd);
+        return NULL;
+      } else {
+        reply(fd, "500 Unknown command\r\n");
+      }
+    }
+    if (commands > 1) {
+      pthread_mutex_lock(&SINK.lock);
+      SINK.pipelined++;
+      pthread_mutex_unlock(&SINK.lock);
+    }
+  }
+  close(fd);
+  return NULL;
+}
+
+void *sinkServer(void *arg)
+{
+  int listenFd = (int)(long)arg;
+  while (true) {
+    int fd = accept(listenFd, NULL, NULL);
+    if (fd < 0)
+      continue;
+    pthread_mutex_lock(&SINK.lock);
+    SINK.connections++;
+    pthread_mutex_unlock(&SINK.lock);
+    pthread_t thread;
+    pthread_create(&thread, NULL, sinkSession, (void*)(long)fd);
+    pthread_detach(thread);
+  }
+  return NULL;
+}
+
+int startSink(int port)
+{
+  int fd = socket(PF_INET, SOCK_STREAM, 0);
+  const int REUSE = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &REUSE, sizeof(REUSE));
+  struct sockaddr_in addr;
+  bzero(&addr, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 10) < 0)
+    panic("Cannot listen on port %d (%s)", port, strerror(errno));
+  pthread_t thread;
+  pthread_create(&thread, NULL, sinkServer, (void*)(long)fd);
+  pthread_detach(thread);
+  return fd;
+}
+
+// checks that a client from an address outside the relay networks cannot relay
+void expectRelayDenied(int port)
+{
+  struct connection conn;
+  initializeBuffers(&conn, 5000);
+  conn.fd = socket(PF_INET, SOCK_STREAM, 0);
+  conn.bytesInBuffer = 0;
+  struct sockaddr_in addr;
+  bzero(&addr, sizeof(addr));
+  addr.sin_family = AF_INET;
+  inet_pton(AF_INET, "127.0.0.2", &addr.sin_addr);
+  if (conn.fd < 0 || bind(conn.fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    panic("Cannot bind to 127.0.0.2 (%s)", strerror(errno));
+  addr.sin_port = htons(port);
+  inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+  if (connect(conn.fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    panic("Cannot connect to port %d (%s)", port, strerror(errno));
+  expectLine(&conn, "220");
+  sendCommand(&conn, "HELO outsider\r\n");
+  expectLine(&conn, "250");
+  sendCommand(&conn, "MAIL FROM:<outsider@example.net>\r\n");
+  expectLine(&conn, "250");
+  sendCommand(&conn, "RCPT TO:<victim@example.com>\r\n");
+  expectLine(&conn, "550");
+  sendCommand(&conn, "QUIT\r\n");
+  expectLine(&conn, "221");
+  closeConnection(&conn);
+  freeBuffers(&conn);
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 4)
+    panic("Syntax: %s <smtp port> <sink port> <mails>", argv[0]);
+  int mails = atoi(argv[3]);
+  pthread_mutex_init(&SINK.lock, NULL);
+  startSink(atoi(argv[2]));
+  expectRelayDenied(atoi(argv[1]));
+
+  struct connection conn;
+  initializeBuffers(&conn, 5000);
+  connectToPort(&conn, atoi(argv[1]));
+  expectLine(&conn, "220");
+  sendCommand(&conn, "HELO tester\r\n");
+  expectLine(&conn, "250");
+
+  // every tenth mail also goes to a recipient the sink refuses, and to one it
+  // takes on the second try
+  set<string> expected;
+  for (int i=0; i<mails; i++) {
+    string rcpts[] = {"user" + to_string(i) + "@example.com", "other@example.org",
+                      "refused@example.com", "busy" + to_string(i) + "@example.com"};
+    int n = i % 10 == 5 ? 4 : 2;
+    sendCommand(&conn, "MAIL FROM:<tester@localhost>\r\n");
+    expectLine(&conn, "250");
+    for (int j=0; j<n; j++) {
+      sendCommand(&conn, ("RCPT TO:<" + rcpts[j] + ">\r\n").c_str());
+      expectLine(&conn, "250");
+      if (j != 2)
+        expected.insert(to_string(i) + " " + rcpts[j]);
+    }
+    sendCommand(&conn, "DATA\r\n");
+    expectLine(&conn, "354");
+    string body = "Subject: relay " + to_string(i) + "\r\n\r\n..line that starts with a dot\r\nlast line " + to_string(i) + "\r\n.\r\n";
+    sendCommand(&conn, body.c_str());
+    expectLine(&conn, "250");
+    sendCommand(&conn, "RSET\r\n");
+    expectLine(&conn, "250");
+  }
+  sendCommand(&conn, "QUIT\r\n");
+  expectLine(&conn, "221");
+  closeConnection(&conn);
+  freeBuffers(&conn);
+
+  // the busy recipients come after a backoff
+  int waited = 0;
+  while (true) {
+    pthread_mutex_lock(&SINK.lock);
+    int got = SINK.received.size();
+    pthread_mutex_unlock(&SINK.lock);
+    if (got >= (int)expected.size() || waited >= WAIT_SECONDS * 10)
+      break;
+    usleep(100000);
+    waited++;
+  }
+
+  pthread_mutex_lock(&SINK.lock);
+  for (set<string>::iterator it = expected.begin(); it != expected.end(); it++) {
+    if (SINK.received[*it] != 1)
+      panic("Mail '%s' arrived %d times", it->c_str(), SINK.received[*it]);
+  }
+  if (SINK.received.size() != expected.size())
+    panic("The sink got %d deliveries, expected %d", (int)SINK.received.size(), (int)expected.size());
+  if (SINK.damaged > 0)
+    panic("%d mails arrived damaged", SINK.damaged);
+  if (SINK.connections >= mails)
+    panic("%d connections for %d mails, they were not reused", SINK.connections, mails);
+  if (SINK.pipelined == 0)
+    panic("The relay did not pipeline its commands");
+  printf("%d mails: %d deliveries over %d connections, %d pipelined reads, %d retried\n",
+         mails, (int)SINK.received.size(), SINK.connections, SINK.pipelined, SINK.retried);
+  pthread_mutex_unlock(&SINK.lock);
+  return 0;
+}
@@ -0,0 +1,393 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <map>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "test.h"
+#include "record.h"
+
+using namespace std;
+
+// Plays session captures (smtp/pop3/maild -e) back against a server, each
+// session on its own connection, at the recorded pace or faster, and prints
+// one JSON object per verb and one for the whole run: throughput, latency
+// percentiles and how many replies were of another class than recorded.
+// With -b the output of an earlier run, e.g. of another build, is read and
+// the differences are printed with the numbers.
+//
+//   test/session-replay -s 2500 -p 11000 -x 10 -u replay capture > new.json
+//   test/session-replay -s 2500 -p 11000 -x 10 -u replay -b old.json capture
+//
+// Captures hold no addresses or mail: every accepted recipient becomes -u
+// at localhost, refused ones an unknown user, and mail data is filler of
+// the recorded size. pop3 sessions log in as -u with -w and read whatever
+// that mailbox holds, so it should have about as many messages as the
+// recorded ones; sessions on POP3S, and sessions from STARTTLS or STLS on,
+// are skipped. Sessions start as their time comes, at most -c at once; one
+// that would be over the limit waits for a session to end.
+
+const int BUFFER_SIZE = 1 << 20; // per running session
+const int LINE_SIZE = 1000;
+
+struct replaySession {
+  int64_t startMs;       // since the earliest session
+  int protocol;          // RECORD_*, -1 until its RECORD_OPEN entry is read
+  vector<RecordEntry> entries;
+};
+
+struct replayConfig {
+  int smtpPort;
+  int lmtpPort;
+  int pop3Port;
+  double speed;
+  const char *user;
+  const char *password;
+  int sessions;          // running at once
+};
+
+struct replayConfig cfg = {0, 0, 0, 1, "replay", "cis505", 256};
+pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sessionEnded = PTHREAD_COND_INITIALIZER;
+int running = 0;
+vector<double> latencies[RECORD_NUM_VERBS]; // us
+long mismatches = 0, skipped = 0, replayed = 0;
+double originNs;
+
+double nowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// waits until 'us' of recorded time after 'baseNs', scaled by the speed
+void waitUntil(double baseNs, double us)
+{
+  double due = baseNs + us * 1e3 / cfg.speed;
+  double now = nowNs();
+  if (due > now)
+    usleep((useconds_t)((due - now) / 1e3));
+}
+
+string base64(const string &in)
+{
+  const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  string out;
+  for (size_t i=0; i<in.length(); i+=3) {
+    unsigned n = (unsigned char)in[i] << 16;
+    if (i+1 < in.length()) n |= (unsigned char)in[i+1] << 8;
+    if (i+2 < in.length()) n |= (unsigned char)in[i+2];
+    out += alphabet[(n >> 18) & 63];
+    out += alphabet[(n >> 12) & 63];
+    out += i+1 < in.length() ? alphabet[(n >> 6) & 63] : '=';
+    out += i+2 < in.length() ? alphabet[n & 63] : '=';
+  }
+  return out;
+}
+
+// lines of filler adding up to 'bytes', CRLFs included
+string filler(uint32_t bytes)
+{
+  string data;
+  while (data.length() + 2 <= bytes) {
+    size_t n = min((size_t)bytes - data.length() - 2, (size_t)76);
+    data += string(n, 'x') + "\r\n";
+  }
+  return data;
+}
+
+// reads a reply and returns its class as recorded: the smtp code of the
+// last line, or 1/2/0 for +OK/+ /-ERR; the data of a pop3 multi-line reply
+// is read up to the dot
+int readReply(struct connection *conn, int protocol, bool multiLine)
+{
+  char line[LINE_SIZE];
+  if (protocol != RECORD_POP3) {
+    do {
+      if (!readLine(conn, line, sizeof(line)))
+        return -1;
+    } while (strlen(line) > 3 && line[3] == '-');
+    return atoi(line);
+  }
+  if (!readLine(conn, line, sizeof(line)))
+    return -1;
+  int reply = strncmp(line, "+OK", 3) == 0 ? 1 : strncmp(line, "+ ", 2) == 0 ? 2 : 0;
+  if (reply == 1 && multiLine) {
+    do {
+      if (!readLine(conn, line, sizeof(line)))
+        return -1;
+    } while (strcmp(line, ".") != 0);
+  }
+  return reply;
+}
+
+// the command to send for a recorded one, "" if the session cannot go on
+string commandFor(const RecordEntry &e, int protocol)
+{
+  string verb = RECORD_VERBS[e.verb];
+  string user = cfg.user;
+  if (verb == "HELO" || verb == "EHLO" || verb == "LHLO")
+    return verb + " replay\r\n";
+  if (verb == "MAIL")
+    return "MAIL FROM:<replay@localhost>\r\n";
+  if (verb == "RCPT")
+    return string("RCPT TO:<") + (e.reply >= 200 && e.reply < 300 ? user : "unknown-" + user) + "@localhost>\r\n";
+  if (verb == ".")
+    return ".\r\n";
+  if (verb == "USER")
+    return "USER " + user + "\r\n";
+  if (verb == "PASS")
+    return string("PASS ") + cfg.password + "\r\n";
+  if (verb == "AUTH")
+    return e.reply == 2 ? "AUTH PLAIN\r\n" : "AUTH PLAIN " + base64(string("\0", 1) + user + string("\0", 1) + cfg.password) + "\r\n";
+  if (verb == "SASL")
+    return base64(string("\0", 1) + user + string("\0", 1) + cfg.password) + "\r\n";
+  if (verb == "STARTTLS" || verb == "STLS")
+    return "";
+  if (verb == "OTHER")
+    return protocol == RECORD_POP3 ? "XOTHER\r\n" : "XOTHER replay\r\n";
+  string line = verb;
+  if (e.args > 0)
+    line += " " + to_string(e.arg);
+  if (e.args > 1)
+    line += " " + to_string(e.arg2);
+  return line + "\r\n";
+}
+
+// the port to replay a session of a protocol on, 0 if there is none
+int portFor(int protocol)
+{
+  return protocol == RECORD_SMTP ? cfg.smtpPort : protocol == RECORD_LMTP ? cfg.lmtpPort : protocol == RECORD_POP3 ? cfg.pop3Port : 0;
+}
+
+void *replay(void *arg)
+{
+  replaySession *s = (replaySession *)arg;
+  struct connection conn;
+  initializeBuffers(&conn, BUFFER_SIZE);
+  connectToPort(&conn, portFor(s->protocol));
+  double openedNs = nowNs();
+  readReply(&conn, s->protocol, false);
+
+  vector<double> mine[RECORD_NUM_VERBS];
+  long wrong = 0;
+  int accepted = 0; // LMTP: replies after the dot
+  bool ended = false, cut = false;
+  for (size_t i=0; i<s->entries.size() && !ended; i++) {
+    const RecordEntry &e = s->entries[i];
+    if (e.type == RECORD_DATA) {
+      sendCommand(&conn, filler(e.arg).c_str());
+      continue;
+    }
+    if (e.type != RECORD_COMMAND)
+      continue;
+    string command = commandFor(e, s->protocol);
+    if (command.empty()) {
+      cut = true;
+      break;
+    }
+    waitUntil(openedNs, e.offset_us);
+    string verb = RECORD_VERBS[e.verb];
+    bool multiLine = verb == "CAPA" || verb == "RETR" || verb == "TOP" || ((verb == "LIST" || verb == "UIDL") && e.args == 0);
+
+    double start = nowNs();
+    sendCommand(&conn, command.c_str());
+    int reply = readReply(&conn, s->protocol, multiLine);
+    for (int r=1; s->protocol == RECORD_LMTP && verb == "." && r < accepted; r++)
+      readReply(&conn, s->protocol, false);
+    mine[e.verb].push_back((nowNs() - start) / 1e3);
+
+    if (reply < 0)
+      ended = true;
+    else if (s->protocol == RECORD_POP3 ? reply != e.reply : reply / 100 != e.reply / 100)
+      wrong++;
+    if (verb == "MAIL" || verb == "RSET" || verb == ".")
+      accepted = 0;
+    else if (verb == "RCPT" && reply >= 200 && reply < 300)
+      accepted++;
+    if (verb == "QUIT")
+      ended = true;
+  }
+  closeConnection(&conn);
+  freeBuffers(&conn);
+
+  pthread_mutex_lock(&statsLock);
+  for (int v=0; v<RECORD_NUM_VERBS; v++)
+    latencies[v].insert(latencies[v].end(), mine[v].begin(), mine[v].end());
+  mismatches += wrong;
+  replayed++;
+  if (cut)
+    skipped++;
+  running--;
+  pthread_cond_signal(&sessionEnded);
+  pthread_mutex_unlock(&statsLock);
+  return NULL;
+}
+
+bool startsBefore(const replaySession *a, const replaySession *b)
+{
+  return a->startMs < b->startMs;
+}
+
+// reads the sessions of a capture file, 'first' is the earliest start so far;
+// a session whose RECORD_OPEN entry is missing keeps protocol -1
+void loadCapture(const char *path, map<string, replaySession> &sessions, int64_t &first)
+{
+  FILE *f = fopen(path, "r");
+  if (!f)
+    panic("Cannot open %s (%s)", path, strerror(errno));
+  RecordHeader h;
+  if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, RECORD_MAGIC, sizeof(h.magic)) != 0)
+    panic("%s is not a capture file", path);
+  RecordEntry e;
+  while (fread(&e, sizeof(e), 1, f) == 1) {
+    string key = string(path) + "#" + to_string(e.session);
+    map<string, replaySession>::iterator it = sessions.find(key);
+    if (it == sessions.end()) {
+      it = sessions.insert(make_pair(key, replaySession())).first;
+      it->second.startMs = 0;
+      it->second.protocol = -1;
+    }
+    replaySession &s = it->second;
+    if (e.type == RECORD_OPEN) {
+      s.startMs = h.start_ms + e.offset_us;
+      s.protocol = e.arg;
+      first = min(first, s.startMs);
+    } else {
+      s.entries.push_back(e);
+    }
+  }
+  fclose(f);
+}
+
+double percentile(vector<double> &v, double p)
+{
+  if (v.empty())
+    return 0;
+  return v[(size_t)(p * (v.size() - 1) + 0.5)];
+}
+
+// value of "key": in a JSON line, or -1
+double field(const string &line, const char *key)
+{
+  size_t at = line.find(string("\"") + key + "\":");
+  return at == string::npos ? -1 : atof(line.c_str() + at + strlen(key) + 3);
+}
+
+// the line of an earlier run for 'name', "" if there is none
+string baselineFor(const vector<string> &baseline, const string &name)
+{
+  for (size_t i=0; i<baseline.size(); i++)
+    if (baseline[i].find("{\"replay\":\"" + name + "\"") == 0)
+      return baseline[i];
+  return "";
+}
+
+// "," then the change of each key from the baseline line in percent
+string deltas(const string &old, const char **keys, const double *values, int n)
+{
+  string out;
+  for (int i=0; i<n && !old.empty(); i++) {
+    double before = field(old, keys[i]);
+    char buf[100];
+    if (before > 0) {
+      snprintf(buf, sizeof(buf), ",\"%s_delta_pct\":%.1f", keys[i], (values[i] - before) * 100 / before);
+      out += buf;
+    }
+  }
+  return out;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *baselinePath = NULL;
+  int c;
+  while ((c = getopt(argc, argv, "s:l:p:x:u:w:c:b:")) != -1) {
+    switch (c) {
+    case 's': cfg.smtpPort = atoi(optarg); break;
+    case 'l': cfg.lmtpPort = atoi(optarg); break;
+    case 'p': cfg.pop3Port = atoi(optarg); break;
+    case 'x': cfg.speed = atof(optarg); break;
+    case 'u': cfg.user = optarg; break;
+    case 'w': cfg.password = optarg; break;
+    case 'c': cfg.sessions = atoi(optarg); break;
+    case 'b': baselinePath = optarg; break;
+    default:
+      panic("Syntax: %s [-s smtp port] [-l lmtp port] [-p pop3 port] [-x speed] [-u user] [-w password] [-c sessions at once] [-b earlier output] capture...", argv[0]);
+    }
+  }
+  if (optind == argc || cfg.speed <= 0 || cfg.sessions <= 0)
+    panic("Syntax: %s [-s smtp port] [-l lmtp port] [-p pop3 port] [-x speed] [-u user] [-w password] [-c sessions at once] [-b earlier output] capture...", argv[0]);
+
+  vector<string> baseline;
+  if (baselinePath) {
+    FILE *f = fopen(baselinePath, "r");
+    if (!f)
+      panic("Cannot open %s (%s)", baselinePath, strerror(errno));
+    char line[LINE_SIZE];
+    while (fgets(line, sizeof(line), f))
+      baseline.push_back(line);
+    fclose(f);
+  }
+
+  map<string, replaySession> sessions;
+  int64_t first = INT64_MAX;
+  for (int i=optind; i<argc; i++)
+    loadCapture(argv[i], sessions, first);
+
+  vector<replaySession *> order;
+  for (map<string, replaySession>::iterator it = sessions.begin(); it != sessions.end(); it++) {
+    if (it->second.protocol < 0 || portFor(it->second.protocol) == 0) {
+      skipped++;
+      continue;
+    }
+    it->second.startMs -= first;
+    order.push_back(&it->second);
+  }
+  sort(order.begin(), order.end(), startsBefore);
+
+  originNs = nowNs();
+  for (size_t i=0; i<order.size(); i++) {
+    waitUntil(originNs, order[i]->startMs * 1e3);
+    pthread_mutex_lock(&statsLock);
+    while (running >= cfg.sessions)
+      pthread_cond_wait(&sessionEnded, &statsLock);
+    running++;
+    pthread_mutex_unlock(&statsLock);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, replay, order[i]) != 0)
+      panic("Cannot start a session thread (%s)", strerror(errno));
+    pthread_detach(thread);
+  }
+  pthread_mutex_lock(&statsLock);
+  while (running > 0)
+    pthread_cond_wait(&sessionEnded, &statsLock);
+  pthread_mutex_unlock(&statsLock);
+  double seconds = (nowNs() - originNs) / 1e9;
+
+  const char *keys[] = {"ops_per_s", "p50_us", "p99_us"};
+  vector<double> all;
+  for (int v=0; v<RECORD_NUM_VERBS; v++) {
+    if (latencies[v].empty())
+      continue;
+    sort(latencies[v].begin(), latencies[v].end());
+    all.insert(all.end(), latencies[v].begin(), latencies[v].end());
+    double values[] = {latencies[v].size() / seconds, percentile(latencies[v], 0.5), percentile(latencies[v], 0.99)};
+    printf("{\"replay\":\"%s\",\"ops\":%ld,\"ops_per_s\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f%s}\n", RECORD_VERBS[v],
+           (long)latencies[v].size(), values[0], values[1], values[2], deltas(baselineFor(baseline, RECORD_VERBS[v]), keys, values, 3).c_str());
+  }
+  sort(all.begin(), all.end());
+  double values[] = {all.size() / seconds, percentile(all, 0.5), percentile(all, 0.99)};
+  printf("{\"replay\":\"total\",\"sessions\":%ld,\"skipped\":%ld,\"ops\":%ld,\"seconds\":%.2f,\"ops_per_s\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"mismatches\":%ld%s}\n",
+         replayed, skipped, (long)all.size(), seconds, values[0], values[1], values[2], mismatches,
+         deltas(baselineFor(baseline, "total"), keys, values, 3).c_str());
+  return 0;
+}
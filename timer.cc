@@ -0,0 +1,186 @@
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <time.h>
+#include "timer.h"
+using namespace std;
+
+// each slot is a circular list with a sentinel head
+static Timer WHEEL[TIMER_LEVELS][TIMER_SLOTS];
+static uint64_t NOW = 0; // current tick
+static pthread_mutex_t wheel_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void unlink_timer(Timer* t){
+	if (t->next == NULL) return;
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+}
+
+static void link_timer(Timer* t){
+	uint64_t delta = t->expires > NOW ? t->expires - NOW : 0;
+	int level = 0;
+	uint64_t span = TIMER_SLOTS;
+	while (level < TIMER_LEVELS - 1 && delta >= span) {
+		level++;
+		span *= TIMER_SLOTS;
+	}
+	if (delta >= span) t->expires = NOW + span - 1; // clamp to the wheel range
+
+	// slot by absolute expiry, so cascading keeps relative order
+	int slot = (t->expires >> (6 * level)) & (TIMER_SLOTS - 1);
+	if (level == 0 && delta == 0) slot = (NOW + 1) & (TIMER_SLOTS - 1); // overdue: next tick
+	Timer* head = &WHEEL[level][slot];
+	t->next = head;
+	t->prev = head->prev;
+	head->prev->next = t;
+	head->prev = t;
+}
+
+// rounds up, plus one because the current tick is already partly over
+static uint64_t ticks_of(int64_t ms){
+	return (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS + 1;
+}
+
+void timer_set(Timer* t, int64_t ms){
+	pthread_mutex_lock(&wheel_mutex);
+	unlink_timer(t);
+	t->expires = NOW + ticks_of(ms);
+	link_timer(t);
+	pthread_mutex_unlock(&wheel_mutex);
+}
+
+void timer_cancel(Timer* t){
+	pthread_mutex_lock(&wheel_mutex);
+	unlink_timer(t);
+	pthread_mutex_unlock(&wheel_mutex);
+}
+
+// re-links every timer of a higher level slot, which lands it one level down
+static void cascade(int level){
+	int slot = (NOW >> (6 * level)) & (TIMER_SLOTS - 1);
+	Timer* head = &WHEEL[level][slot];
+	Timer list;
+	if (head->next == head) return;
+	list.next = head->next;
+	list.prev = head->prev;
+	list.next->prev = &list;
+	list.prev->next = &list;
+	head->next = head->prev = head;
+
+	while (list.next != &list) {
+		Timer* t = list.next;
+		unlink_timer(t);
+		link_timer(t);
+	}
+}
+
+static void tick(){
+	NOW++;
+	for (int level = 1; level < TIMER_LEVELS; level++) {
+		if ((NOW & ((1ULL << (6 * level)) - 1)) != 0) break;
+		cascade(level);
+	}
+
+	Timer* head = &WHEEL[0][NOW & (TIMER_SLOTS - 1)];
+	while (head->next != head) {
+		Timer* t = head->next;
+		unlink_timer(t);
+		int again = t->expire(t);
+		if (again > 0) {
+			t->expires = NOW + ticks_of(again);
+			link_timer(t);
+		}
+	}
+}
+
+static int64_t now_ms(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *timer_thread(void *arg){
+	int64_t next = now_ms() + TIMER_TICK_MS;
+	while (true) {
+		int64_t wait = next - now_ms();
+		if (wait > 0) usleep(wait * 1000);
+
+		// catch up on ticks missed while the machine was busy
+		pthread_mutex_lock(&wheel_mutex);
+		while (now_ms() >= next) {
+			tick();
+			next += TIMER_TICK_MS;
+		}
+		pthread_mutex_unlock(&wheel_mutex);
+	}
+	return NULL;
+}
+
+void timer_start(){
+	for (int level = 0; level < TIMER_LEVELS; level++) {
+		for (int slot = 0; slot < TIMER_SLOTS; slot++) {
+			WHEEL[level][slot].next = WHEEL[level][slot].prev = &WHEEL[level][slot];
+		}
+	}
+	pthread_t thread;
+	pthread_create(&thread, NULL, timer_thread, NULL);
+	pthread_detach(thread);
+}
+
+static int watchdog_expire(Timer* t){
+	Watchdog* w = (Watchdog*)t;
+	if (w->transfer) {
+		int64_t bytes = w->bytes.load(memory_order_relaxed);
+		int64_t needed = (int64_t)w->min_rate * (WATCHDOG_WINDOW_MS / 1000);
+		if (bytes > w->checked && bytes - w->checked >= needed) {
+			w->checked = bytes;
+			return WATCHDOG_WINDOW_MS;
+		}
+	}
+	w->expired.store(true);
+	send(w->fd, w->response, strlen(w->response), MSG_DONTWAIT | MSG_NOSIGNAL);
+	shutdown(w->fd, SHUT_RDWR);
+	return 0;
+}
+
+void watchdog_init(Watchdog* w, int fd, const char* response, int idle_ms, int min_rate){
+	w->timer.prev = w->timer.next = NULL;
+	w->timer.expire = watchdog_expire;
+	w->fd = fd;
+	w->response = response;
+	w->idle_ms = idle_ms;
+	w->min_rate = min_rate;
+	w->transfer = false;
+	w->bytes = 0;
+	w->checked = 0;
+	w->expired = false;
+	watchdog_idle(w);
+}
+
+// restarts the idle timeout, called before waiting for each command
+void watchdog_idle(Watchdog* w){
+	pthread_mutex_lock(&wheel_mutex);
+	w->transfer = false;
+	unlink_timer(&w->timer);
+	w->timer.expires = NOW + ticks_of(w->idle_ms);
+	link_timer(&w->timer);
+	pthread_mutex_unlock(&wheel_mutex);
+}
+
+// switches to rate checking, a no-op while a transfer is already running
+void watchdog_transfer(Watchdog* w){
+	if (w->transfer) return;
+	pthread_mutex_lock(&wheel_mutex);
+	w->transfer = true;
+	w->checked = w->bytes.load(memory_order_relaxed);
+	unlink_timer(&w->timer);
+	w->timer.expires = NOW + ticks_of(WATCHDOG_WINDOW_MS);
+	link_timer(&w->timer);
+	pthread_mutex_unlock(&wheel_mutex);
+}
+
+void watchdog_stop(Watchdog* w){
+	timer_cancel(&w->timer);
+}
@@ -0,0 +1,105 @@
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <string>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "tls.h"
+#include "metrics.h"
+#include "log.h"
+using namespace std;
+
+struct Tls {
+	SSL* ssl;
+};
+
+static SSL_CTX* CTX = NULL;
+static int M_HANDSHAKES, M_RESUMED, M_FAILED, M_KTLS, M_HANDSHAKE;
+
+void tls_init(const char* files){
+	M_HANDSHAKES = metrics_counter("tls_handshakes_total", "TLS handshakes completed.");
+	M_RESUMED = metrics_counter("tls_resumed_total", "TLS handshakes that resumed a session.");
+	M_FAILED = metrics_counter("tls_handshake_failures_total", "TLS handshakes that failed.");
+	M_KTLS = metrics_counter("tls_ktls_total", "TLS sessions sending through kernel TLS.");
+	M_HANDSHAKE = metrics_histogram("tls_handshake_duration_seconds", "Time to complete a TLS handshake.", NULL, NULL);
+
+	string cert = files, key = files;
+	size_t colon = cert.find(':');
+	if (colon != string::npos) {
+		key = cert.substr(colon + 1);
+		cert.erase(colon);
+	}
+	CTX = SSL_CTX_new(TLS_server_method());
+	if (CTX == NULL || SSL_CTX_use_certificate_chain_file(CTX, cert.c_str()) != 1
+			|| SSL_CTX_use_PrivateKey_file(CTX, key.c_str(), SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(CTX) != 1) {
+		cerr << "cannot load TLS certificate or key\r\n";
+		exit(2);
+	}
+	SSL_CTX_set_min_proto_version(CTX, TLS1_2_VERSION);
+
+	// resumption: by session id (TLS 1.2) from the cache, or by ticket; the
+	// ticket keys are made at startup and shared by every session
+	const unsigned char context[] = "maild";
+	SSL_CTX_set_session_id_context(CTX, context, sizeof(context) - 1);
+	SSL_CTX_set_session_cache_mode(CTX, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(CTX, TLS_CACHE_SIZE);
+	SSL_CTX_set_timeout(CTX, TLS_SESSION_TIMEOUT);
+	SSL_CTX_set_num_tickets(CTX, TLS_TICKETS);
+
+	// only used if OpenSSL was built with it and the kernel has the tls module
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL_CTX_set_options(CTX, SSL_OP_ENABLE_KTLS);
+#endif
+}
+
+bool tls_running(){
+	return CTX != NULL;
+}
+
+Tls* tls_accept(int fd){
+	int64_t start = metrics_now();
+	// tickets, then the greeting: Nagle would hold the second write back for
+	// the client's delayed ACK, and responses are batched already
+	const int NODELAY = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &NODELAY, sizeof(NODELAY));
+	SSL* ssl = SSL_new(CTX);
+	if (ssl == NULL || SSL_set_fd(ssl, fd) != 1 || SSL_accept(ssl) != 1) {
+		char reason[256];
+		ERR_error_string_n(ERR_get_error(), reason, sizeof(reason));
+		ERR_clear_error();
+		log_event(LOG_INFO, fd, "TLS handshake failed: ", reason);
+		metrics_add(M_FAILED, 1);
+		SSL_free(ssl);
+		return NULL;
+	}
+	metrics_observe(M_HANDSHAKE, metrics_now() - start);
+	metrics_add(M_HANDSHAKES, 1);
+	if (SSL_session_reused(ssl)) metrics_add(M_RESUMED, 1);
+#ifndef OPENSSL_NO_KTLS
+	if (BIO_get_ktls_send(SSL_get_wbio(ssl))) metrics_add(M_KTLS, 1);
+#endif
+	Tls* tls = new Tls;
+	tls->ssl = ssl;
+	return tls;
+}
+
+int tls_read(Tls* tls, char* buf, int len){
+	int r = SSL_read(tls->ssl, buf, len);
+	if (r <= 0) ERR_clear_error(); // the thread's error queue outlives the session
+	return r;
+}
+
+int tls_write(Tls* tls, const char* buf, int len){
+	int w = SSL_write(tls->ssl, buf, len);
+	if (w <= 0) ERR_clear_error();
+	return w;
+}
+
+void tls_close(Tls* tls){
+	SSL_shutdown(tls->ssl);
+	ERR_clear_error();
+	SSL_free(tls->ssl);
+	delete tls;
+}